@@ -24,6 +24,7 @@
 #include <iostream>
 #include "OpenHome.h"
 #include "gpio.h"
+#include "sim.h"
 
 /** Declare static data members */
 NVConData OpenHome::nvdata;
@@ -31,9 +32,16 @@ ConStatus OpenHome::status;
 ConStatus OpenHome::old_status;
 byte OpenHome::hw_type;
 
-byte OpenHome::nboards;
-byte OpenHome::nstations;
-byte OpenHome::station_bits[MAX_EXT_BOARDS+1];
+uint16_t OpenHome::nboards;
+uint16_t OpenHome::nstations;
+uint64_t OpenHome::station_bits[STATION_WORDS];
+uint64_t OpenHome::attrib_mas[STATION_WORDS];
+uint64_t OpenHome::attrib_igrn[STATION_WORDS];
+uint64_t OpenHome::attrib_mas2[STATION_WORDS];
+uint64_t OpenHome::attrib_dis[STATION_WORDS];
+uint64_t OpenHome::attrib_seq[STATION_WORDS];
+uint64_t OpenHome::attrib_spe[STATION_WORDS];
+SpecialStationEntry OpenHome::special_stations[MAX_NUM_STATIONS];
 
 ulong OpenHome::sensor_lasttime;
 ulong OpenHome::flowcount_log_start;
@@ -43,8 +51,12 @@ ulong OpenHome::raindelay_start_time;
 byte OpenHome::button_timeout;
 ulong OpenHome::checkwt_lasttime;
 ulong OpenHome::checkwt_success_lasttime;
+ulong OpenHome::options_gen = 0;
+ulong OpenHome::stations_gen = 0;
+ulong OpenHome::runtime_gen = 0;
+byte OpenHome::events = 0;
 
-char tmp_buffer[TMP_BUFFER_SIZE+1];       // scratch buffer
+thread_local char tmp_buffer[TMP_BUFFER_SIZE+1];       // scratch buffer
 
 const char wtopts_filename[] = WEATHER_OPTS_FILENAME;
 const char stns_filename[]   = STATION_ATTR_FILENAME;
@@ -98,7 +110,9 @@ const char op_json_names[] =
     "fpr0\0"
     "fpr1\0"
     "re\0\0\0"
-    "reset";
+    "reset"
+    "mash\0"
+    "mas2h";
 
 /** Option promopts (stored in progmem, for LCD display) */
 // Each string is strictly 16 characters
@@ -148,10 +162,12 @@ char op_promopts[] =
     "Pulse rate:     "
     "----------------"
     "As remote ext.? "
-    "Factory reset?  ";
+    "Factory reset?  "
+    "Mas1 high byte: "
+    "Mas2 high byte: ";
 
 /** Option maximum values (stored in progmem) */
-const char op_max[] = {
+const byte op_max[] = {
   0,
   108,
   1,
@@ -170,7 +186,7 @@ const char op_max[] = {
   MAX_EXT_BOARDS,
   1,
   247,
-  MAX_NUM_STATIONS,
+  255,  // master station, low byte (high byte in OPTION_MASTER_STATION_HI)
   60,
   120,
   255,
@@ -189,14 +205,16 @@ const char op_max[] = {
   255,
   255,
   1,
-  MAX_NUM_STATIONS,
+  255,  // master2 station, low byte
   60,
   120,
   0,
   255,
   255,
   1,
-  1
+  1,
+  MAX_NUM_STATIONS>>8,
+  MAX_NUM_STATIONS>>8
 };
 
 /** Option values (stored in RAM) */
@@ -245,7 +263,9 @@ byte OpenHome::options[] = {
   100,// this and next byte define flow pulse rate (100x)
   0,
   0,  // set as remote extension
-  0   // reset
+  0,  // reset
+  0,  // index of master station, high byte
+  0   // index of master2 station, high byte
 };
 
 /** Weekday strings (stored in progmem, for LCD display) */
@@ -260,7 +280,11 @@ static const char days_str[] PROGMEM =
 
 /** Calculate local time (UTC time plus time zone offset) */
 time_t OpenHome::now_tz() {
-  return now()+(int32_t)3600/4*(int32_t)(options[OPTION_TIMEZONE]-48);
+  return now()+tz_offset();
+}
+
+int32_t OpenHome::tz_offset() {
+  return (int32_t)3600/4*(int32_t)(options[OPTION_TIMEZONE]-48);
 }
 
 #include "etherport.h"
@@ -270,7 +294,7 @@ time_t OpenHome::now_tz() {
 #include "server.h"
 
 extern EthernetServer *m_server;
-extern char ether_buffer[];
+extern thread_local char ether_buffer[];
 
 /** Initialize network with the given mac address and http port */
 byte OpenHome::start_network() {
@@ -293,6 +317,7 @@ void OpenHome::reboot_dev() {
 #if defined(DEMO)
   // do nothing
 #else
+  nvm_flush();  // write back pending nvm changes
   sync(); // add sync to prevent file corruption
 	reboot(RB_AUTOBOOT);
 #endif
@@ -345,14 +370,15 @@ void OpenHome::begin() {
  */
 void OpenHome::apply_all_station_bits() {
   //digitalWrite(PIN_SR_LATCH, LOW);
-  byte bid, s, sbits;
+  uint16_t bid;
+  byte s, sbits;
   std::cout << "Applying all station bits" << std::endl;
 
   // Shift out all station bit values
   // from the highest bit to the lowest
   for(bid=0;bid<=MAX_EXT_BOARDS;bid++) {
     if (status.enabled)
-      sbits = station_bits[MAX_EXT_BOARDS-bid];
+      sbits = board_bits(station_bits, MAX_EXT_BOARDS-bid);
     else
       sbits = 0;
 
@@ -365,50 +391,100 @@ void OpenHome::apply_all_station_bits() {
   }
 }
 
+/** Nvm address of a station name
+ * The legacy stations keep theirs where older firmware did,
+ * the others are in the extension area */
+int OpenHome::station_name_addr(uint16_t sid) {
+  if(sid<LEGACY_NUM_STATIONS) return ADDR_NVM_STN_NAMES+(int)sid*STATION_NAME_SIZE;
+  return ADDR_NVM_EXT_STN_NAMES+(int)(sid-LEGACY_NUM_STATIONS)*STATION_NAME_SIZE;
+}
+
 /** Get station name from NVM */
-void OpenHome::get_station_name(byte sid, char tmp[]) {
+void OpenHome::get_station_name(uint16_t sid, char tmp[]) {
   tmp[STATION_NAME_SIZE]=0;
-  nvm_read_block(tmp, (void*)(ADDR_NVM_STN_NAMES+(int)sid*STATION_NAME_SIZE), STATION_NAME_SIZE);
+  nvm_read_block(tmp, (void*)station_name_addr(sid), STATION_NAME_SIZE);
 }
 
 /** Set station name to NVM */
-void OpenHome::set_station_name(byte sid, char tmp[]) {
+void OpenHome::set_station_name(uint16_t sid, char tmp[]) {
   tmp[STATION_NAME_SIZE]=0;
-  nvm_write_block(tmp, (void*)(ADDR_NVM_STN_NAMES+(int)sid*STATION_NAME_SIZE), STATION_NAME_SIZE);
+  nvm_write_block(tmp, (void*)station_name_addr(sid), STATION_NAME_SIZE);
+  stations_gen++;
+}
+
+/** Map an attribute nvm address (start of the bit field) to its RAM copy */
+uint64_t* OpenHome::attrib_bits_ptr(int addr) {
+  switch(addr) {
+  case ADDR_NVM_MAS_OP:     return attrib_mas;
+  case ADDR_NVM_IGNRAIN:    return attrib_igrn;
+  case ADDR_NVM_MAS_OP_2:   return attrib_mas2;
+  case ADDR_NVM_STNDISABLE: return attrib_dis;
+  case ADDR_NVM_STNSEQ:     return attrib_seq;
+  case ADDR_NVM_STNSPE:     return attrib_spe;
+  default: return NULL;
+  }
+}
+
+/** Extension area address of the attribute bits past the legacy boards */
+static int attrib_ext_addr(int addr) {
+  return ADDR_NVM_EXT_ATTRIBS+(addr-ADDR_NVM_MAS_OP)/(LEGACY_EXT_BOARDS+1)*EXT_ATTRIB_BYTES;
 }
 
-/** Save station attribute bits to NVM */
+/** Save station attribute bits (MAX_EXT_BOARDS+1 bytes) to NVM and update the RAM copy */
 void OpenHome::station_attrib_bits_save(int addr, byte bits[]) {
-  nvm_write_block(bits, (void*)addr, MAX_EXT_BOARDS+1);
+  nvm_write_block(bits, (void*)addr, LEGACY_EXT_BOARDS+1);
+  nvm_write_block(bits+LEGACY_EXT_BOARDS+1, (void*)attrib_ext_addr(addr), EXT_ATTRIB_BYTES);
+  uint64_t *ram = attrib_bits_ptr(addr);
+  if(ram) {
+    for(uint16_t bid=0;bid<=MAX_EXT_BOARDS;bid++) board_bits_set(ram, bid, bits[bid]);
+  }
+  stations_gen++;
 }
 
-/** Load all station attribute bits from NVM */
+/** Load all station attribute bits (MAX_EXT_BOARDS+1 bytes) */
 void OpenHome::station_attrib_bits_load(int addr, byte bits[]) {
-  nvm_read_block(bits, (void*)addr, MAX_EXT_BOARDS+1);
+  uint64_t *ram = attrib_bits_ptr(addr);
+  if(ram) {
+    for(uint16_t bid=0;bid<=MAX_EXT_BOARDS;bid++) bits[bid] = board_bits(ram, bid);
+  } else {
+    nvm_read_block(bits, (void*)addr, LEGACY_EXT_BOARDS+1);
+    nvm_read_block(bits+LEGACY_EXT_BOARDS+1, (void*)attrib_ext_addr(addr), EXT_ATTRIB_BYTES);
+  }
+}
+
+/** Load the RAM copy of all station attribute bits from NVM */
+void OpenHome::attribs_load() {
+  static const int addrs[] = {ADDR_NVM_MAS_OP, ADDR_NVM_IGNRAIN, ADDR_NVM_MAS_OP_2,
+                              ADDR_NVM_STNDISABLE, ADDR_NVM_STNSEQ, ADDR_NVM_STNSPE};
+  byte bits[MAX_EXT_BOARDS+1];
+  for(byte i=0;i<sizeof(addrs)/sizeof(addrs[0]);i++) {
+    nvm_read_block(bits, (void*)addrs[i], LEGACY_EXT_BOARDS+1);
+    nvm_read_block(bits+LEGACY_EXT_BOARDS+1, (void*)attrib_ext_addr(addrs[i]), EXT_ATTRIB_BYTES);
+    uint64_t *ram = attrib_bits_ptr(addrs[i]);
+    for(uint16_t bid=0;bid<=MAX_EXT_BOARDS;bid++) board_bits_set(ram, bid, bits[bid]);
+  }
 }
 
-/** Read one station attribute byte from NVM */
-byte OpenHome::station_attrib_bits_read(int addr) {
-  return nvm_read_byte((byte*)addr);
+/** Give the stations past the legacy ones default names (Sxx) and attributes
+ * (master operation and sequential bits set, as after a factory reset) */
+void OpenHome::stations_ext_reset() {
+  for(uint16_t sid=LEGACY_NUM_STATIONS;sid<MAX_NUM_STATIONS;sid++) {
+    snprintf(tmp_buffer, TMP_BUFFER_SIZE, "S%02d", sid+1);
+    nvm_write_block(tmp_buffer, (void*)station_name_addr(sid), strlen(tmp_buffer)+1);
+  }
+  memset(tmp_buffer, 0xff, TMP_BUFFER_SIZE);
+  for(int i=0;i<EXT_ATTRIB_BYTES;i+=TMP_BUFFER_SIZE) {
+    int nbytes = (EXT_ATTRIB_BYTES-i>TMP_BUFFER_SIZE) ? TMP_BUFFER_SIZE : (EXT_ATTRIB_BYTES-i);
+    nvm_write_block(tmp_buffer, (void*)(attrib_ext_addr(ADDR_NVM_MAS_OP)+i), nbytes);
+    nvm_write_block(tmp_buffer, (void*)(attrib_ext_addr(ADDR_NVM_STNSEQ)+i), nbytes);
+  }
 }
 
 /** verify if a string matches password */
 byte OpenHome::password_verify(char *pw) {
-  byte *addr = (byte*)ADDR_NVM_PASSWORD;
-  byte c1, c2;
-  while(1) {
-    if(addr == (byte*)ADDR_NVM_PASSWORD+MAX_USER_PASSWORD)
-      c1 = 0;
-    else
-      c1 = nvm_read_byte(addr++);
-    c2 = *pw++;
-    if (c1==0 || c2==0)
-      break;
-    if (c1!=c2) {
-      return 0;
-    }
-  }
-  return (c1==c2) ? 1 : 0;
+  char stored[MAX_USER_PASSWORD+1];
+  nvm_read_string(stored, (void*)ADDR_NVM_PASSWORD, sizeof(stored));
+  return strcmp(stored, pw)==0 ? 1 : 0;
 }
 
 // ==================
@@ -423,24 +499,65 @@ byte OpenHome::weekday_today() {
 }
 
 /** Switch special station */
-void OpenHome::switch_special_station(byte sid, byte value) {
+void OpenHome::switch_special_station(uint16_t sid, byte value) {
+  if (sim_active()) return;  // a simulation has no effects outside
   // check station special bit
-  if(station_attrib_bits_read(ADDR_NVM_STNSPE+(sid>>3))&(1<<(sid&0x07))) {
-    // read station special data from sd card
-    int stepsize=sizeof(StationSpecialData);
-    read_from_file(stns_filename, tmp_buffer, stepsize, sid*stepsize);
-    StationSpecialData *stn = (StationSpecialData *)tmp_buffer;
+  if(sid<MAX_NUM_STATIONS && station_bit(attrib_spe, sid)) {
+    SpecialStationEntry *stn = special_stations+sid;
     // check station type
     if(stn->type==STN_TYPE_GPIO) {
       // set GPIO pin
       std::cout << "Switching gpio pin# " << stn->data << " to value = " << value << std::endl;
 
-      switch_gpiostation((GPIOStationData *)stn->data, value);
+      switch_gpiostation(stn, value);
     } else if(stn->type==STN_TYPE_HTTP) {
       // send GET command
-      switch_httpstation((HTTPStationData *)stn->data, value);
+      switch_httpstation(stn, value);
+    }
+  }
+}
+
+/** Decode the special data of one station into the RAM table */
+void OpenHome::special_station_update(uint16_t sid, const StationSpecialData *data) {
+  if(sid>=MAX_NUM_STATIONS) return;
+  SpecialStationEntry *stn = special_stations+sid;
+  stations_gen++;
+  memset(stn, 0, sizeof(SpecialStationEntry));
+  stn->type = data->type;
+  strncpy(stn->data, (const char*)data->data, STATION_SPECIAL_DATA_SIZE-1);
+
+  if(stn->type==STN_TYPE_GPIO) {
+    // two ascii digits of pin number, followed by active level
+    stn->gpio = (stn->data[0] - '0') * 10 + (stn->data[1] - '0');
+    stn->active = stn->data[2] - '0';
+  } else if(stn->type==STN_TYPE_HTTP) {
+    // server,port,on_cmd,off_cmd
+    strcpy(stn->tokens, stn->data);
+    stn->server = strtok(stn->tokens, ",");
+    char *port = strtok(NULL, ",");
+    stn->on_cmd = strtok(NULL, ",");
+    stn->off_cmd = strtok(NULL, ",");
+    if(port) stn->port = atoi(port);
+    else stn->server = NULL;
+  }
+}
+
+/** Load special data of all stations from the station file */
+void OpenHome::special_stations_load() {
+  int stepsize=sizeof(StationSpecialData);
+  StationSpecialData *stn = (StationSpecialData *)tmp_buffer;
+  FILE *file = fopen(get_filename_fullpath(stns_filename), "rb");
+  for(uint16_t sid=0;sid<MAX_NUM_STATIONS;sid++) {
+    // each record is read the same way as read_from_file does
+    tmp_buffer[0] = 0;
+    if(file) {
+      fseek(file, sid*stepsize, SEEK_SET);
+      if(!fgets(tmp_buffer, stepsize, file)) tmp_buffer[0] = 0;
     }
+    tmp_buffer[stepsize-1] = 0;
+    special_station_update(sid, stn);
   }
+  if(file) fclose(file);
 }
 
 /** Set station bit
@@ -448,13 +565,15 @@ void OpenHome::switch_special_station(byte sid, byte value) {
  * You have to call apply_all_station_bits next to apply the bits
  * (which results in physical actions of opening/closing valves).
  */
-byte OpenHome::set_station_bit(byte sid, byte value) {
-  byte *data = station_bits+(sid>>3);  // pointer to the station byte
-  byte mask = (byte)1<<(sid&0x07); // mask
+byte OpenHome::set_station_bit(uint16_t sid, byte value) {
+  uint64_t *data = station_bits+(sid>>6);  // pointer to the station word
+  uint64_t mask = (uint64_t)1<<(sid&63); // mask
   if (value) {
     if((*data)&mask) return 0;  // if bit is already set, return no change
     else {
       (*data) = (*data) | mask;
+      runtime_gen++;
+      events |= EVENT_STATIONS;
       switch_special_station(sid, 1); // handle special stations
       return 1;
     }
@@ -462,6 +581,8 @@ byte OpenHome::set_station_bit(byte sid, byte value) {
     if(!((*data)&mask)) return 0; // if bit is already reset, return no change
     else {
       (*data) = (*data) & (~mask);
+      runtime_gen++;
+      events |= EVENT_STATIONS;
       switch_special_station(sid, 0); // handle special stations
       return 255;
     }
@@ -471,9 +592,11 @@ byte OpenHome::set_station_bit(byte sid, byte value) {
 
 /** Clear all station bits */
 void OpenHome::clear_all_station_bits() {
-  byte sid;
-  for(sid=0;sid<=MAX_NUM_STATIONS;sid++) {
-    set_station_bit(sid, 0);
+  // only the words with bits set are visited
+  for(uint16_t w=0;w<STATION_WORDS;w++) {
+    while(station_bits[w]) {
+      set_station_bit(w*64+__builtin_ctzll(station_bits[w]), 0);
+    }
   }
 }
 
@@ -527,16 +650,14 @@ int rf_gpio_fd = -1;
  * Special data for GPIO Station is three bytes of ascii decimal (not hex)
  * First two bytes are zero padded GPIO pin number.
  * Third byte is either 0 or 1 for active low (GND) or high (+5V) relays
+ * The pin and active level are decoded by special_station_update
  */
-void OpenHome::switch_gpiostation(GPIOStationData *data, bool turnon) {
-  byte gpio = (data->pin[0] - '0') * 10 + (data->pin[1] - '0');
-  byte activeState = data->active - '0';
-
-  pinMode(gpio, OUTPUT);
+void OpenHome::switch_gpiostation(SpecialStationEntry *stn, bool turnon) {
+  pinMode(stn->gpio, OUTPUT);
   if (turnon)
-    digitalWrite(gpio, activeState);
+    digitalWrite(stn->gpio, stn->active);
   else
-    digitalWrite(gpio, 1-activeState);
+    digitalWrite(stn->gpio, 1-stn->active);
 }
 
 
@@ -596,16 +717,17 @@ static void switchhttp_callback(byte status, uint16_t off, uint16_t len) {
 }
 
 /** Switch http station
- * This function takes an http station code,
- * parses it into a server name and two HTTP GET requests.
+ * This function takes a decoded http station entry
+ * and sends the on or off HTTP GET request to its server.
  */
-void OpenHome::switch_httpstation(HTTPStationData *data, bool turnon) {
+void OpenHome::switch_httpstation(SpecialStationEntry *stn, bool turnon) {
 
-  char * server = strtok((char *)data->data, ",");
-  char * port = strtok(NULL, ",");
-  char * on_cmd = strtok(NULL, ",");
-  char * off_cmd = strtok(NULL, ",");
-  char * cmd = turnon ? on_cmd : off_cmd;
+  char * server = stn->server;
+  char * cmd = turnon ? stn->on_cmd : stn->off_cmd;
+  if (!server || !cmd) {
+    DEBUG_PRINTLN("invalid http station data");
+    return;
+  }
 
   EthernetClient client;
   struct hostent *host;
@@ -617,7 +739,7 @@ void OpenHome::switch_httpstation(HTTPStationData *data, bool turnon) {
     return;
   }
 
-  if (!client.connect((uint8_t*)host->h_addr, atoi(port))) {
+  if (!client.connect((uint8_t*)host->h_addr, stn->port)) {
     client.stop();
     return;
   }
@@ -659,6 +781,9 @@ void OpenHome::options_setup() {
     // ======== Reset NVM data ========
     int i, sn;
 
+    // the whole reset is committed as one nvm generation
+    nvm_begin();
+
     // 0. wipe out nvm
     for(i=0;i<TMP_BUFFER_SIZE;i++) tmp_buffer[i]=0;
     for(i=0;i<NVM_SIZE;i+=TMP_BUFFER_SIZE) {
@@ -694,22 +819,32 @@ void OpenHome::options_setup() {
     }
     // 4. reset station attribute bits
     // since we wiped out nvm, only non-zero attributes need to be initialized
-    for(i=0;i<MAX_EXT_BOARDS+1;i++) {
+    for(i=0;i<LEGACY_EXT_BOARDS+1;i++) {
       tmp_buffer[i]=0xff;
     }
-    nvm_write_block(tmp_buffer, (void*)ADDR_NVM_MAS_OP, MAX_EXT_BOARDS+1);
-    nvm_write_block(tmp_buffer, (void*)ADDR_NVM_STNSEQ, MAX_EXT_BOARDS+1);
+    nvm_write_block(tmp_buffer, (void*)ADDR_NVM_MAS_OP, LEGACY_EXT_BOARDS+1);
+    nvm_write_block(tmp_buffer, (void*)ADDR_NVM_STNSEQ, LEGACY_EXT_BOARDS+1);
+    // names and attributes of the stations in the extension area
+    stations_ext_reset();
 
     // 5. delete sd file
     remove_file(wtopts_filename);
+    remove_file(PROGRAMS_FILENAME);
 
     // 6. write options
     options_save(); // write default option values
 
+    nvm_commit();
+
     //======== END OF NVM RESET CODE ========
 
     // restart after resetting NVM.
     delay(500);
+  } else if (nvm_get_loaded_size() < NVM_SIZE) {
+    // nvm written by firmware without the extension area
+    nvm_begin();
+    stations_ext_reset();
+    nvm_commit();
   }
 
   {
@@ -719,6 +854,12 @@ void OpenHome::options_setup() {
 
     // load non-volatile controller data
     nvdata_load();
+
+    // load station attribute bits
+    attribs_load();
+
+    // load special station data
+    special_stations_load();
   }
 }
 
@@ -743,6 +884,7 @@ void OpenHome::options_load() {
   nstations = nboards * 8;
   status.enabled = options[OPTION_DEVICE_ENABLE];
   options[OPTION_FW_MINOR] = OS_FW_MINOR;
+  masters_load();
 }
 
 /** Save options to internal NVM */
@@ -755,6 +897,16 @@ void OpenHome::options_save() {
   nboards = options[OPTION_EXT_BOARDS]+1;
   nstations = nboards * 8;
   status.enabled = options[OPTION_DEVICE_ENABLE];
+  options_gen++;
+}
+
+/** Set the master stations from the options
+ * Each is kept as index+1 in two option bytes (0 for none). */
+void OpenHome::masters_load() {
+  status.mas = options[OPTION_MASTER_STATION] | (uint16_t)options[OPTION_MASTER_STATION_HI]<<8;
+  status.mas2= options[OPTION_MASTER_STATION_2] | (uint16_t)options[OPTION_MASTER_STATION_2_HI]<<8;
+  if (status.mas > MAX_NUM_STATIONS)  status.mas = 0;
+  if (status.mas2 > MAX_NUM_STATIONS) status.mas2 = 0;
 }
 
 // ==============================
@@ -764,6 +916,7 @@ void OpenHome::options_save() {
 /** Enable controller operation */
 void OpenHome::enable() {
   status.enabled = 1;
+  events |= EVENT_STATUS;
   options[OPTION_DEVICE_ENABLE] = 1;
   options_save();
 }
@@ -771,6 +924,7 @@ void OpenHome::enable() {
 /** Disable controller operation */
 void OpenHome::disable() {
   status.enabled = 0;
+  events |= EVENT_STATUS;
   options[OPTION_DEVICE_ENABLE] = 0;
   options_save();
 }
@@ -778,6 +932,7 @@ void OpenHome::disable() {
 /** Start rain delay */
 void OpenHome::raindelay_start() {
   status.rain_delayed = 1;
+  events |= EVENT_STATUS;
   nvdata_save();
 }
 
@@ -785,5 +940,6 @@ void OpenHome::raindelay_start() {
 void OpenHome::raindelay_stop() {
   status.rain_delayed = 0;
   nvdata.rd_stop_time = 0;
+  events |= EVENT_STATUS;
   nvdata_save();
 }
\ No newline at end of file
@@ -68,6 +68,19 @@ struct HTTPStationData {
   byte data[STATION_SPECIAL_DATA_SIZE];
 };
 
+/** Decoded special station data, kept in RAM so switching needs no file access or parsing */
+struct SpecialStationEntry {
+  byte type;        // station type, same as StationSpecialData
+  byte gpio;        // gpio station: pin number
+  byte active;      // gpio station: active level
+  uint16_t port;    // http station: server port
+  char *server;     // http station: server name, points into tokens
+  char *on_cmd;     // http station: on command, points into tokens
+  char *off_cmd;    // http station: off command, points into tokens
+  char data[STATION_SPECIAL_DATA_SIZE];   // special data as stored in the station file
+  char tokens[STATION_SPECIAL_DATA_SIZE]; // tokenized copy of data
+};
+
 /** Volatile controller status bits */
 struct ConStatus {
   byte enabled:1;           // operation enable (when set, controller operation is enabled)
@@ -82,13 +95,44 @@ struct ConStatus {
   byte req_network:1;       // request check network
   byte display_board:3;     // the board that is being displayed onto the lcd
   byte network_fails:3;     // number of network fails
-  byte mas:8;               // master station index
-  byte mas2:8;              // master2 station index
+  uint16_t mas;             // master station index+1, 0 if none
+  uint16_t mas2;            // master2 station index+1, 0 if none
+};
+
+/** Station bit sets, one bit per station in 64-bit words
+ * Bit sid&63 of word sid>>6 belongs to station sid. Byte bid of the set
+ * (see board_bits) holds the 8 stations of board bid, as in nvm and json.
+ */
+#define STATION_WORDS  (MAX_NUM_STATIONS/64)
+
+inline bool station_bit(const uint64_t bits[], uint16_t sid) {
+  return (bits[sid>>6]>>(sid&63))&1;
+}
+
+inline byte board_bits(const uint64_t bits[], uint16_t bid) {
+  return (byte)(bits[bid>>3]>>((bid&7)*8));
+}
+
+inline void board_bits_set(uint64_t bits[], uint16_t bid, byte v) {
+  int shift = (bid&7)*8;
+  bits[bid>>3] = (bits[bid>>3]&~((uint64_t)0xFF<<shift)) | ((uint64_t)v<<shift);
+}
+
+/** Main loop timing, in microseconds past the deadline of each scheduler pass */
+struct SchedulerStats {
+  ulong wakeups;          // main loop passes
+  ulong runs;             // scheduler passes
+  ulong late_sum;
+  ulong late_max;
+  ulong switches;         // scheduler passes that turned stations on or off
+  ulong switch_late_sum;
+  ulong switch_late_max;
 };
+extern SchedulerStats sched_stats;
 
 extern const char wtopts_filename[];
 extern const char stns_filename[];
-extern const char op_max[];
+extern const byte op_max[];
 extern const char op_json_names[];
 
 class OpenHome {
@@ -102,14 +146,25 @@ public:
   static NVConData nvdata;
   static ConStatus status;
   static ConStatus old_status;
-  static byte nboards, nstations;
+  static uint16_t nboards, nstations;
   static byte hw_type;           // hardware type
 
   static byte options[];  // option values, max, name, and flag
 
-  static byte station_bits[];     // station activation bits. each byte corresponds to a board (8 stations)
+  static uint64_t station_bits[]; // station activation bits, one per station (see station_bit)
                                   // first byte-> master controller, second byte-> ext. board 1, and so on
 
+  // station attribute bits, cached in RAM, one per station
+  // they are only changed through station_attrib_bits_save
+  static uint64_t attrib_mas[];   // master1 operation bits
+  static uint64_t attrib_igrn[];  // ignore rain bits
+  static uint64_t attrib_mas2[];  // master2 operation bits
+  static uint64_t attrib_dis[];   // station disable bits
+  static uint64_t attrib_seq[];   // station sequential bits
+  static uint64_t attrib_spe[];   // station special bits
+
+  static SpecialStationEntry special_stations[]; // decoded special station data
+
   // variables for time keeping
   static ulong sensor_lasttime;  // time when the last sensor reading is recorded
   static ulong flowcount_time_ms;// time stamp when new flow sensor click is received (in milliseconds)
@@ -119,6 +174,12 @@ public:
   static byte  button_timeout;        // button timeout
   static ulong checkwt_lasttime;      // time when weather was checked
   static ulong checkwt_success_lasttime; // time when weather check was successful
+
+  // generation counters, bumped whenever the data they cover changes (they make the http ETags)
+  static ulong options_gen;       // options
+  static ulong stations_gen;      // station names, attributes and special data
+  static ulong runtime_gen;       // station bits and the run-time queue
+  static byte events;             // state changed since the last event broadcast (EVENT_* bits)
   // member functions
   // -- setup
   static void update_dev();   // update software for Linux instances
@@ -126,17 +187,20 @@ public:
   static void begin();        // initialization, must call this function before calling other functions
   static byte start_network();  // initialize network with the given mac and port
   static time_t now_tz();
+  static int32_t tz_offset();  // seconds local time is ahead of utc
   // -- station names and attributes
-  static void get_station_name(byte sid, char buf[]); // get station name
-  static void set_station_name(byte sid, char buf[]); // set station name
+  static void get_station_name(uint16_t sid, char buf[]); // get station name
+  static void set_station_name(uint16_t sid, char buf[]); // set station name
   static uint16_t parse_rfstation_code(RFStationData *data, ulong *on, ulong *off); // parse rf code into on/off/time sections
   static void switch_rfstation(RFStationData *data, bool turnon);  // switch rf station
   static void switch_remotestation(RemoteStationData *data, bool turnon); // switch remote station
-  static void switch_gpiostation(GPIOStationData *data, bool turnon); // switch gpio station
-  static void switch_httpstation(HTTPStationData *data, bool turnon); // switch http station
-  static void station_attrib_bits_save(int addr, byte bits[]); // save station attribute bits to nvm
-  static void station_attrib_bits_load(int addr, byte bits[]); // load station attribute bits from nvm
-  static byte station_attrib_bits_read(int addr); // read one station attribte byte from nvm
+  static void switch_gpiostation(SpecialStationEntry *stn, bool turnon); // switch gpio station
+  static void switch_httpstation(SpecialStationEntry *stn, bool turnon); // switch http station
+  static void special_stations_load(); // load and decode all special station data from the station file
+  static void special_station_update(uint16_t sid, const StationSpecialData *data); // decode special data of one station
+  static void station_attrib_bits_save(int addr, byte bits[]); // save station attribute bits (a byte per board) to nvm
+  static void station_attrib_bits_load(int addr, byte bits[]); // load station attribute bits (a byte per board) from nvm
+  static void attribs_load();     // load all station attribute bits from nvm into RAM
 
   // -- options and data storeage
   static void nvdata_load();
@@ -145,6 +209,7 @@ public:
   static void options_setup();
   static void options_load();
   static void options_save();
+  static void masters_load();     // set status.mas and status.mas2 from the options
 
   static byte password_verify(char *pw);  // verify password
 
@@ -157,10 +222,14 @@ public:
   static int detect_exp();        // detect the number of expansion boards
   static byte weekday_today();    // returns index of today's weekday (Monday is 0)
 
-  static byte set_station_bit(byte sid, byte value); // set station bit of one station (sid->station index, value->0/1)
-  static void switch_special_station(byte sid, byte value); // swtich special station
+  static byte set_station_bit(uint16_t sid, byte value); // set station bit of one station (sid->station index, value->0/1)
+  static void switch_special_station(uint16_t sid, byte value); // swtich special station
   static void clear_all_station_bits(); // clear all station bits
   static void apply_all_station_bits(); // apply all station bits (activate/deactive values)
+private:
+  static uint64_t* attrib_bits_ptr(int addr); // RAM copy of the attribute bits stored at nvm address addr
+  static int station_name_addr(uint16_t sid); // nvm address of a station name
+  static void stations_ext_reset(); // default names and attributes of the stations past the legacy ones
 };
 
 #endif  // _OpenHome_H
@@ -10,10 +10,17 @@ while getopts ":s" opt; do
 done
 echo "Building OpenHome..."
 
-if [ "$1" == "demo" ]; then
-	g++ -o OpenHome -Wno-int-to-pointer-cast -DDEMO main.cpp OpenHome.cpp program.cpp server.cpp utils.cpp weather.cpp gpio.cpp etherport.cpp -lpthread
+if [ "$1" == "bench" ]; then
+	g++ -o httpbench httpbench.cpp -lpthread
+elif [ "$1" == "jsonbench" ]; then
+	g++ -o jsonbench -Wno-int-to-pointer-cast -DDEMO jsonbench.cpp OpenHome.cpp program.cpp utils.cpp weather.cpp sim.cpp gpio.cpp etherport.cpp -lpthread -lz
+elif [ "$1" == "test" ]; then
+	"$0" demo && tests/run.sh ./OpenHome
+	exit $?
+elif [ "$1" == "demo" ]; then
+	g++ -o OpenHome -Wno-int-to-pointer-cast -DDEMO main.cpp OpenHome.cpp program.cpp server.cpp utils.cpp weather.cpp sim.cpp gpio.cpp etherport.cpp -lpthread -lz
 else
-	g++ -o OpenHome -Wno-int-to-pointer-cast -DOSPI -DPINE main.cpp OpenHome.cpp program.cpp server.cpp utils.cpp weather.cpp gpio.cpp etherport.cpp -lpthread
+	g++ -o OpenHome -Wno-int-to-pointer-cast -DOSPI -DPINE main.cpp OpenHome.cpp program.cpp server.cpp utils.cpp weather.cpp sim.cpp gpio.cpp etherport.cpp -lpthread -lz
 fi
 
 # if [ ! "$SILENT" = true ] && [ -f OpenHome.launch ] && [ ! -f /etc/init.d/OpenHome.sh ]; then
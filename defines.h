@@ -47,6 +47,7 @@
 /** File names */
 #define WEATHER_OPTS_FILENAME "wtopts.txt"    // weather options file
 #define STATION_ATTR_FILENAME "stns.dat"      // station attributes data file
+#define PROGRAMS_FILENAME     "progs.dat"     // program store file
 #define STATION_SPECIAL_DATA_SIZE  (TMP_BUFFER_SIZE - 8)
 
 #define FLOWCOUNT_RT_WINDOW   30    // flow count window (for computing real-time flow rate), 30 seconds
@@ -69,10 +70,18 @@
 // But they can be increased if needed
 #define NVM_FILENAME        "nvm.dat" // for RPI/BBB, nvm data is stored in a file
 
-#define MAX_EXT_BOARDS    6  // maximum number of exp. boards (each expands 8 stations)
+#define MAX_EXT_BOARDS    255 // maximum number of exp. boards (each expands 8 stations)
 #define MAX_NUM_STATIONS  ((1+MAX_EXT_BOARDS)*8)  // maximum number of stations
 
-#define NVM_SIZE            4096
+// the first stations keep the nvm layout of older firmware,
+// the ones past them live in the nvm extension area
+#define LEGACY_EXT_BOARDS   6
+#define LEGACY_NUM_STATIONS ((1+LEGACY_EXT_BOARDS)*8)
+#define EXT_ATTRIB_BYTES    (MAX_EXT_BOARDS-LEGACY_EXT_BOARDS)  // attribute bytes of each field in the extension area
+
+#define NVM_LEGACY_SIZE     4096  // nvm size of older firmware
+#define NVM_SIZE            (ADDR_NVM_EXT_STN_NAMES+(MAX_NUM_STATIONS-LEGACY_NUM_STATIONS)*STATION_NAME_SIZE)
+#define NVM_FLUSH_INTERVAL  5     // default seconds between nvm write-backs
 #define STATION_NAME_SIZE   24    // maximum number of characters in each station name
 
 #define MAX_PROGRAMDATA     2438  // program data
@@ -92,13 +101,17 @@
 #define ADDR_NVM_WEATHERURL    (ADDR_NVM_JAVASCRIPTURL+MAX_JAVASCRIPTURL)
 #define ADDR_NVM_WEATHER_KEY   (ADDR_NVM_WEATHERURL+MAX_WEATHERURL)
 #define ADDR_NVM_STN_NAMES     (ADDR_NVM_WEATHER_KEY+MAX_WEATHER_KEY)
-#define ADDR_NVM_MAS_OP        (ADDR_NVM_STN_NAMES+MAX_NUM_STATIONS*STATION_NAME_SIZE) // master op bits
-#define ADDR_NVM_IGNRAIN       (ADDR_NVM_MAS_OP+(MAX_EXT_BOARDS+1))  // ignore rain bits
-#define ADDR_NVM_MAS_OP_2      (ADDR_NVM_IGNRAIN+(MAX_EXT_BOARDS+1)) // master2 op bits
-#define ADDR_NVM_STNDISABLE    (ADDR_NVM_MAS_OP_2+(MAX_EXT_BOARDS+1))// station disable bits
-#define ADDR_NVM_STNSEQ        (ADDR_NVM_STNDISABLE+(MAX_EXT_BOARDS+1))// station sequential bits
-#define ADDR_NVM_STNSPE        (ADDR_NVM_STNSEQ+(MAX_EXT_BOARDS+1)) // station special bits (i.e. non-standard stations)
-#define ADDR_NVM_OPTIONS       (ADDR_NVM_STNSPE+(MAX_EXT_BOARDS+1))  // options
+#define ADDR_NVM_MAS_OP        (ADDR_NVM_STN_NAMES+LEGACY_NUM_STATIONS*STATION_NAME_SIZE) // master op bits
+#define ADDR_NVM_IGNRAIN       (ADDR_NVM_MAS_OP+(LEGACY_EXT_BOARDS+1))  // ignore rain bits
+#define ADDR_NVM_MAS_OP_2      (ADDR_NVM_IGNRAIN+(LEGACY_EXT_BOARDS+1)) // master2 op bits
+#define ADDR_NVM_STNDISABLE    (ADDR_NVM_MAS_OP_2+(LEGACY_EXT_BOARDS+1))// station disable bits
+#define ADDR_NVM_STNSEQ        (ADDR_NVM_STNDISABLE+(LEGACY_EXT_BOARDS+1))// station sequential bits
+#define ADDR_NVM_STNSPE        (ADDR_NVM_STNSEQ+(LEGACY_EXT_BOARDS+1)) // station special bits (i.e. non-standard stations)
+#define ADDR_NVM_OPTIONS       (ADDR_NVM_STNSPE+(LEGACY_EXT_BOARDS+1))  // options
+
+/** NVM extension area addresses (past the nvm size of older firmware) */
+#define ADDR_NVM_EXT_ATTRIBS   (NVM_LEGACY_SIZE)  // attribute bits of boards past the legacy ones, same order as above
+#define ADDR_NVM_EXT_STN_NAMES (ADDR_NVM_EXT_ATTRIBS+6*EXT_ATTRIB_BYTES) // names of stations past the legacy ones
 
 /** Default password, location string, weather key, script urls */
 #define DEFAULT_PASSWORD          "Undine12"
@@ -156,6 +169,8 @@ typedef enum {
   OPTION_PULSE_RATE_1,
   OPTION_REMOTE_EXT_MODE,
   OPTION_RESET,
+  OPTION_MASTER_STATION_HI,
+  OPTION_MASTER_STATION_2_HI,
   NUM_OPTIONS	// total number of options
 } OS_OPTION_t;
 
@@ -166,6 +181,13 @@ typedef enum {
 #define LOGDATA_WATERLEVEL 0x03
 #define LOGDATA_FLOWSENSE  0x04
 
+/** Controller state pushed to event stream subscribers (OpenHome::events) */
+#define EVENT_STATUS       0x01   // enabled, rain delay, rain sensor
+#define EVENT_STATIONS     0x02   // station bits
+#define EVENT_QUEUE        0x04   // run-time queue and last run
+#define EVENT_WEATHER      0x08   // weather query results
+#define EVENT_ALL          0x0F
+
 #undef OS_HW_VERSION
 
 #define PIN_FREE_LIST		{5,6,7,8,9,10,11,12,13,16,18,19,20,21,23,24,25,26}
@@ -186,6 +208,18 @@ typedef enum {
 
 
 #define ETHER_BUFFER_SIZE   16384
+#define ETHER_REQUEST_SIZE  262144 // largest request: a full /cs at MAX_NUM_STATIONS, names url-encoded
+#define ETHER_MAX_CONNECTIONS 64    // maximum number of concurrent http connections
+#define ETHER_MAX_STREAMS     48    // connections that may be event streams
+#define ETHER_STREAM_BACKLOG  65536 // bytes an event stream may fall behind before it is dropped
+#define ETHER_READ_TIMEOUT    3     // seconds allowed to receive a request
+#define ETHER_WRITE_TIMEOUT   10    // seconds allowed to send a response
+#define ETHER_IDLE_TIMEOUT    15    // seconds an idle kept-alive connection stays open
+#define ETHER_MAX_SEGMENTS    16    // pieces of a response sent with one call
+#define ETHER_STATS_TAGS      32    // response statistics slots
+#define ETHER_GZIP_LEVEL      1     // zlib level of compressed responses (1 fastest .. 9 smallest, 0 off)
+#define ETHER_GZIP_MIN_SIZE   1024  // bytes a response body must reach to be compressed
+#define HTTP_MAX_WORKERS      8     // maximum number of http worker threads
 
 #define DEBUG_BEGIN(x)          {}  /** Serial debug functions */
 #define ENABLE_DEBUG
@@ -200,7 +234,8 @@ typedef enum {
 
 inline void itoa(int v,char *s,int b)   {sprintf(s,"%d",v);}
 inline void ultoa(unsigned long v,char *s,int b) {sprintf(s,"%lu",v);}
-#define now()       time(0)
+time_t clock_time();
+#define now()       clock_time()
 
 /** Re-define avr-specific (e.g. PGM) types to use standard types */
 #define pgm_read_byte(x) *(x)
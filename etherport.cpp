@@ -25,93 +25,1243 @@
 #include "etherport.h"
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <netinet/in.h>
+#include <linux/tcp.h>
+#include <sys/uio.h>
 #include <string.h>
 #include <errno.h>
+#include <zlib.h>
 #include "defines.h"
+#include "utils.h"
+
+/** Server side connection
+ * EthernetServer drives each connection through a small state machine
+ * with non-blocking sockets and a single epoll set:
+ *   READING  - receiving the request: headers, then the body if any
+ *                (or idle, waiting for the next request on a kept-alive connection)
+ *   READY    - a complete request is waiting to be handled
+ *   HANDLING - handed out by available(); writes are buffered
+ *   DONE     - handler is done; waiting for the main loop to pick it up
+ *   WRITING  - the response is sent as the socket allows
+ * Every state but HANDLING has a deadline, after which the connection is
+ * dropped, so a slow or idle client never holds up the main loop.
+ * A HANDLING connection may be owned by another thread, which only moves
+ * it to DONE; sockets and the epoll set are only touched by the main loop.
+ *
+ * Connections are kept open (HTTP/1.1 keep-alive) unless the client asks
+ * otherwise: once a response is sent, the connection goes back to READING.
+ * Requests are served one at a time, in order, so pipelined requests
+ * simply wait in the receive buffer. Responses are framed with a
+ * Content-Length header, added when the handler is done.
+ *
+ * A response is a list of segments: static header lines are referenced,
+ * not copied, and the data written by the handler is collected in the
+ * transmit buffer. The framing header is a segment of its own, placed
+ * where the handler ended its headers. The segments go out with one
+ * sendmsg (writev) call, unless the socket buffer fills up.
+ *
+ * When the client accepts gzip or deflate, a body that grows past
+ * ether_gzip_min_size is compressed as the handler writes it: what is
+ * buffered so far goes through the compressor, and so does every
+ * following write. The stream is finished when the handler is done.
+ * The compressor is kept for the connection's next responses.
+ *
+ * An event stream is a response that does not end: once its headers
+ * and first data are sent, the connection stays open, and broadcast()
+ * appends to all streams at once. Streams are never compressed and have
+ * no Content-Length. A stream that cannot keep up with the broadcasts
+ * is closed, so a slow client never holds up the main loop; clients
+ * reconnect and start over from the current state.
+ */
+#define CONN_FREE      0
+#define CONN_READING   1
+#define CONN_READY     2
+#define CONN_HANDLING  3
+#define CONN_DONE      4
+#define CONN_WRITING   5
+#define CONN_STREAM    6	// event stream, waiting for broadcasts
+
+#define ENC_NONE       0
+#define ENC_GZIP       1
+#define ENC_DEFLATE    2
+
+int ether_gzip_level = ETHER_GZIP_LEVEL;
+size_t ether_gzip_min_size = ETHER_GZIP_MIN_SIZE;
+
+struct TxSegment {
+	const char *ptr;	// static data, or NULL for data in the transmit buffer
+	size_t off;	// offset in the transmit buffer
+	size_t len;
+};
+
+struct EthernetConnection {
+	int fd;
+	byte state;
+	int epfd;
+	int evfd;	// eventfd that wakes up the main loop
+	unsigned long deadline;	// millis
+	char *rx;	// receive buffer, grows up to ETHER_REQUEST_SIZE for a large request
+	int rx_len, rx_cap;
+	int req_len;	// length of the request handed out (chunked body decoded)
+	int req_raw;	// length of the request as received, pipelined requests follow it
+	bool keepalive;	// keep the connection open after the response
+	bool continued;	// "100 Continue" sent for the current request
+	bool streaming;	// the response is an event stream
+	bool out_wait;	// waiting for the socket to become writable
+	byte encoding;	// content coding the client accepts for the current request
+	char *tx;	// transmit buffer, holds what the handler writes
+	size_t tx_len, tx_cap;
+	TxSegment seg[ETHER_MAX_SEGMENTS];	// the response
+	int nseg;
+	int seg_next;	// first segment not completely sent
+	size_t seg_off;	// bytes of it already sent
+	int hdr_seg;	// segment where the body starts, -1 if not marked
+	bool no_body;	// the response has no body (304), nor a Content-Length
+	size_t body_off;	// where the body starts in the transmit buffer
+	bool deflating;	// the body is being compressed
+	z_stream *zs;	// compressor, NULL until a response needs one
+	byte zs_encoding;	// format the compressor was set up for
+	char frame[128];	// framing headers
+	int tag;	// statistics slot of the response
+	unsigned int syscalls;	// send calls for the response
+	unsigned int segs_out;	// tcp data segments sent before the response
+};
+
+static EthernetStats stats[ETHER_STATS_TAGS];
+static int nstreams = 0;	// connections that are event streams
+
+/** Connection state, as published by the thread that handled it */
+static inline byte conn_state(EthernetConnection *conn)
+{
+	return __atomic_load_n(&conn->state, __ATOMIC_ACQUIRE);
+}
+
+/** Resize the receive buffer; it keeps what has been received */
+static bool conn_rx_resize(EthernetConnection *conn, int cap)
+{
+	char *rx = (char *) realloc(conn->rx, cap);
+	if (!rx)
+		return false;
+	conn->rx = rx;
+	conn->rx_cap = cap;
+	return true;
+}
+
+/** Give back the room a large request took, once the buffer holds less again */
+static void conn_rx_shrink(EthernetConnection *conn)
+{
+	if (conn->rx_cap > ETHER_BUFFER_SIZE && conn->rx_len < ETHER_BUFFER_SIZE)
+		conn_rx_resize(conn, ETHER_BUFFER_SIZE);
+}
+
+static void conn_close(EthernetConnection *conn)
+{
+	if (conn->state == CONN_FREE)
+		return;
+	if (conn->streaming)
+	{
+		__atomic_fetch_sub(&nstreams, 1, __ATOMIC_RELAXED);
+		conn->streaming = false;
+	}
+	epoll_ctl(conn->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+	free(conn->tx);
+	conn->tx = NULL;
+	conn->tx_len = conn->tx_cap = 0;
+	conn->nseg = conn->seg_next = 0;
+	conn->rx_len = 0;
+	conn_rx_shrink(conn);
+	if (conn->zs)
+	{
+		deflateEnd(conn->zs);
+		free(conn->zs);
+		conn->zs = NULL;
+	}
+	conn->state = CONN_FREE;
+}
+
+/** Length of the headers of the first request in the receive buffer, 0 if not complete */
+static int conn_header_len(EthernetConnection *conn)
+{
+	int len = 0;
+	char *end = (char *) memmem(conn->rx, conn->rx_len, "\r\n\r\n", 4);
+	if (end)
+		len = end - conn->rx + 4;
+	end = (char *) memmem(conn->rx, len ? len : conn->rx_len, "\n\n", 2);
+	if (end)
+		len = end - conn->rx + 2;
+	return len;
+}
+
+/** Value of a request header, or NULL; len is set to the length of the value */
+static const char *conn_header(const char *req, int hdr_len, const char *name, int *len)
+{
+	int name_len = strlen(name);
+	const char *end = req + hdr_len;
+	const char *p = (const char *) memchr(req, '\n', hdr_len);	// skip the request line
+	while (p && ++p < end)
+	{
+		const char *eol = (const char *) memchr(p, '\n', end - p);
+		if (!eol)
+			break;
+		if (eol - p > name_len && p[name_len] == ':' && strncasecmp(p, name, name_len) == 0)
+		{
+			const char *v = p + name_len + 1;
+			while (v < eol && (*v == ' ' || *v == '\t'))
+				v++;
+			const char *e = eol;
+			while (e > v && (e[-1] == '\r' || e[-1] == ' '))
+				e--;
+			*len = e - v;
+			return v;
+		}
+		p = eol;
+	}
+	return NULL;
+}
+
+/** Whether a header value contains a token (case insensitive) */
+static bool header_has(const char *value, int len, const char *token)
+{
+	char buf[64];
+	if (len > (int) sizeof(buf) - 1)
+		len = sizeof(buf) - 1;
+	memcpy(buf, value, len);
+	buf[len] = 0;
+	return strcasestr(buf, token) != NULL;
+}
+
+/** Whether the connection is to be kept open after the request
+ *  HTTP/1.1 keeps it unless asked not to, HTTP/1.0 only when asked to */
+static bool conn_keepalive(const char *req, int hdr_len)
+{
+	const char *eol = (const char *) memchr(req, '\n', hdr_len);
+	if (!eol)
+		return false;
+	bool keep = memmem(req, eol - req, "HTTP/1.1", 8) != NULL;
+	int len;
+	const char *v = conn_header(req, hdr_len, "Connection", &len);
+	if (v && header_has(v, len, "close"))
+		keep = false;
+	else if (v && header_has(v, len, "keep-alive"))
+		keep = true;
+	return keep;
+}
+
+/** Content coding for the response: gzip or deflate if the client accepts it
+ *  (a coding listed with q=0 is refused), gzip preferred */
+static byte conn_encoding(const char *req, int hdr_len)
+{
+	int len;
+	const char *v = conn_header(req, hdr_len, "Accept-Encoding", &len);
+	if (!v || ether_gzip_level <= 0)
+		return ENC_NONE;
+	bool gzip = false, deflate = false;
+	const char *end = v + len;
+	while (v < end)
+	{
+		const char *comma = (const char *) memchr(v, ',', end - v);
+		const char *e = comma ? comma : end;
+		while (v < e && *v == ' ')
+			v++;
+		const char *semi = (const char *) memchr(v, ';', e - v);
+		const char *name_end = semi ? semi : e;
+		while (name_end > v && name_end[-1] == ' ')
+			name_end--;
+		bool refused = false;
+		if (semi)
+		{
+			const char *q = semi + 1;
+			while (q < e && *q == ' ')
+				q++;
+			if (e - q >= 2 && (q[0] == 'q' || q[0] == 'Q') && q[1] == '=')
+				refused = (strtod(q + 2, NULL) <= 0);
+		}
+		int n = name_end - v;
+		if (!refused)
+		{
+			if ((n == 4 && !strncasecmp(v, "gzip", 4)) || (n == 1 && *v == '*'))
+				gzip = true;
+			else if (n == 7 && !strncasecmp(v, "deflate", 7))
+				deflate = true;
+		}
+		v = e + 1;
+	}
+	return gzip ? ENC_GZIP : deflate ? ENC_DEFLATE : ENC_NONE;
+}
+
+/** Check a chunked body at rx+hdr_len; once it is complete, decode it in place
+ *  Returns the encoded length of the body, 0 if it is not complete, -1 if malformed */
+static int conn_chunked(EthernetConnection *conn, int hdr_len, int *body_len)
+{
+	char *start = conn->rx + hdr_len, *end = conn->rx + conn->rx_len;
+	char *p = start, *eol, *q;
+	// find the end of the body without changing anything
+	while (true)
+	{
+		if (!(eol = (char *) memchr(p, '\n', end - p)))
+			return 0;
+		unsigned long size = strtoul(p, &q, 16);
+		if (q == p || size > ETHER_REQUEST_SIZE)
+			return -1;
+		p = eol + 1;
+		if (!size)
+			break;
+		if (end - p < (long) size + 1)
+			return 0;
+		p += size;
+		if (*p == '\r')
+			p++;
+		if (p >= end)
+			return 0;
+		if (*p++ != '\n')
+			return -1;
+	}
+	// optional trailer headers, up to an empty line
+	while (true)
+	{
+		if (!(eol = (char *) memchr(p, '\n', end - p)))
+			return 0;
+		bool empty = (eol == p || (eol == p + 1 && *p == '\r'));
+		p = eol + 1;
+		if (empty)
+			break;
+	}
+	int raw = p - start;
+	// move the chunks' data together
+	char *src = start, *dst = start;
+	while (true)
+	{
+		unsigned long size = strtoul(src, NULL, 16);
+		src = (char *) memchr(src, '\n', end - src) + 1;
+		if (!size)
+			break;
+		memmove(dst, src, size);
+		dst += size;
+		src += size;
+		if (*src == '\r')
+			src++;
+		src++;
+	}
+	*body_len = dst - start;
+	return raw;
+}
+
+/** Answer "Expect: 100-continue" once the headers are in */
+static void conn_continue(EthernetConnection *conn, int hdr_len)
+{
+	int len;
+	const char *v = conn_header(conn->rx, hdr_len, "Expect", &len);
+	if (conn->continued || !v || !header_has(v, len, "100-continue"))
+		return;
+	static const char resp[] = "HTTP/1.1 100 Continue\r\n\r\n";
+	::send(conn->fd, resp, sizeof(resp) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+	conn->continued = true;
+}
+
+/** Check whether the first request in the receive buffer is complete,
+ *  headers and body (Content-Length or chunked, decoded in place).
+ *  Returns 1 when it is (req_len and req_raw are set), 0 if more is to
+ *  be received, or the HTTP status for a request that cannot be served */
+static int conn_parse(EthernetConnection *conn)
+{
+	int hdr_len = conn_header_len(conn);
+	if (!hdr_len)
+		return (conn->rx_len >= ETHER_REQUEST_SIZE - 1) ? 431 : 0;
+	int len;
+	const char *v = conn_header(conn->rx, hdr_len, "Transfer-Encoding", &len);
+	if (v && header_has(v, len, "chunked"))
+	{
+		int body_len = 0;
+		int raw = conn_chunked(conn, hdr_len, &body_len);
+		if (raw < 0)
+			return 400;
+		if (!raw)
+		{
+			if (conn->rx_len >= ETHER_REQUEST_SIZE - 1)
+				return 413;
+			conn_continue(conn, hdr_len);
+			return 0;
+		}
+		conn->req_len = hdr_len + body_len;
+		conn->req_raw = hdr_len + raw;
+		return 1;
+	}
+	long body_len = 0;
+	if ((v = conn_header(conn->rx, hdr_len, "Content-Length", &len)))
+		body_len = strtol(v, NULL, 10);
+	if (body_len < 0)
+		return 400;
+	if (body_len > ETHER_REQUEST_SIZE - 1 - hdr_len)
+		return 413;	// the whole request must fit in the receive buffer
+	if (conn->rx_len < hdr_len + body_len)
+	{
+		conn_continue(conn, hdr_len);
+		return 0;
+	}
+	conn->req_len = conn->req_raw = hdr_len + body_len;
+	return 1;
+}
+
+/** A request is complete: stop watching the socket until the response
+ *  is sent, and queue the request */
+static void conn_ready(EthernetConnection *conn)
+{
+	struct epoll_event ev = {0};
+	ev.data.ptr = conn;
+	epoll_ctl(conn->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+	int hdr_len = conn_header_len(conn);
+	conn->keepalive = conn_keepalive(conn->rx, hdr_len);
+	conn->encoding = conn_encoding(conn->rx, hdr_len);
+	conn->continued = false;
+	conn->state = CONN_READY;
+}
+
+/** Make room for size more bytes in the transmit buffer */
+static bool conn_reserve(EthernetConnection *conn, size_t size)
+{
+	if (conn->tx_len + size <= conn->tx_cap)
+		return true;
+	size_t cap = conn->tx_cap ? conn->tx_cap : ETHER_BUFFER_SIZE;
+	while (cap < conn->tx_len + size)
+		cap *= 2;
+	char *tx = (char *) realloc(conn->tx, cap);
+	if (!tx)
+		return false;
+	conn->tx = tx;
+	conn->tx_cap = cap;
+	return true;
+}
+
+/** Start a new response */
+static void conn_tx_reset(EthernetConnection *conn)
+{
+	conn->tx_len = 0;
+	conn->nseg = conn->seg_next = 0;
+	conn->seg_off = 0;
+	conn->hdr_seg = -1;
+	conn->no_body = false;
+	conn->body_off = 0;
+	conn->deflating = false;
+	conn->tag = 0;
+	conn->syscalls = 0;
+}
+
+/** Add size bytes, placed at the end of the transmit buffer, to the response */
+static bool conn_tx_add(EthernetConnection *conn, size_t size)
+{
+	if (!size)
+		return true;
+	TxSegment *last = conn->nseg ? conn->seg + conn->nseg - 1 : NULL;
+	if (last && !last->ptr && last->off + last->len == conn->tx_len && conn->nseg != conn->hdr_seg)
+	{
+		last->len += size;	// continues the last segment, on the same side of the headers' end
+	}
+	else
+	{
+		if (conn->nseg == ETHER_MAX_SEGMENTS - 1)	// one is kept for the framing headers
+			return false;
+		TxSegment *seg = conn->seg + conn->nseg++;
+		seg->ptr = NULL;
+		seg->off = conn->tx_len;
+		seg->len = size;
+	}
+	conn->tx_len += size;
+	return true;
+}
+
+/** Append data to the response, copied into the transmit buffer */
+static bool conn_tx_copy(EthernetConnection *conn, const void *buf, size_t size)
+{
+	if (!conn_reserve(conn, size))
+		return false;
+	memcpy(conn->tx + conn->tx_len, buf, size);
+	return conn_tx_add(conn, size);
+}
+
+/** Compress data into the response; Z_FINISH ends the stream */
+static bool conn_deflate(EthernetConnection *conn, const void *buf, size_t size, int flush)
+{
+	z_stream *zs = conn->zs;
+	zs->next_in = (Bytef *) buf;
+	zs->avail_in = size;
+	while (true)
+	{
+		if (conn->tx_cap - conn->tx_len < 1024 && !conn_reserve(conn, 1024))
+			return false;
+		zs->next_out = (Bytef *) conn->tx + conn->tx_len;
+		zs->avail_out = conn->tx_cap - conn->tx_len;
+		int ret = deflate(zs, flush);
+		size_t out = (char *) zs->next_out - (conn->tx + conn->tx_len);
+		if (out && !conn_tx_add(conn, out))
+			return false;
+		if (ret == Z_STREAM_END || (ret != Z_OK && ret != Z_BUF_ERROR))
+			return ret == Z_STREAM_END;
+		if (zs->avail_out && !zs->avail_in && flush != Z_FINISH)
+			return true;
+	}
+}
+
+/** Start compressing the body: the part buffered so far goes through the compressor.
+ *  Returns false if the body is to be sent as it is */
+static bool conn_deflate_start(EthernetConnection *conn)
+{
+	if (conn->zs && conn->zs_encoding != conn->encoding)
+	{
+		deflateEnd(conn->zs);
+		free(conn->zs);
+		conn->zs = NULL;
+	}
+	if (conn->zs)
+	{
+		deflateReset(conn->zs);
+	}
+	else
+	{
+		conn->zs = (z_stream *) calloc(1, sizeof(z_stream));
+		// gzip wraps the stream with a gzip header, deflate with a zlib header
+		int bits = (conn->encoding == ENC_GZIP) ? 15 + 16 : 15;
+		if (!conn->zs || deflateInit2(conn->zs, ether_gzip_level, Z_DEFLATED, bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		{
+			free(conn->zs);
+			conn->zs = NULL;
+			conn->encoding = ENC_NONE;
+			return false;
+		}
+		conn->zs_encoding = conn->encoding;
+	}
+	size_t len = conn->tx_len - conn->body_off;
+	char *body = (char *) malloc(len);
+	if (!body)
+		return false;
+	memcpy(body, conn->tx + conn->body_off, len);
+	conn->tx_len = conn->body_off;
+	conn->nseg = conn->hdr_seg;
+	conn->deflating = true;
+	bool ok = conn_deflate(conn, body, len, Z_NO_FLUSH);
+	free(body);
+	return ok;
+}
+
+/** Append data to the body of the response */
+static bool conn_tx_body(EthernetConnection *conn, const void *buf, size_t size)
+{
+	if (conn->deflating)
+		return conn_deflate(conn, buf, size, Z_NO_FLUSH);
+	if (!conn_tx_copy(conn, buf, size))
+		return false;
+	if (conn->encoding != ENC_NONE && conn->hdr_seg >= 0 && conn->tx_len - conn->body_off >= ether_gzip_min_size)
+		conn_deflate_start(conn);
+	return true;
+}
+
+/** Append static data to the response, without copying it */
+static bool conn_tx_static(EthernetConnection *conn, const char *buf, size_t size)
+{
+	// keep room for the framing headers and a copied segment
+	if (conn->nseg >= ETHER_MAX_SEGMENTS - 2)
+		return conn_tx_copy(conn, buf, size);
+	TxSegment *seg = conn->seg + conn->nseg++;
+	seg->ptr = buf;
+	seg->off = 0;
+	seg->len = size;
+	return true;
+}
+
+static void conn_flush(EthernetConnection *conn);
+
+/** Answer a request that cannot be served with an error status, and close */
+static void conn_reject(EthernetConnection *conn, int status)
+{
+	const char *reason = (status == 413) ? "Payload Too Large" :
+			(status == 431) ? "Request Header Fields Too Large" : "Bad Request";
+	char resp[128];
+	int n = snprintf(resp, sizeof(resp), "HTTP/1.1 %d %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", status, reason);
+	conn->rx_len = 0;
+	conn_tx_reset(conn);
+	if (!conn_tx_copy(conn, resp, n))
+	{
+		conn_close(conn);
+		return;
+	}
+	conn->keepalive = false;
+	conn->state = CONN_WRITING;
+	conn->deadline = millis() + ETHER_WRITE_TIMEOUT * 1000UL;
+	conn_flush(conn);
+}
+
+/** Queue the first request in the receive buffer if it is complete */
+static bool conn_check(EthernetConnection *conn)
+{
+	int status = conn_parse(conn);
+	if (status == 1)
+		conn_ready(conn);
+	else if (status)
+		conn_reject(conn, status);
+	return status != 0;
+}
+
+/** The response is sent: close the connection, or wait for the next request */
+static void conn_finish(EthernetConnection *conn)
+{
+	if (!conn->keepalive)
+	{
+		conn_close(conn);
+		return;
+	}
+	if (conn->tx_cap > ETHER_BUFFER_SIZE * 4)
+	{
+		// do not hold on to the buffer of an unusually large response
+		free(conn->tx);
+		conn->tx = NULL;
+		conn->tx_cap = 0;
+	}
+	conn_rx_shrink(conn);
+	conn_tx_reset(conn);
+	conn->state = CONN_READING;
+	conn->deadline = millis() + (conn->rx_len ? ETHER_READ_TIMEOUT : ETHER_IDLE_TIMEOUT) * 1000UL;
+	if (conn_check(conn))
+		return;	// pipelined request, already received
+	struct epoll_event ev = {0};
+	ev.events = EPOLLIN;
+	ev.data.ptr = conn;
+	epoll_ctl(conn->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+	conn->out_wait = false;
+}
+
+/** Wait for the client of an event stream to close it */
+static void conn_stream_wait(EthernetConnection *conn)
+{
+	struct epoll_event ev = {0};
+	ev.events = EPOLLIN;
+	ev.data.ptr = conn;
+	epoll_ctl(conn->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+	conn->out_wait = false;
+}
+
+/** The first part of an event stream is sent: wait for broadcasts */
+static void conn_stream(EthernetConnection *conn)
+{
+	conn_tx_reset(conn);
+	conn->rx_len = 0;	// nothing the client sends is served
+	conn->state = CONN_STREAM;
+	conn->deadline = millis() + ETHER_IDLE_TIMEOUT * 1000UL;
+	conn_stream_wait(conn);
+}
+
+/** Add the framing headers to the response written by the handler */
+static void conn_frame(EthernetConnection *conn)
+{
+	if (conn->hdr_seg < 0)
+	{
+		// no complete response, let the client see the connection close
+		conn->keepalive = false;
+		return;
+	}
+	if (conn->deflating && !conn_deflate(conn, NULL, 0, Z_FINISH))
+	{
+		conn->hdr_seg = -1;
+		conn->nseg = 0;
+		conn->keepalive = false;
+		return;
+	}
+	size_t body_len = 0;
+	for (int i = conn->hdr_seg; i < conn->nseg; i++)
+		body_len += conn->seg[i].len;
+	const char *coding = !conn->deflating ? "" :
+			(conn->encoding == ENC_GZIP) ? "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n" :
+			"Content-Encoding: deflate\r\nVary: Accept-Encoding\r\n";
+	int n;
+	if (conn->streaming)
+		n = snprintf(conn->frame, sizeof(conn->frame), "Connection: close\r\n\r\n");
+	else if (conn->no_body)
+		n = snprintf(conn->frame, sizeof(conn->frame), "Connection: %s\r\n\r\n", conn->keepalive ? "keep-alive" : "close");
+	else
+		n = snprintf(conn->frame, sizeof(conn->frame), "%sContent-Length: %lu\r\nConnection: %s\r\n\r\n",
+				coding, (unsigned long) body_len, conn->keepalive ? "keep-alive" : "close");
+	memmove(conn->seg + conn->hdr_seg + 1, conn->seg + conn->hdr_seg, (conn->nseg - conn->hdr_seg) * sizeof(TxSegment));
+	conn->nseg++;
+	TxSegment *seg = conn->seg + conn->hdr_seg;
+	seg->ptr = conn->frame;
+	seg->off = 0;
+	seg->len = n;
+}
+
+/** Number of tcp segments with data the socket has sent. Only responses
+ *  send data, so the difference to the count after the previous response
+ *  is what the current one took */
+static unsigned int conn_segs_out(EthernetConnection *conn)
+{
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+	memset(&info, 0, sizeof(info));
+	if (getsockopt(conn->fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0)
+		return 0;
+	return info.tcpi_data_segs_out;
+}
+
+/** Account the response that has just been sent */
+static void conn_account(EthernetConnection *conn)
+{
+	EthernetStats *st = stats + ((conn->tag >= 0 && conn->tag < ETHER_STATS_TAGS) ? conn->tag : 0);
+	size_t bytes = 0;
+	for (int i = 0; i < conn->nseg; i++)
+		bytes += conn->seg[i].len;
+	__atomic_fetch_add(&st->responses, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&st->syscalls, conn->syscalls, __ATOMIC_RELAXED);
+	unsigned int segs_out = conn_segs_out(conn);
+	__atomic_fetch_add(&st->segments, segs_out - conn->segs_out, __ATOMIC_RELAXED);
+	conn->segs_out = segs_out;
+	__atomic_fetch_add(&st->bytes, bytes, __ATOMIC_RELAXED);
+}
+
+/** Send as much of the response as the socket takes */
+static void conn_flush(EthernetConnection *conn)
+{
+	while (conn->seg_next < conn->nseg)
+	{
+		struct iovec iov[ETHER_MAX_SEGMENTS];
+		int n_iov = 0;
+		for (int i = conn->seg_next; i < conn->nseg; i++, n_iov++)
+		{
+			TxSegment *seg = conn->seg + i;
+			size_t skip = (i == conn->seg_next) ? conn->seg_off : 0;
+			iov[n_iov].iov_base = (char *) (seg->ptr ? seg->ptr : conn->tx + seg->off) + skip;
+			iov[n_iov].iov_len = seg->len - skip;
+		}
+		struct msghdr msg = {0};
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n_iov;
+		ssize_t n = ::sendmsg(conn->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		conn->syscalls++;
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			// wait until the socket is writable again
+			struct epoll_event ev = {0};
+			ev.events = (conn->state == CONN_STREAM) ? (EPOLLIN | EPOLLOUT) : EPOLLOUT;
+			ev.data.ptr = conn;
+			epoll_ctl(conn->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+			conn->out_wait = true;
+			return;
+		}
+		if (n <= 0)
+		{
+			conn_close(conn);
+			return;
+		}
+		// skip what was sent
+		size_t sent = n;
+		while (conn->seg_next < conn->nseg && sent >= conn->seg[conn->seg_next].len - conn->seg_off)
+		{
+			sent -= conn->seg[conn->seg_next].len - conn->seg_off;
+			conn->seg_next++;
+			conn->seg_off = 0;
+		}
+		conn->seg_off += sent;
+	}
+	if (conn->state == CONN_WRITING)
+	{
+		conn_account(conn);
+		if (conn->streaming)
+			conn_stream(conn);
+		else
+			conn_finish(conn);
+	}
+	else if (conn->state == CONN_STREAM)
+	{
+		conn_tx_reset(conn);
+		if (conn->out_wait)
+			conn_stream_wait(conn);
+	}
+}
+
+/** Read from an event stream: the client only sends to close it */
+static void conn_drain(EthernetConnection *conn)
+{
+	char buf[256];
+	while (true)
+	{
+		ssize_t n = ::recv(conn->fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (n <= 0)
+		{
+			conn_close(conn);
+			return;
+		}
+	}
+}
+
+/** Read from the socket until the request is complete */
+static void conn_read(EthernetConnection *conn)
+{
+	while (true)
+	{
+		if (conn->rx_len >= conn->rx_cap - 1)
+		{
+			// only a request that is still incomplete gets a larger buffer
+			int cap = conn->rx_cap * 2;
+			if (cap > ETHER_REQUEST_SIZE)
+				cap = ETHER_REQUEST_SIZE;
+			if (cap <= conn->rx_cap || !conn_rx_resize(conn, cap))
+				break;
+		}
+		ssize_t n = ::recv(conn->fd, conn->rx + conn->rx_len, conn->rx_cap - 1 - conn->rx_len, MSG_DONTWAIT);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (n <= 0)
+		{
+			// closed or failed before a complete request arrived
+			conn_close(conn);
+			return;
+		}
+		if (!conn->rx_len)	// a new request starts, the idle timeout no longer applies
+			conn->deadline = millis() + ETHER_READ_TIMEOUT * 1000UL;
+		conn->rx_len += n;
+		conn->rx[conn->rx_len] = 0;
+		if (conn_check(conn))
+			return;
+	}
+	// the buffer is full, and may not grow any more
+	conn_check(conn);
+}
 
 EthernetServer::EthernetServer(uint16_t port)
-		: m_port(port), m_sock(0)
+		: m_port(port), m_sock(-1), m_epfd(-1), m_evfd(-1), m_tfd(-1), m_wake(0), m_conns(NULL), m_next(0)
 {
 }
 
 EthernetServer::~EthernetServer()
 {
-	close(m_sock);
+	if (m_conns)
+	{
+		for (int i = 0; i < ETHER_MAX_CONNECTIONS; i++)
+		{
+			conn_close(m_conns + i);
+			free(m_conns[i].rx);
+		}
+		delete[] m_conns;
+	}
+	if (m_evfd >= 0)
+		close(m_evfd);
+	if (m_tfd >= 0)
+		close(m_tfd);
+	if (m_epfd >= 0)
+		close(m_epfd);
+	if (m_sock >= 0)
+		close(m_sock);
 }
 
+//  With port 0 there is no listen socket: connections only come
+//   from adopt() (the simulation uses this).
 bool EthernetServer::begin()
 {
-	struct sockaddr_in sin = {0};
-	sin.sin_family = AF_INET;
-	sin.sin_port = htons(m_port);
-	sin.sin_addr.s_addr = INADDR_ANY;
+	if ((m_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+	{
+		DEBUG_PRINTLN("can't create epoll set");
+		return false;
+	}
+	struct epoll_event ev = {0};
+	if (m_port)
+	{
+		struct sockaddr_in sin = {0};
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(m_port);
+		sin.sin_addr.s_addr = INADDR_ANY;
 
-	if ((m_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		if ((m_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		{
+			DEBUG_PRINTLN("can't create shell listen socket");
+			return false;
+		}
+		int on = 1;
+		if (setsockopt(m_sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0)
+		{
+			DEBUG_PRINTLN("can't setsockopt");
+			return false;
+		}
+		if (bind(m_sock, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+		{
+			DEBUG_PRINTLN("shell bind error");
+			return false;
+		}
+		if (ioctl(m_sock, FIONBIO, (char*) &on) < 0)
+		{
+			DEBUG_PRINTLN("setting nonblock failed");
+			return false;
+		}
+		if (listen(m_sock, ETHER_MAX_CONNECTIONS) < 0)
+		{
+			DEBUG_PRINTLN("shell listen error");
+			return false;
+		}
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;	// NULL marks the listen socket
+		if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_sock, &ev) < 0)
+		{
+			DEBUG_PRINTLN("can't add listen socket to epoll set");
+			return false;
+		}
+	}
+	if ((m_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
 	{
-		DEBUG_PRINTLN("can't create shell listen socket");
+		DEBUG_PRINTLN("can't create wakeup eventfd");
 		return false;
 	}
-	int on = 1;
-	if (setsockopt(m_sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0)
+	ev.events = EPOLLIN;
+	ev.data.ptr = &m_evfd;	// marks the wakeup eventfd
+	if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_evfd, &ev) < 0)
 	{
-		DEBUG_PRINTLN("can't setsockopt");
+		DEBUG_PRINTLN("can't add eventfd to epoll set");
 		return false;
 	}
-	if (bind(m_sock, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+	if ((m_tfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
 	{
-		DEBUG_PRINTLN("shell bind error");
+		DEBUG_PRINTLN("can't create deadline timerfd");
 		return false;
 	}
-	if (ioctl(m_sock, FIONBIO, (char*) &on) < 0)
+	ev.events = EPOLLIN;
+	ev.data.ptr = &m_tfd;	// marks the deadline timerfd
+	if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tfd, &ev) < 0)
 	{
-		DEBUG_PRINTLN("setting nonblock failed");
+		DEBUG_PRINTLN("can't add timerfd to epoll set");
 		return false;
 	}
-	if (listen(m_sock, 2) < 0)
+	m_conns = new EthernetConnection[ETHER_MAX_CONNECTIONS]();
+	for (int i = 0; i < ETHER_MAX_CONNECTIONS; i++)
+	{
+		m_conns[i].state = CONN_FREE;
+		m_conns[i].epfd = m_epfd;
+		m_conns[i].evfd = m_evfd;
+		m_conns[i].tx = NULL;
+		m_conns[i].tx_len = m_conns[i].tx_cap = 0;
+		m_conns[i].nseg = m_conns[i].seg_next = 0;
+		m_conns[i].rx = NULL;
+		m_conns[i].rx_len = m_conns[i].rx_cap = 0;
+		if (!conn_rx_resize(m_conns + i, ETHER_BUFFER_SIZE))
+		{
+			DEBUG_PRINTLN("can't allocate receive buffers");
+			return false;
+		}
+		m_conns[i].req_len = m_conns[i].req_raw = 0;
+		m_conns[i].continued = false;
+		m_conns[i].streaming = false;
+		m_conns[i].out_wait = false;
+		m_conns[i].keepalive = false;
+		m_conns[i].encoding = 0;
+		m_conns[i].zs = NULL;
+	}
+	return true;
+}
+
+/** Accept all pending connections */
+void EthernetServer::accept_all()
+{
+	int client_sock;
+	while ((client_sock = accept4(m_sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+	{
+		// responses go out in one piece; with pipelined requests Nagle would
+		// hold back the next response until the previous one is acknowledged
+		int on = 1;
+		setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		adopt(client_sock);
+	}
+}
+
+/** Serve the requests received on a connected (non-blocking) socket
+ *  Returns false, with the socket closed, if there is no room for it */
+bool EthernetServer::adopt(int sock)
+{
+	EthernetConnection *conn = NULL;
+	for (int i = 0; i < ETHER_MAX_CONNECTIONS; i++)
+	{
+		if (conn_state(m_conns + i) == CONN_FREE)
+		{
+			conn = m_conns + i;
+			break;
+		}
+	}
+	if (!conn)
+		conn = evict_idle();
+	if (!conn)
 	{
-		DEBUG_PRINTLN("shell listen error");
+		// too many connections
+		close(sock);
 		return false;
 	}
+	struct epoll_event ev = {0};
+	ev.events = EPOLLIN;
+	ev.data.ptr = conn;
+	if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, sock, &ev) < 0)
+	{
+		close(sock);
+		return false;
+	}
+	conn->fd = sock;
+	conn->state = CONN_READING;
+	conn->rx_len = 0;
+	conn->req_len = conn->req_raw = 0;
+	conn->continued = false;
+	conn->streaming = false;
+	conn->out_wait = false;
+	conn->segs_out = 0;
+	conn_tx_reset(conn);
+	conn->deadline = millis() + ETHER_READ_TIMEOUT * 1000UL;
 	return true;
 }
 
-//  This function blocks until we get a client connected.
-//   It will timeout after 50ms and return a blank client.
-//   If it succeeds it will return an EthernetClient.
-EthernetClient EthernetServer::available()
+/** Close the kept-alive connection that has been idle the longest, to make room */
+EthernetConnection *EthernetServer::evict_idle()
 {
-	fd_set sock_set;
-	FD_ZERO(&sock_set);
-	FD_SET(m_sock, &sock_set);
-	struct timeval timeout;
-	timeout.tv_sec = 0;
-	timeout.tv_usec = 50 * 1000; // 50ms
+	EthernetConnection *oldest = NULL;
+	for (int i = 0; i < ETHER_MAX_CONNECTIONS; i++)
+	{
+		EthernetConnection *conn = m_conns + i;
+		if (conn_state(conn) == CONN_READING && !conn->rx_len &&
+				(!oldest || (long)(conn->deadline - oldest->deadline) < 0))
+			oldest = conn;
+	}
+	if (oldest)
+		conn_close(oldest);
+	return oldest;
+}
 
-	select(m_sock + 1, &sock_set, NULL, NULL, &timeout);
-	if (FD_ISSET(m_sock, &sock_set))
+/** Next connection with a complete request, checked round-robin */
+EthernetConnection *EthernetServer::next_request()
+{
+	for (int i = 0; i < ETHER_MAX_CONNECTIONS; i++)
+	{
+		int k = (m_next + i) % ETHER_MAX_CONNECTIONS;
+		if (conn_state(m_conns + k) == CONN_READY)
+		{
+			m_next = (k + 1) % ETHER_MAX_CONNECTIONS;
+			return m_conns + k;
+		}
+	}
+	return NULL;
+}
+
+/** Start sending the responses of connections whose handler is done */
+void EthernetServer::collect_done()
+{
+	for (int i = 0; i < ETHER_MAX_CONNECTIONS; i++)
 	{
-		int client_sock = 0;
-		struct sockaddr_in cli_addr;
-		unsigned int clilen = sizeof(cli_addr);
-		if ((client_sock = accept(m_sock, (struct sockaddr *) &cli_addr, &clilen)) <= 0)
-			return EthernetClient(0);
-		return EthernetClient(client_sock);
+		EthernetConnection *conn = m_conns + i;
+		if (conn_state(conn) == CONN_DONE)
+		{
+			conn->state = CONN_WRITING;
+			conn->deadline = millis() + ETHER_WRITE_TIMEOUT * 1000UL;
+			conn_flush(conn);
+		}
 	}
-	return EthernetClient(0);
+}
+
+/** Drop connections past their deadline */
+void EthernetServer::expire(unsigned long curr_ms)
+{
+	for (int i = 0; i < ETHER_MAX_CONNECTIONS; i++)
+	{
+		EthernetConnection *conn = m_conns + i;
+		byte state = conn_state(conn);
+		if ((state == CONN_READING || state == CONN_WRITING) && (long)(curr_ms - conn->deadline) >= 0)
+			conn_close(conn);
+		else if (state == CONN_STREAM && (long)(curr_ms - conn->deadline) >= 0)
+		{
+			if (conn->seg_next < conn->nseg)
+			{
+				// a broadcast is still not sent: the client is gone or stuck
+				conn_close(conn);
+				continue;
+			}
+			// a comment line keeps the connection from looking idle to proxies and the client
+			conn->deadline = curr_ms + ETHER_IDLE_TIMEOUT * 1000UL;
+			if (conn_tx_copy(conn, ":\n\n", 3))
+				conn_flush(conn);
+			else
+				conn_close(conn);
+		}
+	}
+}
+
+/** Shorten the wait so that the earliest deadline is not missed */
+int EthernetServer::next_deadline(unsigned long curr_ms, int timeout_ms)
+{
+	for (int i = 0; i < ETHER_MAX_CONNECTIONS; i++)
+	{
+		EthernetConnection *conn = m_conns + i;
+		byte state = conn_state(conn);
+		if (state == CONN_READING || state == CONN_WRITING || state == CONN_STREAM)
+		{
+			long left = (long)(conn->deadline - curr_ms);
+			if (left < 0)
+				left = 0;
+			if (timeout_ms < 0 || left < timeout_ms)
+				timeout_ms = left;
+		}
+	}
+	return timeout_ms;
+}
+
+//  This function waits up to timeout_ms for network activity,
+//   accepting connections, receiving requests and sending responses.
+//   A negative timeout waits until the time set with wake_at.
+//   It returns an EthernetClient holding a complete request,
+//   or a blank client if no request is ready.
+EthernetClient EthernetServer::available(int timeout_ms)
+{
+	if (!m_conns)
+	{
+		// not listening, just keep the loop's pace
+		if (timeout_ms >= 0)
+			delay(timeout_ms);
+		else if (m_wake)
+		{
+			struct timespec ts = {m_wake, 0};
+			while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &ts, NULL) == EINTR);
+		}
+		return EthernetClient();
+	}
+
+	// a request received earlier is served without waiting
+	EthernetConnection *conn = next_request();
+	if (conn)
+		timeout_ms = 0;
+
+	struct epoll_event events[ETHER_MAX_CONNECTIONS + 1];
+	int n = epoll_wait(m_epfd, events, ETHER_MAX_CONNECTIONS + 1, next_deadline(millis(), timeout_ms));
+	for (int i = 0; i < n; i++)
+	{
+		EthernetConnection *c = (EthernetConnection *) events[i].data.ptr;
+		if (!c)
+		{
+			accept_all();
+			continue;
+		}
+		if ((void *) c == &m_evfd)
+		{
+			uint64_t count;
+			while (::read(m_evfd, &count, sizeof(count)) > 0);
+			continue;
+		}
+		if ((void *) c == &m_tfd)
+		{
+			// expired, or cancelled because the clock was set: armed again by the next wake_at
+			uint64_t count;
+			while (::read(m_tfd, &count, sizeof(count)) > 0);
+			m_wake = 0;
+			continue;
+		}
+		byte state = conn_state(c);
+		if (state == CONN_READING && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+			conn_read(c);
+		else if (state == CONN_WRITING && (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)))
+			conn_flush(c);
+		else if (state == CONN_STREAM)
+		{
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				conn_drain(c);
+			if (c->state == CONN_STREAM && (events[i].events & EPOLLOUT))
+				conn_flush(c);
+		}
+	}
+	collect_done();
+	expire(millis());
+
+	if (!conn)
+		conn = next_request();
+	if (!conn)
+		return EthernetClient();
+	conn->state = CONN_HANDLING;
+	return EthernetClient(conn);
+}
+
+/** Response statistics of one slot */
+void EthernetServer::get_stats(int tag, EthernetStats *st)
+{
+	EthernetStats *src = stats + tag;
+	st->responses = __atomic_load_n(&src->responses, __ATOMIC_RELAXED);
+	st->syscalls = __atomic_load_n(&src->syscalls, __ATOMIC_RELAXED);
+	st->segments = __atomic_load_n(&src->segments, __ATOMIC_RELAXED);
+	st->bytes = __atomic_load_n(&src->bytes, __ATOMIC_RELAXED);
+}
+
+/** Send data to all event streams. Streams that have fallen too far
+ *  behind are closed. Main loop only */
+void EthernetServer::broadcast(const char *data, size_t size)
+{
+	if (!m_conns || !size)
+		return;
+	for (int i = 0; i < ETHER_MAX_CONNECTIONS; i++)
+	{
+		EthernetConnection *conn = m_conns + i;
+		byte state = conn_state(conn);
+		// a stream whose handler is done, but is not sent yet, gets the data appended
+		if ((state != CONN_DONE && state != CONN_WRITING && state != CONN_STREAM) || !conn->streaming)
+			continue;
+		if (conn->tx_len + size > ETHER_STREAM_BACKLOG || !conn_tx_copy(conn, data, size))
+		{
+			conn_close(conn);
+			continue;
+		}
+		if (state != CONN_DONE && !conn->out_wait)
+			conn_flush(conn);
+	}
+}
+
+/** Number of event streams */
+int EthernetServer::streams()
+{
+	return __atomic_load_n(&nstreams, __ATOMIC_RELAXED);
+}
+
+/** Wake up available() at time t (seconds since epoch, utc), or when
+ *  the clock is set. 0 cancels it. Main loop only */
+void EthernetServer::wake_at(time_t t)
+{
+	if (t == m_wake)
+		return;
+	m_wake = t;
+	if (m_tfd < 0)
+		return;
+	struct itimerspec its = {{0, 0}, {t, 0}};
+	if (timerfd_settime(m_tfd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL) < 0)
+		DEBUG_PRINTLN("can't arm timerfd");
+}
+
+/** Wake up available(), from any thread */
+void EthernetServer::wake()
+{
+	uint64_t one = 1;
+	if (m_evfd >= 0 && ::write(m_evfd, &one, sizeof(one)) < 0)
+		DEBUG_PRINTLN("can't signal eventfd");
 }
 
 EthernetClient::EthernetClient()
-		: m_sock(0), m_connected(false)
+		: m_sock(0), m_connected(false), m_conn(NULL)
 {
 }
 
 EthernetClient::EthernetClient(int sock)
-		: m_sock(sock), m_connected(true)
+		: m_sock(sock), m_connected(true), m_conn(NULL)
+{
+}
+
+EthernetClient::EthernetClient(EthernetConnection *conn)
+		: m_sock(conn->fd), m_connected(true), m_conn(conn)
 {
 }
 
@@ -150,6 +1300,22 @@ bool EthernetClient::connected()
 
 void EthernetClient::stop()
 {
+	if (m_conn)
+	{
+		// the server sends what is buffered, then closes the connection.
+		// this may run on a worker thread, so only hand the connection back
+		// and let the main loop do the socket work
+		int evfd = m_conn->evfd;
+		conn_frame(m_conn);
+		__atomic_store_n(&m_conn->state, CONN_DONE, __ATOMIC_RELEASE);
+		uint64_t one = 1;
+		if (::write(evfd, &one, sizeof(one)) < 0)
+			DEBUG_PRINTLN("can't signal eventfd");
+		m_conn = NULL;
+		m_sock = 0;
+		m_connected = false;
+		return;
+	}
 	if (m_sock)
 	{
 		close(m_sock);
@@ -158,6 +1324,68 @@ void EthernetClient::stop()
 	}
 }
 
+/** Detach a server connection from this client, so that it is not
+ * finished when the client goes away; wrap it in a new client to serve it */
+EthernetConnection *EthernetClient::release()
+{
+	EthernetConnection *conn = m_conn;
+	m_conn = NULL;
+	m_sock = 0;
+	m_connected = false;
+	return conn;
+}
+
+/** Add static data (that outlives the response) to a server response without copying it */
+size_t EthernetClient::write_static(const char *buf, size_t size)
+{
+	if (!m_conn)
+		return write((const uint8_t *) buf, size);
+	if (m_conn->hdr_seg >= 0 && m_conn->encoding != ENC_NONE)
+		return write((const uint8_t *) buf, size);	// body that may be compressed
+	return conn_tx_static(m_conn, buf, size) ? size : 0;
+}
+
+/** Mark the end of the response headers, the body follows unless body is false
+ *  (a 304 response). The server adds the framing headers and the empty line here */
+void EthernetClient::end_headers(bool body)
+{
+	if (m_conn)
+	{
+		m_conn->hdr_seg = m_conn->nseg;
+		m_conn->no_body = !body;
+		m_conn->body_off = m_conn->tx_len;
+	}
+	else
+		write((const uint8_t *) "\r\n", 2);
+}
+
+/** Make the response an event stream, before its body is written: the
+ *  connection stays open after it is sent and gets the data passed to
+ *  EthernetServer::broadcast(). False if there are too many streams */
+bool EthernetClient::stream()
+{
+	if (!m_conn)
+		return false;
+	if (m_conn->streaming)
+		return true;
+	if (__atomic_add_fetch(&nstreams, 1, __ATOMIC_RELAXED) > ETHER_MAX_STREAMS)
+	{
+		__atomic_fetch_sub(&nstreams, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+	m_conn->streaming = true;
+	m_conn->keepalive = false;
+	m_conn->encoding = ENC_NONE;
+	return true;
+}
+
+/** Statistics slot the response is accounted to */
+void EthernetClient::set_tag(int tag)
+{
+	if (m_conn)
+		m_conn->tag = tag;
+}
+
 EthernetClient::operator bool()
 {
 	return m_sock != 0;
@@ -169,6 +1397,18 @@ EthernetClient::operator bool()
 //  and return 0;
 int EthernetClient::read(uint8_t *buf, size_t size)
 {
+	if (m_conn)
+	{
+		// server side: the request has already been received
+		int len = (m_conn->req_len < (int)size) ? m_conn->req_len : size;
+		memcpy(buf, m_conn->rx, len);
+		// keep what follows (pipelined requests) for later
+		m_conn->rx_len -= m_conn->req_raw;
+		memmove(m_conn->rx, m_conn->rx + m_conn->req_raw, m_conn->rx_len);
+		m_conn->rx[m_conn->rx_len] = 0;
+		m_conn->req_len = 0;
+		return len;
+	}
 	fd_set sock_set;
 	FD_ZERO(&sock_set);
 	FD_SET(m_sock, &sock_set);
@@ -190,5 +1430,12 @@ int EthernetClient::read(uint8_t *buf, size_t size)
 
 size_t EthernetClient::write(const uint8_t *buf, size_t size)
 {
+	if (m_conn)
+	{
+		// server side: buffer the response, it is sent once the handler is done
+		if (m_conn->hdr_seg >= 0)
+			return conn_tx_body(m_conn, buf, size) ? size : 0;
+		return conn_tx_copy(m_conn, buf, size) ? size : 0;
+	}
 	return ::send(m_sock, buf, size, MSG_NOSIGNAL);
 }
\ No newline at end of file
@@ -28,24 +28,43 @@
 #include <stdio.h>
 #include <inttypes.h>
 #include <ctype.h>
+#include <time.h>
 
 #ifdef __APPLE__
 #	define MSG_NOSIGNAL SO_NOSIGPIPE
 #endif
 
 class EthernetServer;
+struct EthernetConnection;
+
+extern int ether_gzip_level;	// compression level of responses, 0 sends them uncompressed
+extern size_t ether_gzip_min_size;	// smallest body that is compressed
+
+/** Response statistics of the server, per slot (see EthernetClient::set_tag) */
+struct EthernetStats {
+	unsigned long responses;
+	unsigned long syscalls;	// send calls
+	unsigned long segments;	// tcp segments sent
+	unsigned long bytes;
+};
 
 class EthernetClient
 {
 public:
 	EthernetClient();
 	EthernetClient(int sock);
+	EthernetClient(EthernetConnection *conn);
 	~EthernetClient();
 	int connect(uint8_t ip[4], uint16_t port);
 	bool connected();
 	void stop();
 	int read(uint8_t *buf, size_t size);
 	size_t write(const uint8_t *buf, size_t size);
+	size_t write_static(const char *buf, size_t size);
+	void end_headers(bool body = true);
+	void set_tag(int tag);
+	bool stream();
+	EthernetConnection *release();
 	operator bool();
 	int GetSocket()
 	{
@@ -54,6 +73,7 @@ public:
 private:
 	int m_sock;
 	bool m_connected;
+	EthernetConnection *m_conn;	// set for connections accepted by EthernetServer
 	friend class EthernetServer;
 };
 
@@ -64,10 +84,29 @@ public:
 	~EthernetServer();
 
 	bool begin();
-	EthernetClient available();
+	bool adopt(int sock);
+	EthernetClient available(int timeout_ms = 50);
+	void wake();
+	void wake_at(time_t t);
+	void broadcast(const char *data, size_t size);
+	static int streams();
+	static void get_stats(int tag, EthernetStats *st);
 private:
+	void accept_all();
+	EthernetConnection *next_request();
+	EthernetConnection *evict_idle();
+	void collect_done();
+	void expire(unsigned long curr_ms);
+	int next_deadline(unsigned long curr_ms, int timeout_ms);
+
 	uint16_t m_port;
 	int m_sock;
+	int m_epfd;
+	int m_evfd;	// eventfd to wake up available() from other threads
+	int m_tfd;	// timerfd to wake up available() at the time set by wake_at
+	time_t m_wake;	// time the timerfd is armed for, 0 when it is not
+	EthernetConnection *m_conns;
+	int m_next;	// connection to check first for a pending request
 };
 
 #endif /* _ETHERPORT_H_ */
@@ -0,0 +1,253 @@
+/* OpenHome Firmware
+ * Copyright (C) 2015 by Charles Remeikas
+ *
+ * HTTP load benchmark
+ * Runs concurrent clients against the controller's web server and
+ * reports throughput, latency and CPU time per request, with one
+ * connection per request or with kept-alive (optionally pipelined)
+ * connections. Build with: ./build.sh bench
+ *
+ * This file is part of the OpenHome Firmware
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <algorithm>
+#include <vector>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+static const char *host = "127.0.0.1";
+static int port = 80;
+static int nconns = 8;          // concurrent clients
+static int nrequests = 2000;    // requests per client
+static int pipeline = 1;        // requests sent back-to-back on a connection
+static bool keepalive = false;  // reuse connections
+static int server_pid = 0;      // server process, for its cpu time
+static const char *encoding = NULL;  // Accept-Encoding sent with the requests
+static const char *extra_header = NULL;  // another header sent with the requests
+static const char *path = "/jc?pw=Undine12";
+
+struct ClientStats {
+  std::vector<double> latency;  // microseconds
+  int errors;
+  double bytes;                 // received, headers included
+};
+
+static double now_us() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+/** Cpu time of a process in microseconds, from /proc */
+static double process_cpu_us(int pid) {
+  char name[64];
+  snprintf(name, sizeof(name), "/proc/%d/stat", pid);
+  FILE *fp = fopen(name, "r");
+  if (!fp) return 0;
+  unsigned long utime = 0, stime = 0;
+  // skip to fields 14 and 15 (after the parenthesized command name)
+  char buf[1024];
+  if (fgets(buf, sizeof(buf), fp)) {
+    char *p = strrchr(buf, ')');
+    if (p) sscanf(p+2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+  }
+  fclose(fp);
+  return (utime + stime) * 1e6 / sysconf(_SC_CLK_TCK);
+}
+
+static int open_conn() {
+  struct sockaddr_in sin = {0};
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(port);
+  inet_pton(AF_INET, host, &sin.sin_addr);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  int on = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  if (connect(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/** Read one response. Returns false if the connection failed or closed */
+static bool read_response(int fd, std::vector<char> &buf, size_t &len, double &bytes) {
+  while (true) {
+    // complete headers?
+    char *end = (char *) memmem(&buf[0], len, "\r\n\r\n", 4);
+    if (end) {
+      size_t hdr = end - &buf[0] + 4;
+      if (len >= 12 && (memcmp(&buf[9], "304", 3) == 0 || memcmp(&buf[9], "204", 3) == 0)) {
+        // no body
+        bytes += hdr;
+        memmove(&buf[0], &buf[hdr], len - hdr);
+        len -= hdr;
+        return true;
+      }
+      char *cl = (char *) memmem(&buf[0], hdr, "Content-Length:", 15);
+      if (cl) {
+        size_t body = strtoul(cl+15, NULL, 10);
+        if (len >= hdr + body) {
+          bytes += hdr + body;
+          memmove(&buf[0], &buf[hdr+body], len - hdr - body);
+          len -= hdr + body;
+          return true;
+        }
+      }
+    }
+    if (len == buf.size()) buf.resize(buf.size()*2);
+    ssize_t n = recv(fd, &buf[len], buf.size()-len, 0);
+    if (n <= 0) {
+      // without Content-Length the response ends when the server closes
+      bool ok = (n == 0 && end);
+      if (ok) bytes += len;
+      len = 0;
+      return ok;
+    }
+    len += n;
+  }
+}
+
+static void *client_thread(void *arg) {
+  ClientStats *st = (ClientStats *) arg;
+  char req[512];
+  char accept[256] = "";
+  if (encoding) snprintf(accept, sizeof(accept), "Accept-Encoding: %s\r\n", encoding);
+  if (extra_header) snprintf(accept+strlen(accept), sizeof(accept)-strlen(accept), "%s\r\n", extra_header);
+  int reqlen = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: %s\r\n%s%s\r\n",
+                        path, host, accept, keepalive ? "" : "Connection: close\r\n");
+  std::vector<char> out(reqlen * pipeline);
+  for (int i=0; i<pipeline; i++) memcpy(&out[i*reqlen], req, reqlen);
+  std::vector<char> buf(65536);
+  size_t len = 0;
+  int fd = -1;
+  for (int done=0; done<nrequests; ) {
+    int batch = keepalive ? std::min(pipeline, nrequests-done) : 1;
+    if (fd < 0 && (fd = open_conn()) < 0) {
+      st->errors++;
+      done++;
+      continue;
+    }
+    double t0 = now_us();
+    if (send(fd, &out[0], reqlen*batch, MSG_NOSIGNAL) != reqlen*batch) {
+      st->errors++;
+      close(fd);
+      fd = -1;
+      done++;
+      continue;
+    }
+    for (int i=0; i<batch; i++) {
+      if (!read_response(fd, buf, len, st->bytes)) {
+        st->errors++;
+        close(fd);
+        fd = -1;
+        len = 0;
+        break;
+      }
+      st->latency.push_back(now_us() - t0);
+    }
+    done += batch;
+    if (!keepalive && fd >= 0) {
+      close(fd);
+      fd = -1;
+      len = 0;
+    }
+  }
+  if (fd >= 0) close(fd);
+  return NULL;
+}
+
+static void usage(const char *name) {
+  printf("Usage: %s [-a host] [-p port] [-c clients] [-n requests] [-k] [-P depth] [-s pid] [-e coding] [-H header] [path]\n", name);
+  printf("  -a host     server address (default %s)\n", host);
+  printf("  -p port     server port (default %d)\n", port);
+  printf("  -c clients  concurrent clients (default %d)\n", nconns);
+  printf("  -n requests requests per client (default %d)\n", nrequests);
+  printf("  -k          keep connections alive\n");
+  printf("  -P depth    pipelined requests per round trip, with -k (default 1)\n");
+  printf("  -s pid      server process id, to report its cpu time per request\n");
+  printf("  -e coding   Accept-Encoding of the requests, e.g. gzip\n");
+  printf("  -H header   another request header, e.g. \"If-None-Match: *\"\n");
+  printf("  path        request path (default %s)\n", path);
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  while((opt = getopt(argc, argv, "a:p:c:n:kP:s:e:H:h")) != -1) {
+    switch(opt) {
+    case 'a': host = optarg; break;
+    case 'p': port = atoi(optarg); break;
+    case 'c': nconns = atoi(optarg); break;
+    case 'n': nrequests = atoi(optarg); break;
+    case 'k': keepalive = true; break;
+    case 'P': pipeline = std::max(1, atoi(optarg)); break;
+    case 's': server_pid = atoi(optarg); break;
+    case 'e': encoding = optarg; break;
+    case 'H': extra_header = optarg; break;
+    default:
+      usage(argv[0]);
+      return (opt=='h') ? 0 : 1;
+    }
+  }
+  if (optind < argc) path = argv[optind];
+
+  std::vector<ClientStats> stats(nconns);
+  std::vector<pthread_t> threads(nconns);
+  double server_cpu = server_pid ? process_cpu_us(server_pid) : 0;
+  struct rusage ru0, ru1;
+  getrusage(RUSAGE_SELF, &ru0);
+  double t0 = now_us();
+  for (int i=0; i<nconns; i++) {
+    stats[i].errors = 0;
+    stats[i].bytes = 0;
+    pthread_create(&threads[i], NULL, client_thread, &stats[i]);
+  }
+  for (int i=0; i<nconns; i++) pthread_join(threads[i], NULL);
+  double elapsed = now_us() - t0;
+  getrusage(RUSAGE_SELF, &ru1);
+  if (server_pid) server_cpu = process_cpu_us(server_pid) - server_cpu;
+
+  std::vector<double> all;
+  int errors = 0;
+  double bytes = 0;
+  for (int i=0; i<nconns; i++) {
+    bytes += stats[i].bytes;
+    all.insert(all.end(), stats[i].latency.begin(), stats[i].latency.end());
+    errors += stats[i].errors;
+  }
+  std::sort(all.begin(), all.end());
+  size_t n = all.size();
+  double client_cpu = (ru1.ru_utime.tv_sec - ru0.ru_utime.tv_sec + ru1.ru_stime.tv_sec - ru0.ru_stime.tv_sec) * 1e6
+                    + (ru1.ru_utime.tv_usec - ru0.ru_utime.tv_usec + ru1.ru_stime.tv_usec - ru0.ru_stime.tv_usec);
+  printf("%s %s, %d clients, pipeline %d\n", path, keepalive ? "keep-alive" : "close", nconns, keepalive ? pipeline : 1);
+  printf("requests   %lu ok, %d errors in %.2f s (%.0f req/s)\n", (unsigned long) n, errors, elapsed/1e6, n/(elapsed/1e6));
+  if (n) printf("latency    p50 %.0f us, p99 %.0f us, max %.0f us\n", all[n/2], all[n*99/100], all[n-1]);
+  if (n) printf("received   %.0f bytes/req\n", bytes/n);
+  if (n) printf("client cpu %.1f us/req\n", client_cpu/n);
+  if (n && server_pid) printf("server cpu %.1f us/req\n", server_cpu/n);
+  return errors ? 1 : 0;
+}
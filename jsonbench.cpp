@@ -0,0 +1,163 @@
+/* OpenHome Firmware
+ * Copyright (C) 2015 by Charles Remeikas
+ *
+ * Json rendering benchmark
+ * Times the renderers behind /jc and /jp on a generated data set and
+ * reports ns per call and per field (a number or a string written from
+ * an argument). The output goes to a buffer that is counted and
+ * rewound, not to a client, and the /jp section cache is bypassed.
+ * The data files are made in a scratch directory and removed at the
+ * end. Build with: ./build.sh jsonbench
+ *
+ * This file is part of the OpenHome Firmware
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+// the controller itself, with its main renamed, and the web server
+// with its static renderers in reach
+#define main openhome_main
+#include "main.cpp"
+#undef main
+#include "server.cpp"
+
+#include <dirent.h>
+#include <time.h>
+
+static int nboards = 7;         // boards of 8 stations
+static int nprogs = 80;         // programs
+static int ncalls = 2000;       // calls per run
+static int nruns = 10;          // runs, the best one is reported
+static size_t bench_bytes = 0;  // output so far
+
+static void bench_flush() {
+  bench_bytes += bfill.position();
+  bfill = BufferFiller(ether_buffer, ETHER_BUFFER_SIZE, bench_flush);
+}
+
+static double now_ns() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+/** Boards and programs to render */
+static void bench_data() {
+  os.options[OPTION_EXT_BOARDS] = nboards - 1;
+  os.options_save();
+  pd.durations_resize(os.nstations);
+  pd.eraseall();
+  ProgramStruct prog;
+  byte durations[MAX_NUM_STATIONS];
+  memset(&prog, 0, sizeof(prog));
+  prog.durations = durations;
+  for (int pid=0; pid<nprogs; pid++) {
+    prog.enabled = 1;
+    prog.type = pid % 4;
+    prog.starttime_type = pid % 2;
+    prog.days[0] = 0x7F;
+    prog.days[1] = pid % 7;
+    for (int i=0; i<MAX_NUM_STARTTIMES; i++) prog.starttimes[i] = 60*(i+1) + pid;
+    for (int sid=0; sid<os.nstations; sid++) durations[sid] = (pid + sid) % 200;
+    snprintf(prog.name, PROGRAM_NAME_SIZE, "Program %d", pid+1);
+    pd.add(&prog);
+  }
+}
+
+/** Best time of a renderer, in ns per call, and the bytes of a call */
+static double bench_run(void (*render)(), size_t *bytes) {
+  double best = 0;
+  bfill = BufferFiller(ether_buffer, ETHER_BUFFER_SIZE, bench_flush);
+  bench_bytes = 0;
+  for (int r=0; r<nruns; r++) {
+    double t0 = now_ns();
+    for (int i=0; i<ncalls; i++) render();
+    double t = (now_ns() - t0) / ncalls;
+    if (r == 0 || t < best) best = t;
+  }
+  bench_flush();
+  *bytes = bench_bytes / ((size_t)ncalls * nruns);
+  return best;
+}
+
+static void bench_remove(const char *dir) {
+  DIR *d = opendir(dir);
+  if (!d) return;
+  struct dirent *e;
+  char name[PATH_MAX];
+  while ((e = readdir(d)) != NULL) {
+    if (e->d_name[0] == '.') continue;
+    snprintf(name, sizeof(name), "%s/%s", dir, e->d_name);
+    unlink(name);
+  }
+  closedir(d);
+  rmdir(dir);
+}
+
+static void bench_usage(const char *name) {
+  printf("Usage: %s [-b boards] [-p programs] [-n calls] [-r runs]\n", name);
+  printf("  -b boards   boards of 8 stations (default %d)\n", nboards);
+  printf("  -p programs programs (default %d)\n", nprogs);
+  printf("  -n calls    calls of each renderer per run (default %d)\n", ncalls);
+  printf("  -r runs     runs, the best one is reported (default %d)\n", nruns);
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  while((opt = getopt(argc, argv, "b:p:n:r:h")) != -1) {
+    switch(opt) {
+    case 'b': nboards = atoi(optarg); break;
+    case 'p': nprogs = atoi(optarg); break;
+    case 'n': ncalls = atoi(optarg); break;
+    case 'r': nruns = atoi(optarg); break;
+    default:
+      bench_usage(argv[0]);
+      return (opt=='h') ? 0 : 1;
+    }
+  }
+  if (nboards < 1 || nboards > MAX_EXT_BOARDS+1 || nprogs < 1 || nprogs > MAX_NUMBER_PROGRAMS ||
+      ncalls < 1 || nruns < 1) {
+    bench_usage(argv[0]);
+    return 1;
+  }
+
+  char dir[] = "/tmp/jsonbench.XXXXXX";
+  if (!mkdtemp(dir) || chdir(dir)) {
+    perror(dir);
+    return 1;
+  }
+  set_runtime_path("./");
+  initialiseEpoch();
+  os.begin();
+  os.options_setup();
+  pd.init();
+  bench_data();
+
+  // fields: the values written from arguments
+  long jc_fields = 17 + os.nboards + 3*os.nstations;
+  long jp_fields = 5 + nprogs * (3 + MAX_NUM_STARTTIMES + os.nstations + 1);
+  size_t jc_bytes, jp_bytes;
+  double jc = bench_run(server_json_controller_main, &jc_bytes);
+  double jp = bench_run(render_json_programs, &jp_bytes);
+
+  printf("%d stations, %d programs, best of %d runs of %d calls\n", os.nstations, nprogs, nruns, ncalls);
+  printf("server_json_controller_main  %8.0f ns/call  %6.1f ns/field  %ld fields  %zu bytes\n",
+         jc, jc/jc_fields, jc_fields, jc_bytes);
+  printf("render_json_programs         %8.0f ns/call  %6.1f ns/field  %ld fields  %zu bytes\n",
+         jp, jp/jp_fields, jp_fields, jp_bytes);
+
+  bench_remove(dir);
+  return 0;
+}
@@ -23,6 +23,7 @@
 
 #include <limits.h>
 #include <iostream> 
+#include <signal.h>
 
 #include "OpenHome.h"
 #include "program.h"
@@ -31,10 +32,11 @@
 #include "etherport.h"
 #include "server.h"
 #include "gpio.h"
+#include "sim.h"
  
-char ether_buffer[ETHER_BUFFER_SIZE];
+thread_local char ether_buffer[ETHER_BUFFER_SIZE];
 EthernetServer *m_server = 0;
-EthernetClient *m_client = 0;
+thread_local EthernetClient *m_client = 0;
 
 // Small variations have been added to the timing values below
 // to minimize conflicting events
@@ -46,12 +48,14 @@ EthernetClient *m_client = 0;
 #define LCD_BACKLIGHT_TIMEOUT   15      // LCD backlight timeout: 15 secs
 #define PING_TIMEOUT            200     // Ping test timeout: 200 ms
 
-extern char tmp_buffer[];       // scratch buffer
-BufferFiller bfill;             // buffer filler
+extern thread_local char tmp_buffer[];  // scratch buffer
+thread_local BufferFiller bfill;       // buffer filler
+static int http_workers = -1;   // number of http worker threads, -1: one per core
 
 // ====== Object defines ======
 OpenHome os; // OpenHome object
 ProgramData pd;   // ProgramdData object
+SchedulerStats sched_stats;
 
 volatile ulong flow_count = 0;
 /** Flow sensor interrupt service routine */
@@ -64,6 +68,8 @@ void flow_isr() {
 }
 
 
+void server_start_workers(int n);
+
 void do_setup() {
   initialiseEpoch();   // initialize time reference for millis() and micros()
   os.begin();          // OpenHome init
@@ -71,7 +77,9 @@ void do_setup() {
 
   pd.init();            // ProgramData init
 
-  if (os.start_network()) {  // initialize network
+  if (sim_active()) {  // the network is simulated
+    os.status.network_fails = 0;
+  } else if (os.start_network()) {  // initialize network
     DEBUG_PRINTLN("network established.");
     os.status.network_fails = 0;
   } else {
@@ -79,54 +87,178 @@ void do_setup() {
     os.status.network_fails = 1;
   }
   os.status.req_network = 0;
+
+  if (http_workers < 0) http_workers = sysconf(_SC_NPROCESSORS_ONLN);
+  server_start_workers(http_workers);
 }
 
 void write_log(byte type, ulong curr_time);
 void schedule_all_stations(ulong curr_time);
-void turn_off_station(byte sid, ulong curr_time);
+void turn_off_station(uint16_t sid, ulong curr_time);
+static void run_station(uint16_t sid, ulong curr_time);
 void process_dynamic_events(ulong curr_time);
 void check_network();
 void check_weather();
 void perform_ntp_sync();
 void delete_log(char *name);
 void handle_web_request(char *p);
+bool server_dispatch(EthernetClient &client);
+bool server_run_commands();
+void server_push_events();
+void state_lock();
+void state_unlock();
+
+static inline void event_at(ulong *next, ulong curr_time, ulong t) {
+  if (t > curr_time && t < *next) *next = t;
+}
+
+/** Time of the next scheduler event
+ * The first second after curr_time at which a pass of the scheduler
+ * has something to do: a program start, a station or master turning on
+ * or off, the end of a rain delay, a weather, network or ntp check, or
+ * an nvm write-back. Until then the main loop only serves requests.
+ */
+static ulong next_event(ulong curr_time) {
+  ulong soon = curr_time+1;
+  if (os.button_timeout) return soon;
+  if (os.status.rain_delayed != os.old_status.rain_delayed) return soon;
+  if (!os.status.rain_delayed && os.nvdata.rd_stop_time > curr_time) return soon;
+  if (os.status.program_busy && !pd.nqueue) return soon;
+
+  ulong next = curr_time + CHECK_NETWORK_INTERVAL - curr_time % CHECK_NETWORK_INTERVAL;
+  event_at(&next, curr_time, curr_time + NTP_SYNC_INTERVAL - curr_time % NTP_SYNC_INTERVAL);
+  event_at(&next, curr_time, pd.index_next_due(curr_time/60) * 60);
+  if (os.status.rain_delayed) event_at(&next, curr_time, os.nvdata.rd_stop_time);
+
+  // stations turning on and off, and the masters following them
+  if (os.status.program_busy) {
+    byte mas_on_adj = os.options[OPTION_MASTER_ON_ADJ];
+    byte mas_off_adj= os.options[OPTION_MASTER_OFF_ADJ];
+    byte mas_on_adj_2 = os.options[OPTION_MASTER_ON_ADJ_2];
+    byte mas_off_adj_2= os.options[OPTION_MASTER_OFF_ADJ_2];
+    if (pd.nedges) {
+      if (pd.edge_next() <= curr_time) return soon;
+      event_at(&next, curr_time, pd.edge_next());
+    }
+    // running stations are the first of their queue elements
+    for(uint16_t i=0;i<pd.nedges;i++) {
+      RuntimeQueueStruct *q = pd.queue + pd.station_qid[pd.edge_heap[i]];
+      if (os.status.mas) {
+        event_at(&next, curr_time, q->st + mas_on_adj);
+        event_at(&next, curr_time, q->st + q->dur + mas_off_adj - 60 + 1);
+      }
+      if (os.status.mas2) {
+        event_at(&next, curr_time, q->st + mas_on_adj_2);
+        event_at(&next, curr_time, q->st + q->dur + mas_off_adj_2 - 60 + 1);
+      }
+    }
+  }
+
+  if (os.options[OPTION_SENSOR_TYPE]==SENSOR_TYPE_FLOW) {
+    event_at(&next, curr_time, curr_time + FLOWCOUNT_RT_WINDOW - curr_time % FLOWCOUNT_RT_WINDOW);
+  }
+
+  // see check_weather
+  if (!(os.status.network_fails>0 || os.status.program_busy || os.options[OPTION_REMOTE_EXT_MODE])) {
+    if (!os.checkwt_lasttime) return soon;
+    event_at(&next, curr_time, os.checkwt_lasttime + CHECK_WEATHER_TIMEOUT + 1);
+    if (os.checkwt_success_lasttime) {
+      event_at(&next, curr_time, os.checkwt_success_lasttime + CHECK_WEATHER_SUCCESS_TIMEOUT + 1);
+    }
+  }
+
+  long wait = nvm_flush_wait();
+  if (wait >= 0) event_at(&next, curr_time, curr_time + (wait > 1000 ? (wait+999)/1000 : 1));
+  return next;
+}
+
+/** Account a scheduler pass that ran late_us past its deadline */
+static void sched_stats_add(ulong late_us, bool switched) {
+  sched_stats.runs++;
+  sched_stats.late_sum += late_us;
+  if (late_us > sched_stats.late_max) sched_stats.late_max = late_us;
+  if (switched) {
+    sched_stats.switches++;
+    sched_stats.switch_late_sum += late_us;
+    if (late_us > sched_stats.switch_late_max) sched_stats.switch_late_max = late_us;
+  }
+}
+
+/** Whether master station mas must be on
+ * It is, if a station set to activate it (in masop) is running within
+ * the on/off adjustments. Stations are masked a word at a time, and only
+ * the ones both running and set to activate the master are looked at.
+ */
+static byte master_needed(uint16_t mas, const uint64_t masop[], byte on_adj, byte off_adj, ulong curr_time) {
+  uint16_t nwords = (os.nstations+63)>>6;
+  for(uint16_t w=0;w<nwords;w++) {
+    uint64_t bits = os.station_bits[w] & masop[w];
+    if ((mas>>6) == w) bits &= ~((uint64_t)1<<(mas&63));  // not the master itself
+    while (bits) {
+      uint16_t sid = (w<<6) + __builtin_ctzll(bits);
+      bits &= bits-1;
+      uint16_t qid = pd.station_qid[sid];
+      if (qid == 0xFFFF) continue;  // a station bit without a schedule, e.g. a former master
+      RuntimeQueueStruct *q = pd.queue+qid;
+      // check if timing is within the acceptable range
+      if (curr_time >= q->st + on_adj &&
+          curr_time <= q->st + q->dur + off_adj - 60) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
 
 /** Main Loop */
 void do_loop()
 {
   static ulong last_time = 0;
   static ulong last_minute = 0;
+  static ulong next_time = 0;   // next scheduler event, 0 runs the scheduler right away
 
-  byte bid, sid, s, pid, qid, bitvalue;
+  uint16_t sid;
+  uint16_t pid;
   ProgramStruct prog;
+  byte durations[MAX_NUM_STATIONS];
+  prog.durations = durations;
 
-  os.status.mas = os.options[OPTION_MASTER_STATION];
-  os.status.mas2= os.options[OPTION_MASTER_STATION_2];
-  time_t curr_time = os.now_tz();
   // ====== Process Ethernet packets ======
-  EthernetClient client = m_server->available();
-  if (client) {
-    while(true) {
-      int len = client.read((uint8_t*) ether_buffer, ETHER_BUFFER_SIZE);
-      if (len <=0) {
-        if(!client.connected()) {
-          break;
-        } else {
-          continue;
-        }
-      } else {
-        m_client = &client;
-        ether_buffer[len] = 0;  // put a zero at the end of the packet
-        handle_web_request(ether_buffer);
-        m_client = 0;
-        break;
-      }
-    }
+  // network events are processed until the next scheduler event is due
+  bool changed;
+  if (sim_active()) {
+    // simulated: the clock skips to the next event, scripted requests are served
+    changed = sim_wait(next_time ? next_time - os.tz_offset() : 0);
+  } else {
+    if (next_time) m_server->wake_at(next_time - os.tz_offset());
+    EthernetClient client = m_server->available(next_time ? -1 : 0);
+    changed = client && server_dispatch(client);
   }
 
-  // if 1 second has passed
-  if (last_time != curr_time) {
+  // http workers read the controller state while the loop waits above,
+  // from here on it is changed
+  state_lock();
+  sched_stats.wakeups++;
+  os.masters_load();
+
+  // run the requests that change state
+  if (server_run_commands()) changed = true;
+
+  struct timespec ts;
+  clock_now(&ts);
+  time_t curr_time = ts.tv_sec + os.tz_offset();
+
+  // state changes are acted on at the next second
+  ulong deadline = next_time;
+  if (changed && next_time > last_time+1) next_time = last_time+1;
+
+  // if the next event is due, or the clock went back
+  if ((curr_time >= next_time && curr_time != last_time) || curr_time < last_time) {
+    bool timed = (deadline == next_time && deadline && curr_time >= last_time);
+    ulong prev_time = last_time;
     last_time = curr_time;
+    uint64_t old_bits[STATION_WORDS];
+    memcpy(old_bits, os.station_bits, sizeof(old_bits));
     if (os.button_timeout) os.button_timeout--;
     
     // ====== Check raindelay status ======
@@ -179,67 +311,53 @@ void do_loop()
     // we only need to check once every minute
     if (curr_minute != last_minute) {
       last_minute = curr_minute;
-      // check through all programs
-      for(pid=0; pid<pd.nprograms; pid++) {
+      // get the programs that start this minute
+      uint16_t due_pids[MAX_NUMBER_PROGRAMS];
+      uint16_t ndue = pd.index_pop_due(curr_minute, due_pids);
+      for(uint16_t i=0; i<ndue; i++) {
+        pid = due_pids[i];
         pd.read(pid, &prog);
-        if(prog.check_match(curr_time)) {
-          // program match found
-          // process all selected stations
-          for(sid=0;sid<os.nstations;sid++) {
-            bid=sid>>3;
-            s=sid&0x07;
-            // skip if the station is a master station (because master cannot be scheduled independently
-            if ((os.status.mas==sid+1) || (os.status.mas2==sid+1))
-              continue;
-
-            // if station has non-zero water time and the station is not disabled
-            if (prog.durations[sid] && !(os.station_attrib_bits_read(ADDR_NVM_STNDISABLE+bid)&(1<<s))) {
-              // water time is scaled by watering percentage
-              ulong water_time = water_time_resolve(water_time_decode(prog.durations[sid]));
-              // if the program is set to use weather scaling
-              if (prog.use_weather) {
-                byte wl = os.options[OPTION_WATER_PERCENTAGE];
-                water_time = water_time * wl / 100;
-                if (wl < 20 && water_time < 10) // if water_percentage is less than 20% and water_time is less than 10 seconds
-                                                // do not water
-                  water_time = 0;
-              }
+        // program match found
+        // process all selected stations
+        for(sid=0;sid<os.nstations;sid++) {
+          // skip if the station is a master station (because master cannot be scheduled independently
+          if ((os.status.mas==sid+1) || (os.status.mas2==sid+1))
+            continue;
+
+          // if station has non-zero water time and the station is not disabled
+          if (prog.durations[sid] && !station_bit(os.attrib_dis, sid)) {
+            // water time is scaled by watering percentage
+            ulong water_time = water_time_resolve(water_time_decode(prog.durations[sid]));
+            // if the program is set to use weather scaling
+            if (prog.use_weather) {
+              byte wl = os.options[OPTION_WATER_PERCENTAGE];
+              water_time = water_time * wl / 100;
+              if (wl < 20 && water_time < 10) // if water_percentage is less than 20% and water_time is less than 10 seconds
+                                              // do not water
+                water_time = 0;
+            }
 
-              if (water_time) {
-                // check if water time is still valid
-                // because it may end up being zero after scaling
-                q = pd.enqueue();
-                if (q) {
-                  q->st = 0;
-                  q->dur = water_time;
-                  q->sid = sid;
-                  q->pid = pid+1;
-                  match_found = true;
-                } else {
-                  // queue is full
-                }
-              }// if water_time
-            }// if prog.durations[sid]
-          }// for sid
-        }// if check_match
-      }// for pid
+            if (water_time) {
+              // check if water time is still valid
+              // because it may end up being zero after scaling
+              q = pd.enqueue();
+              if (q) {
+                q->st = 0;
+                q->dur = water_time;
+                q->sid = sid;
+                q->pid = pid+1;
+                match_found = true;
+              } else {
+                // queue is full
+              }
+            }// if water_time
+          }// if prog.durations[sid]
+        }// for sid
+      }// for due programs
 
       // calculate start and end time
       if (match_found) {
         schedule_all_stations(curr_time);
-
-        // For debugging: print out queued elements
-        DEBUG_PRINT("en:");
-        for(q=pd.queue;q<pd.queue+pd.nqueue;q++) {
-          DEBUG_PRINT("[");
-          DEBUG_PRINT(q->sid);
-          DEBUG_PRINT(",");
-          DEBUG_PRINT(q->dur);
-          DEBUG_PRINT(",");
-          DEBUG_PRINT(q->st);
-          DEBUG_PRINT("]");
-        }
-        DEBUG_PRINTLN("");
       }
     }//if_check_current_minute
 
@@ -247,57 +365,9 @@ void do_loop()
     // Check if a program is running currently
     // If so, do station run-time keeping
     if (os.status.program_busy){
-      // first, go through run time queue to assign queue elements to stations
-      q = pd.queue;
-      qid=0;
-      for(;q<pd.queue+pd.nqueue;q++,qid++) {
-        sid=q->sid;
-        byte sqi=pd.station_qid[sid];
-        // skip if station is already assigned a queue element
-        // and that queue element has an earlier start time
-        if(sqi<255 && pd.queue[sqi].st<q->st) continue;
-        // otherwise assign the queue element to station
-        pd.station_qid[sid]=qid;
-      }
-      // next, go through the stations and perform time keeping
-      for(bid=0;bid<os.nboards; bid++) {
-        bitvalue = os.station_bits[bid];
-        for(s=0;s<8;s++) {
-          byte sid = bid*8+s;
-
-          // skip master station
-          if (os.status.mas == sid+1) continue;
-          if (os.status.mas2== sid+1) continue;
-          if (pd.station_qid[sid]==255) continue;
-
-          q = pd.queue + pd.station_qid[sid];
-          // check if this station is scheduled, either running or waiting to run
-          if (q->st > 0) {
-            // if so, check if we should turn it off
-            if (curr_time >= q->st+q->dur) {
-              turn_off_station(sid, curr_time);
-            }
-          }
-          // if current station is not running, check if we should turn it on
-          if(!((bitvalue>>s)&1)) {
-            if (curr_time >= q->st && curr_time < q->st+q->dur) {
-
-              //turn_on_station(sid);
-              std::cout << "Turning on station " << sid << std::endl;
-              os.set_station_bit(sid, 1);
-
-            } //if curr_time > scheduled_start_time
-          } // if current station is not running
-        }//end_s
-      }//end_bid
-
-      // finally, go through the queue again and clear up elements marked for removal
-      int qi;
-      for(qi=pd.nqueue-1;qi>=0;qi--) {
-        q=pd.queue+qi;
-        if(!q->dur || curr_time>=q->st+q->dur)  {
-          pd.dequeue(qi);
-        }
+      // only the stations whose next start or stop has come are touched
+      while ((sid = pd.edge_due(curr_time)) != 0xFFFF) {
+        run_station(sid, curr_time);
       }
 
       // process dynamic events
@@ -306,26 +376,6 @@ void do_loop()
       // activate / deactivate valves
       os.apply_all_station_bits();
 
-      // check through runtime queue, calculate the last stop time of sequential stations
-      pd.last_seq_stop_time = 0;
-      ulong sst;
-      byte re=os.options[OPTION_REMOTE_EXT_MODE];
-      q = pd.queue;
-      for(;q<pd.queue+pd.nqueue;q++) {
-        sid = q->sid;
-        bid = sid>>3;
-        s = sid&0x07;
-        // check if any sequential station has a valid stop time
-        // and the stop time must be larger than curr_time
-        sst = q->st + q->dur;
-        if (sst>curr_time) {
-          // only need to update last_seq_stop_time for sequential stations
-          if (os.station_attrib_bits_read(ADDR_NVM_STNSEQ+bid)&(1<<s) && !re) {
-            pd.last_seq_stop_time = (sst>pd.last_seq_stop_time ) ? sst : pd.last_seq_stop_time;
-          }
-        }
-      }
-
       // if the runtime queue is empty
       // reset all stations
       if (!pd.nqueue) {
@@ -342,57 +392,20 @@ void do_loop()
         }
 
         // in case some options have changed while executing the program
-        os.status.mas = os.options[OPTION_MASTER_STATION]; // update master station
-        os.status.mas2= os.options[OPTION_MASTER_STATION_2]; // update master2 station
+        os.masters_load(); // update master stations
       }
     }//if_some_program_is_running
 
     // handle master
     if (os.status.mas>0) {
-      byte mas_on_adj = os.options[OPTION_MASTER_ON_ADJ];
-      byte mas_off_adj= os.options[OPTION_MASTER_OFF_ADJ];
-      byte masbit = 0;
-      os.station_attrib_bits_load(ADDR_NVM_MAS_OP, (byte*)tmp_buffer);  // tmp_buffer now stores masop_bits
-      for(sid=0;sid<os.nstations;sid++) {
-        // skip if this is the master station
-        if (os.status.mas == sid+1) continue;
-        bid = sid>>3;
-        s = sid&0x07;
-        // if this station is running and is set to activate master
-        if ((os.station_bits[bid]&(1<<s)) && (tmp_buffer[bid]&(1<<s))) {
-          q=pd.queue+pd.station_qid[sid];
-          // check if timing is within the acceptable range
-          if (curr_time >= q->st + mas_on_adj &&
-              curr_time <= q->st + q->dur + mas_off_adj - 60) {
-            masbit = 1;
-            break;
-          }
-        }
-      }
+      byte masbit = master_needed(os.status.mas-1, os.attrib_mas, os.options[OPTION_MASTER_ON_ADJ],
+                                  os.options[OPTION_MASTER_OFF_ADJ], curr_time);
       os.set_station_bit(os.status.mas-1, masbit);
     }
     // handle master2
     if (os.status.mas2>0) {
-      byte mas_on_adj_2 = os.options[OPTION_MASTER_ON_ADJ_2];
-      byte mas_off_adj_2= os.options[OPTION_MASTER_OFF_ADJ_2];
-      byte masbit2 = 0;
-      os.station_attrib_bits_load(ADDR_NVM_MAS_OP_2, (byte*)tmp_buffer);  // tmp_buffer now stores masop2_bits
-      for(sid=0;sid<os.nstations;sid++) {
-        // skip if this is the master station
-        if (os.status.mas2 == sid+1) continue;
-        bid = sid>>3;
-        s = sid&0x07;
-        // if this station is running and is set to activate master
-        if ((os.station_bits[bid]&(1<<s)) && (tmp_buffer[bid]&(1<<s))) {
-          q=pd.queue+pd.station_qid[sid];
-          // check if timing is within the acceptable range
-          if (curr_time >= q->st + mas_on_adj_2 &&
-              curr_time <= q->st + q->dur + mas_off_adj_2 - 60) {
-            masbit2 = 1;
-            break;
-          }
-        }
-      }
+      byte masbit2 = master_needed(os.status.mas2-1, os.attrib_mas2, os.options[OPTION_MASTER_ON_ADJ_2],
+                                   os.options[OPTION_MASTER_OFF_ADJ_2], curr_time);
       os.set_station_bit(os.status.mas2-1, masbit2);
     }    
 
@@ -405,26 +418,39 @@ void do_loop()
     // real-time flow count
     static ulong flowcount_rt_start = 0;
     if (os.options[OPTION_SENSOR_TYPE]==SENSOR_TYPE_FLOW) {
-      if (curr_time % FLOWCOUNT_RT_WINDOW == 0) {
+      if (curr_time / FLOWCOUNT_RT_WINDOW != prev_time / FLOWCOUNT_RT_WINDOW) {
         os.flowcount_rt = (flow_count > flowcount_rt_start) ? flow_count - flowcount_rt_start: 0;
         flowcount_rt_start = flow_count;
       }
     }
 
     // perform ntp sync
-    if (curr_time % NTP_SYNC_INTERVAL == 0) os.status.req_ntpsync = 1;
+    if (prev_time && curr_time / NTP_SYNC_INTERVAL != prev_time / NTP_SYNC_INTERVAL) os.status.req_ntpsync = 1;
     perform_ntp_sync();
 
     // check network connection
-    if (curr_time && (curr_time % CHECK_NETWORK_INTERVAL==0))  os.status.req_network = 1;
+    if (prev_time && curr_time / CHECK_NETWORK_INTERVAL != prev_time / CHECK_NETWORK_INTERVAL)  os.status.req_network = 1;
     check_network();
 
     // check weather
     check_weather();
 
+    // write back nvm changes that are due
+    nvm_flush_check();
+
+    // compact the program store file when needed
+    pd.compact_check();
+
+    if (timed) {
+      ulong late_us = (ulong)(curr_time - deadline)*1000000UL + ts.tv_nsec/1000;
+      sched_stats_add(late_us, memcmp(old_bits, os.station_bits, sizeof(old_bits)) != 0);
+    }
+    next_time = next_event(curr_time);
   }
 
-  delay(1); // For OSPI/OSBO/LINUX, sleep 1 ms to minimize CPU usage
+  // tell the event stream subscribers what has changed
+  server_push_events();
+  state_unlock();
 }
 
 /** Make weather query */
@@ -453,12 +479,12 @@ void check_weather() {
  * This function turns off a scheduled station
  * and writes log record
  */
-void turn_off_station(byte sid, ulong curr_time) {
+void turn_off_station(uint16_t sid, ulong curr_time) {
   os.set_station_bit(sid, 0);
 
-  byte qid = pd.station_qid[sid];
+  uint16_t qid = pd.station_qid[sid];
   // ignore if we are turning off a station that's not running or scheduled to run
-  if (qid>=pd.nqueue)  return;
+  if (qid==0xFFFF)  return;
 
   RuntimeQueueStruct *q = pd.queue+qid;
 
@@ -471,15 +497,41 @@ void turn_off_station(byte sid, ulong curr_time) {
       pd.lastrun.program = q->pid;
       pd.lastrun.duration = curr_time - q->st;
       pd.lastrun.endtime = curr_time;
+      os.events |= EVENT_QUEUE;
 
       // log station run
       write_log(LOGDATA_STATION, curr_time);
     }
   }
 
-  // dequeue the element
+  // dequeue the element, the station's next one (if any) takes its place
   pd.dequeue(qid);
-  pd.station_qid[sid] = 0xFF;
+}
+
+/** Start or stop a station whose next start or stop time has come
+ * The element that ended is logged, elements that ended or were
+ * cancelled while waiting behind it are dropped, and the station is
+ * turned on if its next element has started.
+ */
+static void run_station(uint16_t sid, ulong curr_time) {
+  // masters cannot be scheduled independently, their elements just expire
+  bool master = (os.status.mas==sid+1) || (os.status.mas2==sid+1);
+  RuntimeQueueStruct *q = pd.queue + pd.station_qid[sid];
+  if (!master && curr_time >= q->st+q->dur) {
+    turn_off_station(sid, curr_time);
+  }
+  uint16_t qid;
+  while ((qid = pd.station_qid[sid]) != 0xFFFF) {
+    q = pd.queue + qid;
+    if (q->dur && curr_time < q->st+q->dur) break;
+    pd.dequeue(qid);
+  }
+  if (!master && qid != 0xFFFF && curr_time >= q->st && !station_bit(os.station_bits, sid)) {
+    //turn_on_station(sid);
+    std::cout << "Turning on station " << sid << std::endl;
+    os.set_station_bit(sid, 1);
+  }
+  pd.edge_update(sid);
 }
 
 /** Process dynamic events
@@ -494,30 +546,51 @@ void process_dynamic_events(ulong curr_time) {
     rain = true;
   }
 
-  byte sid, s, bid, qid, rbits;
-  for(bid=0;bid<os.nboards;bid++) {
-    rbits = os.station_attrib_bits_read(ADDR_NVM_IGNRAIN+bid);
-    for(s=0;s<8;s++) {
-      sid=bid*8+s;
+  if (en && !rain) return;
+
+  // stations to cut: scheduled ones, less those that ignore rain
+  // if the controller is enabled (and so it is raining)
+  uint16_t nwords = (os.nstations+63)>>6;
+  for(uint16_t w=0;w<nwords;w++) {
+    uint64_t bits = pd.edge_bits[w];
+    if (en) bits &= ~os.attrib_igrn[w];
+    // turn_off_station only changes the bit of its own station
+    while (bits) {
+      uint16_t sid = (w<<6) + __builtin_ctzll(bits);
+      bits &= bits-1;
 
-      // ignore master stations because they are handled separately      
+      // ignore master stations because they are handled separately
       if (os.status.mas == sid+1) continue;
-      if (os.status.mas2== sid+1) continue;      
-      // If this is a normal program (not a run-once or test program)
-      // and either the controller is disabled, or
-      // if raining and ignore rain bit is cleared
-      // FIX ME
-      qid = pd.station_qid[sid];
-      if(qid==255) continue;
-      RuntimeQueueStruct *q = pd.queue + qid;
-
-      if ((q->pid<99) && (!en || (rain && !(rbits&(1<<s)))) ) {
+      if (os.status.mas2== sid+1) continue;
+      // turn off normal programs (not run-once or test programs)
+      uint16_t qid;
+      while ((qid = pd.station_qid[sid]) != 0xFFFF && pd.queue[qid].pid<QUEUE_PID_MANUAL) {
         turn_off_station(sid, curr_time);
       }
     }
   }
 }
 
+/** The last stop time of a sequential station, if later than curr_time */
+static ulong last_seq_stop_time(ulong curr_time) {
+  if (os.options[OPTION_REMOTE_EXT_MODE]) return 0;
+  ulong last = 0;
+  uint16_t nwords = (os.nstations+63)>>6;
+  for(uint16_t w=0;w<nwords;w++) {
+    uint64_t bits = pd.edge_bits[w] & os.attrib_seq[w];
+    while (bits) {
+      uint16_t sid = (w<<6) + __builtin_ctzll(bits);
+      bits &= bits-1;
+      for(uint16_t qid=pd.station_qid[sid];qid!=0xFFFF;qid=pd.queue[qid].next) {
+        RuntimeQueueStruct *q = pd.queue+qid;
+        ulong sst = q->st + q->dur;
+        if (q->dur && sst > curr_time && sst > last) last = sst;
+      }
+    }
+  }
+  return last;
+}
+
 /** Scheduler
  * This function loops through the queue
  * and schedules the start time of each station
@@ -529,23 +602,21 @@ void schedule_all_stations(ulong curr_time) {
 
   int16_t station_delay = water_time_decode_signed(os.options[OPTION_STATION_DELAY_TIME]);
   // if the sequential queue has stations running
-  if (pd.last_seq_stop_time > curr_time) {
-    seq_start_time = pd.last_seq_stop_time + station_delay;
+  ulong seq_stop_time = last_seq_stop_time(curr_time);
+  if (seq_stop_time > curr_time) {
+    seq_start_time = seq_stop_time + station_delay;
   }
 
-  RuntimeQueueStruct *q = pd.queue;
   byte re = os.options[OPTION_REMOTE_EXT_MODE];
-  // go through runtime queue and calculate start time of each station
-  for(;q<pd.queue+pd.nqueue;q++) {
-    if(q->st) continue; // if this queue element has already been scheduled, skip
+  // go through the new queue elements and calculate start time of each station
+  for(uint16_t i=0;i<pd.npending;i++) {
+    RuntimeQueueStruct *q = pd.queue + pd.pending[i];
     if(!q->dur) continue; // if the element has been marked to reset, skip
-    byte sid=q->sid;
-    byte bid=sid>>3;
-    byte s=sid&0x07;
+    uint16_t sid=q->sid;
 
     // if this is a sequential station and the controller is not in remote extension mode
     // use sequential scheduling. station delay time apples
-    if (os.station_attrib_bits_read(ADDR_NVM_STNSEQ+bid)&(1<<s) && !re) {
+    if (station_bit(os.attrib_seq, sid) && !re) {
       // sequential scheduling
       q->st = seq_start_time;
       seq_start_time += q->dur;
@@ -556,6 +627,7 @@ void schedule_all_stations(ulong curr_time) {
       // stagger concurrent stations by 1 second
       con_start_time++;
     }
+    os.events |= EVENT_QUEUE;
     DEBUG_PRINT("[");
     DEBUG_PRINT(sid);
     DEBUG_PRINT(":");
@@ -573,6 +645,7 @@ void schedule_all_stations(ulong curr_time) {
       }
     }
   }
+  pd.insert_pending();
 }
 
 /** Immediately reset all stations
@@ -591,45 +664,51 @@ void reset_all_stations_immediate() {
  * Stations will be logged
  */
 void reset_all_stations() {
-  RuntimeQueueStruct *q = pd.queue;
   // go through runtime queue and assign water time to 0
-  for(;q<pd.queue+pd.nqueue;q++) {
-    q->dur = 0;
+  uint16_t sids[MAX_NUM_STATIONS];
+  uint16_t n = pd.nedges;
+  memcpy(sids, pd.edge_heap, n*sizeof(uint16_t));
+  for(uint16_t i=0;i<n;i++) {
+    for(uint16_t qid=pd.station_qid[sids[i]];qid!=0xFFFF;qid=pd.queue[qid].next) {
+      pd.queue[qid].dur = 0;
+    }
+    pd.edge_update(sids[i]);
   }
+  os.events |= EVENT_QUEUE;
 }
 
 
 /** Manually start a program
  * If pid==0, this is a test program (1 minute per station)
- * If pid==255, this is a short test program (2 second per station)
+ * If pid==0xFFFF, this is a short test program (2 second per station)
  * If pid > 0. run program pid-1
  */
-void manual_start_program(byte pid, byte uwt) {
+void manual_start_program(uint16_t pid, byte uwt) {
   boolean match_found = false;
   reset_all_stations_immediate();
   ProgramStruct prog;
+  byte durations[MAX_NUM_STATIONS];
+  prog.durations = durations;
   ulong dur;
-  byte sid, bid, s;
-  if ((pid>0)&&(pid<255)) {
+  uint16_t sid;
+  if ((pid>0)&&(pid<0xFFFF)) {
     pd.read(pid-1, &prog);
   }
   for(sid=0;sid<os.nstations;sid++) {
-    bid=sid>>3;
-    s=sid&0x07;
     dur = 60;
-    if(pid==255)  dur=2;
+    if(pid==0xFFFF)  dur=2;
     else if(pid>0)
       dur = water_time_resolve(water_time_decode(prog.durations[sid]));
     if(uwt) {
       dur = dur * os.options[OPTION_WATER_PERCENTAGE] / 100;
     }
-    if(dur>0 && !(os.station_attrib_bits_read(ADDR_NVM_STNDISABLE+bid)&(1<<s))) {
+    if(dur>0 && !station_bit(os.attrib_dis, sid)) {
       RuntimeQueueStruct *q = pd.enqueue();
       if (q) {
         q->st = 0;
         q->dur = dur;
         q->sid = sid;
-        q->pid = 254;
+        q->pid = QUEUE_PID_RUNONCE;
         match_found = true;
       }
     }
@@ -690,7 +769,7 @@ void write_log(byte type, ulong curr_time) {
   strcpy_P(tmp_buffer, PSTR("["));
 
   if(type == LOGDATA_STATION) {
-    itoa(pd.lastrun.program, tmp_buffer+strlen(tmp_buffer), 10);
+    itoa(pd.report_pid(pd.lastrun.program), tmp_buffer+strlen(tmp_buffer), 10);
     strcat_P(tmp_buffer, PSTR(","));
     itoa(pd.lastrun.station, tmp_buffer+strlen(tmp_buffer), 10);
     strcat_P(tmp_buffer, PSTR(","));
@@ -760,11 +839,71 @@ void perform_ntp_sync() {
   return;
 }
 
+static volatile sig_atomic_t quit_requested = 0;
+
+/** Termination signal handler, lets the main loop exit cleanly */
+static void handle_quit(int sig) {
+  quit_requested = 1;
+}
+
+/** Print command line usage */
+static void usage(const char *name) {
+  printf("Usage: %s [-n seconds] [-w threads] [-z level] [-Z bytes] [-S script [-o file]]\n", name);
+  printf("  -n seconds  nvm write-back interval (default %d, 0 writes through)\n", NVM_FLUSH_INTERVAL);
+  printf("  -w threads  http worker threads (default one per core, at most %d, 0 serves requests in the main loop)\n", HTTP_MAX_WORKERS);
+  printf("  -z level    compression level of http responses, 1-9 (default %d, 0 disables compression)\n", ETHER_GZIP_LEVEL);
+  printf("  -Z bytes    smallest http response body that is compressed (default %d)\n", ETHER_GZIP_MIN_SIZE);
+  printf("  -S script   simulate the script on a virtual clock, with the data files in the current directory (see sim.cpp)\n");
+  printf("  -o file     record of the simulation (default stdout)\n");
+}
+
 int main(int argc, char *argv[]) {
+  int opt;
+  const char *sim_script = NULL, *sim_record = NULL;
+  while((opt = getopt(argc, argv, "n:w:z:Z:S:o:h")) != -1) {
+    switch(opt) {
+    case 'n':
+      nvm_flush_interval = strtoul(optarg, NULL, 10);
+      break;
+    case 'w':
+      http_workers = atoi(optarg);
+      break;
+    case 'z':
+      ether_gzip_level = atoi(optarg);
+      if (ether_gzip_level < 0 || ether_gzip_level > 9) ether_gzip_level = ETHER_GZIP_LEVEL;
+      break;
+    case 'Z':
+      ether_gzip_min_size = strtoul(optarg, NULL, 10);
+      break;
+    case 'S':
+      sim_script = optarg;
+      break;
+    case 'o':
+      sim_record = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return (opt=='h') ? 0 : 1;
+    }
+  }
+
+  signal(SIGINT, handle_quit);
+  signal(SIGTERM, handle_quit);
+
+  if (sim_script) {
+    if (!sim_begin(sim_script, sim_record)) return 1;
+    http_workers = 0;  // requests are served in the main loop
+  }
+
   do_setup();
 
-  while(true) {
+  while(!quit_requested && !sim_done()) {
     do_loop();
   }
+
+  // make sure pending nvm changes reach the disk before exiting
+  nvm_flush();
+  pd.compact_wait();
+  sim_end();
   return 0;
 }
\ No newline at end of file
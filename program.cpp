@@ -22,6 +22,9 @@
  */
 
 #include <limits.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include "program.h"
 
 #if !defined(SECS_PER_DAY)
@@ -31,135 +34,740 @@
 #endif
 
 // Declare static data members
-byte ProgramData::nprograms = 0;
-byte ProgramData::nqueue = 0;
+uint16_t ProgramData::nprograms = 0;
+uint16_t ProgramData::ndurations = 0;
+uint16_t ProgramData::nqueue = 0;
 RuntimeQueueStruct ProgramData::queue[RUNTIME_QUEUE_SIZE];
-byte ProgramData::station_qid[MAX_NUM_STATIONS];
+uint16_t ProgramData::station_qid[MAX_NUM_STATIONS];
+uint16_t ProgramData::pending[RUNTIME_QUEUE_SIZE];
+uint16_t ProgramData::npending = 0;
+uint16_t ProgramData::edge_heap[MAX_NUM_STATIONS];
+uint16_t ProgramData::nedges = 0;
+uint64_t ProgramData::edge_bits[STATION_WORDS];
+uint16_t ProgramData::queue_free;
+ulong ProgramData::edge_time[MAX_NUM_STATIONS];
+uint16_t ProgramData::edge_pos[MAX_NUM_STATIONS];
 LogStruct ProgramData::lastrun;
-ulong ProgramData::last_seq_stop_time;
+ulong ProgramData::store_gen = 0;
+ProgramStruct ProgramData::pool[MAX_NUMBER_PROGRAMS];
+byte *ProgramData::pool_durations = NULL;
+uint16_t ProgramData::order[MAX_NUMBER_PROGRAMS];
+uint16_t ProgramData::free_slots[MAX_NUMBER_PROGRAMS];
+uint16_t ProgramData::nfree = 0;
+int ProgramData::store_fd = -1;
+off_t ProgramData::store_size = 0;
+byte ProgramData::store_failed = 0;
+byte ProgramData::batch_active = 0;
+byte *ProgramData::batch_log = NULL;
+int ProgramData::batch_len = 0;
+int ProgramData::batch_cap = 0;
+uint16_t ProgramData::batch_nprograms;
+uint16_t ProgramData::batch_nfree;
+uint16_t ProgramData::batch_order[MAX_NUMBER_PROGRAMS];
+uint16_t ProgramData::batch_free_slots[MAX_NUMBER_PROGRAMS];
+byte ProgramData::batch_saved[MAX_NUMBER_PROGRAMS/8];
+ProgramData::BatchSlot *ProgramData::batch_undo = NULL;
+uint16_t ProgramData::batch_nundo = 0;
+ulong ProgramData::next_minute[MAX_NUMBER_PROGRAMS];
+uint16_t ProgramData::index_heap[MAX_NUMBER_PROGRAMS];
+uint16_t ProgramData::index_pos[MAX_NUMBER_PROGRAMS];
+uint16_t ProgramData::index_size = 0;
+byte ProgramData::index_dirty = 1;
+ulong ProgramData::index_minute = 0;
+uint16_t ProgramData::index_sunrise;
+uint16_t ProgramData::index_sunset;
 
 void ProgramData::init() {
 	reset_runtime();
-  load_count();
+  // programs keep at least the durations older firmware saved
+  if (!durations_grow(os.nstations > LEGACY_NUM_STATIONS ? os.nstations : LEGACY_NUM_STATIONS))  return;
+  load_store();
+}
+
+/** Enlarge the durations table to n durations per program
+ * Durations of the new stations start out as 0.
+ * Returns false if out of memory, the table is left as it was.
+ */
+bool ProgramData::durations_grow(uint16_t n) {
+  if (n <= ndurations)  return true;
+  byte *table = (byte*) calloc(MAX_NUMBER_PROGRAMS, n);
+  if (!table) {
+    DEBUG_PRINTLN("out of memory for program durations");
+    return false;
+  }
+  if (pool_durations) {
+    // only slots in use are copied, so the pages of unused slots are not touched
+    for (uint16_t pid = 0; pid < nprograms; pid++) {
+      memcpy(table+order[pid]*n, pool_durations+order[pid]*ndurations, ndurations);
+    }
+    if (batch_active) {
+      // slots deleted during a batch come back on rollback
+      for (uint16_t pid = 0; pid < batch_nprograms; pid++) {
+        memcpy(table+batch_order[pid]*n, pool_durations+batch_order[pid]*ndurations, ndurations);
+      }
+    }
+    free(pool_durations);
+  }
+  pool_durations = table;
+  ndurations = n;
+  for (uint16_t slot = 0; slot < MAX_NUMBER_PROGRAMS; slot++)  pool[slot].durations = table+slot*n;
+  return true;
+}
+
+/** Keep (at least) n durations for each program
+ * Called when the number of stations changes. The program store
+ * file is rewritten with the new record size.
+ */
+void ProgramData::durations_resize(uint16_t n) {
+  if (n <= ndurations || !durations_grow(n))  return;
+  if (batch_active)  store_fail();  // the batch log has records of the old size
+  else  compact();
+}
+
+/** Copy a program into a pool slot */
+void ProgramData::store(uint16_t slot, ProgramStruct *buf) {
+  ProgramStruct *prog = pool+slot;
+  memcpy(prog, buf, PROGRAMSTRUCT_SIZE);
+  if (buf->durations != prog->durations)  memcpy(prog->durations, buf->durations, ndurations);
+}
+
+/** Convert a program saved by older firmware
+ * buf->durations must have room for ndurations durations.
+ */
+void ProgramData::import_legacy(const LegacyProgramStruct *old, ProgramStruct *buf) {
+  memcpy(buf, old, offsetof(LegacyProgramStruct, durations));
+  memcpy(buf->name, old->name, PROGRAM_NAME_SIZE);
+  memcpy(buf->durations, old->durations, LEGACY_NUM_STATIONS);
+  memset(buf->durations+LEGACY_NUM_STATIONS, 0, ndurations-LEGACY_NUM_STATIONS);
 }
 
 void ProgramData::reset_runtime() {
-  memset(station_qid, 0xFF, MAX_NUM_STATIONS);  // reset station qid to 0xFF
+  memset(station_qid, 0xFF, sizeof(station_qid));  // reset station qid to 0xFFFF
+  memset(edge_pos, 0xFF, sizeof(edge_pos));
+  memset(edge_bits, 0, sizeof(edge_bits));
+  for(uint16_t i=0;i<RUNTIME_QUEUE_SIZE;i++)  queue[i].next = (i+1<RUNTIME_QUEUE_SIZE) ? i+1 : 0xFFFF;
+  queue_free = 0;
   nqueue = 0;
-  last_seq_stop_time = 0;
+  npending = 0;
+  nedges = 0;
+  os.runtime_gen++;
+  os.events |= EVENT_QUEUE;
 }
 
 /** Insert a new element to the queue
- * This function returns pointer to the next available element in the queue
- * and returns NULL if the queue is full
+ * This function returns pointer to a free element and returns NULL if
+ * the queue is full. The element waits in pending until the scheduler
+ * gives it a start time, and insert_pending adds it to its station.
  */
 RuntimeQueueStruct* ProgramData::enqueue() {
-  if (nqueue < RUNTIME_QUEUE_SIZE) {
-    nqueue ++;
-    return queue + (nqueue-1);
-  } else {
-    return NULL;
+  if (queue_free == 0xFFFF)  return NULL;
+  uint16_t qid = queue_free;
+  queue_free = queue[qid].next;
+  queue[qid].st = 0;
+  queue[qid].next = 0xFFFF;
+  pending[npending++] = qid;
+  nqueue ++;
+  os.runtime_gen++;
+  os.events |= EVENT_QUEUE;
+  return queue + qid;
+}
+
+/** Add the pending elements to the lists of their stations
+ * A station's list is ordered by start time. Elements left without a
+ * start time are dropped.
+ */
+void ProgramData::insert_pending() {
+  for(uint16_t i=0;i<npending;i++) {
+    uint16_t qid = pending[i];
+    RuntimeQueueStruct *q = queue + qid;
+    if (!q->st) {
+      q->next = queue_free;
+      queue_free = qid;
+      nqueue--;
+      continue;
+    }
+    uint16_t *link = station_qid + q->sid;
+    while (*link != 0xFFFF && queue[*link].st <= q->st)  link = &queue[*link].next;
+    q->next = *link;
+    *link = qid;
+    if (station_qid[q->sid] == qid)  edge_update(q->sid);
   }
+  npending = 0;
 }
 
 /** Remove an element from the queue
- * This function copies the last element of
- * the queue to overwrite the requested
- * element, therefore removing the requested element.
+ * The element is unlinked from its station's list and returned to the
+ * pool. The other elements stay where they are.
  */
 // this removes an element from the queue
-void ProgramData::dequeue(byte qid) {
-  if (qid>=nqueue)  return;
-  if (qid<nqueue-1) {
-    queue[qid] = queue[nqueue-1]; // copy the last element to the dequeud element to fill the space
-    if(station_qid[queue[qid].sid] == nqueue-1) // fix queue index if necessary
-      station_qid[queue[qid].sid] = qid;
-  }
+void ProgramData::dequeue(uint16_t qid) {
+  if (qid>=RUNTIME_QUEUE_SIZE)  return;
+  RuntimeQueueStruct *q = queue + qid;
+  uint16_t *link = station_qid + q->sid;
+  while (*link != 0xFFFF && *link != qid)  link = &queue[*link].next;
+  if (*link != qid)  return;  // not in the queue
+  *link = q->next;
+  q->next = queue_free;
+  queue_free = qid;
   nqueue--;
+  if (link == station_qid + q->sid)  edge_update(q->sid);
+  os.runtime_gen++;
+  os.events |= EVENT_QUEUE;
+
+  DEBUG_PRINT("de:[");
+  DEBUG_PRINT(q->sid);
+  DEBUG_PRINT(",");
+  DEBUG_PRINT(q->dur);
+  DEBUG_PRINT(",");
+  DEBUG_PRINT(q->st);
+  DEBUG_PRINT("]");
+  DEBUG_PRINTLN(nqueue);
+}
+
+/** Move the station at heap position i up or down to its place */
+void ProgramData::edge_sift(uint16_t i) {
+  uint16_t sid = edge_heap[i];
+  ulong t = edge_time[sid];
+  while (i > 0 && edge_time[edge_heap[(i-1)/2]] > t) {
+    edge_heap[i] = edge_heap[(i-1)/2];
+    edge_pos[edge_heap[i]] = i;
+    i = (i-1)/2;
+  }
+  for (;;) {
+    uint16_t c = 2*i+1;
+    if (c >= nedges)  break;
+    if (c+1 < nedges && edge_time[edge_heap[c+1]] < edge_time[edge_heap[c]])  c++;
+    if (edge_time[edge_heap[c]] >= t)  break;
+    edge_heap[i] = edge_heap[c];
+    edge_pos[edge_heap[i]] = i;
+    i = c;
+  }
+  edge_heap[i] = sid;
+  edge_pos[sid] = i;
+}
+
+void ProgramData::edge_set(uint16_t sid, ulong t) {
+  edge_time[sid] = t;
+  if (edge_pos[sid] == 0xFFFF) {
+    edge_heap[nedges] = sid;
+    edge_pos[sid] = nedges++;
+    edge_bits[sid>>6] |= (uint64_t)1<<(sid&63);
+  }
+  edge_sift(edge_pos[sid]);
+}
+
+void ProgramData::edge_remove(uint16_t sid) {
+  uint16_t i = edge_pos[sid];
+  if (i == 0xFFFF)  return;
+  edge_pos[sid] = 0xFFFF;
+  edge_bits[sid>>6] &= ~((uint64_t)1<<(sid&63));
+  if (i == --nedges)  return;
+  edge_heap[i] = edge_heap[nedges];
+  edge_pos[edge_heap[i]] = i;
+  edge_sift(i);
+}
+
+/** Update when a station next starts or stops
+ * That is when its first element starts, if the station is off, or
+ * ends, if it is on (masters only drop their elements when they end).
+ * Cancelled elements (zero duration) are due right away.
+ */
+void ProgramData::edge_update(uint16_t sid) {
+  uint16_t qid = station_qid[sid];
+  if (qid == 0xFFFF) {
+    edge_remove(sid);
+    return;
+  }
+  RuntimeQueueStruct *q = queue + qid;
+  bool master = (os.status.mas==sid+1) || (os.status.mas2==sid+1);
+  if (!q->dur)
+    edge_set(sid, 0);
+  else if (master || station_bit(os.station_bits, sid))
+    edge_set(sid, q->st+q->dur);
+  else
+    edge_set(sid, q->st);
+}
+
+uint16_t ProgramData::edge_due(ulong curr_time) {
+  return (nedges && edge_time[edge_heap[0]] <= curr_time) ? edge_heap[0] : 0xFFFF;
+}
+
+ulong ProgramData::edge_next() {
+  return edge_time[edge_heap[0]];
+}
+
+/** Load programs from the program store file
+ * The file is created, and programs saved in nvm by older
+ * firmware are imported, if it does not exist yet.
+ */
+void ProgramData::load_store() {
+  compact_wait();
+  nprograms = 0;
+  nfree = 0;
+  for (uint16_t slot = MAX_NUMBER_PROGRAMS; slot > 0; slot--)  free_slots[nfree++] = slot-1;
+  index_invalidate();
+
+  store_fd = open(get_filename_fullpath(PROGRAMS_FILENAME), O_RDWR|O_CREAT, 0644);
+  if (store_fd < 0) {
+    DEBUG_PRINTLN("can't open program file");
+    return;
+  }
+
+  ProgramFileHeader hdr;
+  ssize_t hlen = pread(store_fd, &hdr, sizeof(hdr), 0);
+  if (hlen < PROGRAM_FILE_V1_HEADER) {
+    // new file
+    compact();
+    compact_wait();
+    import_nvm();
+    return;
+  }
+  bool v1 = false;
+  off_t pos;
+  int recsize;
+  if (hdr.magic == PROGRAM_FILE_MAGIC && hdr.version == 1 && hdr.recsize == sizeof(LegacyProgramStruct)) {
+    v1 = true;
+    pos = PROGRAM_FILE_V1_HEADER;
+    recsize = sizeof(LegacyProgramStruct);
+  } else if (hdr.magic == PROGRAM_FILE_MAGIC && hdr.version == PROGRAM_FILE_VERSION && hlen == sizeof(hdr) &&
+             hdr.recsize == PROGRAMSTRUCT_SIZE && hdr.ndurations <= MAX_NUM_STATIONS && durations_grow(hdr.ndurations)) {
+    pos = sizeof(hdr);
+    recsize = PROGRAMSTRUCT_SIZE + hdr.ndurations;
+  } else {
+    DEBUG_PRINTLN("program file invalid, programs erased");
+    compact();
+    compact_wait();
+    return;
+  }
+
+  // replay the log up to the first torn or invalid record
+  ProgramLogRecord rec;
+  ProgramStruct prog;
+  byte data[PROGRAMSTRUCT_SIZE+MAX_NUM_STATIONS];
+  byte durations[MAX_NUM_STATIONS];
+  prog.durations = durations;
+  while (pread(store_fd, &rec, sizeof(rec), pos) == sizeof(rec)) {
+    off_t len = sizeof(rec);
+    uint32_t crc = crc32(&rec.op, sizeof(rec)-sizeof(rec.crc));
+    if (rec.op == PROGRAM_LOG_ADD || rec.op == PROGRAM_LOG_MODIFY) {
+      if (pread(store_fd, data, recsize, pos+len) != recsize)  break;
+      crc = crc32(data, recsize, crc);
+      len += recsize;
+      if (v1) {
+        import_legacy((LegacyProgramStruct*)data, &prog);
+      } else {
+        memcpy(&prog, data, PROGRAMSTRUCT_SIZE);
+        memcpy(durations, data+PROGRAMSTRUCT_SIZE, hdr.ndurations);
+        memset(durations+hdr.ndurations, 0, ndurations-hdr.ndurations);
+      }
+    }
+    if (crc != rec.crc || !replay(&rec, &prog))  break;
+    pos += len;
+  }
+  store_size = pos;
+  if (v1 || hdr.ndurations != ndurations) {
+    // rewrite in the current format
+    compact();
+    return;
+  }
+  if (ftruncate(store_fd, store_size) != 0)  store_failed = 1;
+}
+
+/** Import programs saved in nvm by older firmware */
+void ProgramData::import_nvm() {
+  uint16_t count = nvm_read_byte((byte *) ADDR_PROGRAMCOUNTER);
+  if (count > MAX_NVM_PROGRAMS)  return;
+  LegacyProgramStruct old;
+  ProgramStruct prog;
+  byte durations[MAX_NUM_STATIONS];
+  prog.durations = durations;
+  for (uint16_t pid = 0; pid < count; pid++) {
+    unsigned int addr = ADDR_PROGRAMDATA + (unsigned int)pid * sizeof(LegacyProgramStruct);
+    nvm_read_block((void*)&old, (const void *)addr, sizeof(LegacyProgramStruct));
+    import_legacy(&old, &prog);
+    add(&prog);
+  }
+  // programs are owned by the program store from now on
+  nvm_write_byte((byte *) ADDR_PROGRAMCOUNTER, 0);
+}
+
+/** Apply a log record to the programs in RAM
+ * Returns false if the record is invalid
+ */
+bool ProgramData::replay(ProgramLogRecord *rec, ProgramStruct *buf) {
+  uint16_t pid = rec->pid;
+  uint16_t slot;
+  switch (rec->op) {
+  case PROGRAM_LOG_ADD:
+    if (nprograms >= MAX_NUMBER_PROGRAMS || !nfree)  return false;
+    if (!batch_save(free_slots[nfree-1]))  return false;
+    slot = free_slots[--nfree];
+    store(slot, buf);
+    order[nprograms++] = slot;
+    break;
+
+  case PROGRAM_LOG_MODIFY:
+    if (pid >= nprograms || !batch_save(order[pid]))  return false;
+    store(order[pid], buf);
+    break;
+
+  case PROGRAM_LOG_DELETE:
+    if (pid >= nprograms)  return false;
+    free_slots[nfree++] = order[pid];
+    memmove(order+pid, order+pid+1, (nprograms-pid-1)*sizeof(uint16_t));
+    nprograms--;
+    break;
+
+  case PROGRAM_LOG_MOVEUP:
+    if (pid >= nprograms || pid == 0)  return false;
+    slot = order[pid-1];
+    order[pid-1] = order[pid];
+    order[pid] = slot;
+    break;
+
+  case PROGRAM_LOG_ERASEALL:
+    while (nprograms)  free_slots[nfree++] = order[--nprograms];
+    break;
+
+  default:
+    return false;
+  }
+  index_update(rec->op, pid);
+  return true;
+}
+
+/** Append a log record to the program store file */
+void ProgramData::append(ProgramLogRecord *rec, ProgramStruct *buf) {
+  byte data[sizeof(ProgramLogRecord)+PROGRAMSTRUCT_SIZE+MAX_NUM_STATIONS];
+  int len = sizeof(ProgramLogRecord);
+  if (rec->op == PROGRAM_LOG_ADD || rec->op == PROGRAM_LOG_MODIFY) {
+    memcpy(data+len, buf, PROGRAMSTRUCT_SIZE);
+    memcpy(data+len+PROGRAMSTRUCT_SIZE, buf->durations, ndurations);
+    len += PROGRAMSTRUCT_SIZE + ndurations;
+  }
+  rec->crc = crc32(&rec->op, sizeof(ProgramLogRecord)-sizeof(rec->crc));
+  rec->crc = crc32(data+sizeof(ProgramLogRecord), len-sizeof(ProgramLogRecord), rec->crc);
+  memcpy(data, rec, sizeof(ProgramLogRecord));
+
+  if (batch_active) {
+    if (batch_len+len > batch_cap) {
+      int cap = (batch_len+len)*2;
+      byte *log = (byte*) realloc(batch_log, cap);
+      if (!log) {
+        store_fail();
+        return;
+      }
+      batch_log = log;
+      batch_cap = cap;
+    }
+    memcpy(batch_log+batch_len, data, len);
+    batch_len += len;
+    return;
+  }
+  store_write(data, len);
+}
+
+/** Apply a change and save it to the program store file */
+byte ProgramData::apply(byte op, uint16_t pid, ProgramStruct *buf) {
+  ProgramLogRecord rec;
+  rec.op = op;
+  rec.reserved = 0;
+  rec.pid = pid;
+  if (!replay(&rec, buf))  return 0;
+  append(&rec, buf);
+  store_gen++;
+  return 1;
+}
+
+// a compaction in progress: the image of the new file, and the old file
+// as it was when the image was taken
+static struct {
+  byte *image;
+  size_t len;
+  uint16_t nrec;
+  int recsize;
+  off_t snap_size;
+  char path[PATH_MAX];
+  char tmp[PATH_MAX+4];
+} compact_job;
+static pthread_t compact_tid;
+static byte compact_state = 0;  // COMPACT_IDLE, RUNNING, or DONE (set by the compaction thread)
+static byte compact_stale = 0;  // a change went into RAM only, the image can't be completed
+// while a compaction runs, guards store_fd, store_size, store_failed and compact_stale
+static pthread_mutex_t store_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define COMPACT_IDLE     0
+#define COMPACT_RUNNING  1
+#define COMPACT_DONE     2
+
+/** Write len bytes to the program store file, at its end */
+void ProgramData::store_write(const byte *data, int len) {
+  pthread_mutex_lock(&store_mutex);
+  bool ok = store_fd >= 0 && !store_failed;
+  if (ok && (pwrite(store_fd, data, len, store_size) != len || fdatasync(store_fd) != 0)) {
+    DEBUG_PRINTLN("program file write failed");
+    store_failed = 1;
+    ok = false;
+  }
+  if (ok)  store_size += len;
+  else  compact_stale = 1;  // rewritten in full by compact_check
+  pthread_mutex_unlock(&store_mutex);
+}
+
+/** Have the program store file rewritten in full by compact_check */
+void ProgramData::store_fail() {
+  pthread_mutex_lock(&store_mutex);
+  store_failed = 1;
+  compact_stale = 1;  // a compaction in progress is out of date too
+  pthread_mutex_unlock(&store_mutex);
+}
+
+/** Rewrite the program store file with one add record per program
+ * The programs are copied into an image of the new file, which a thread
+ * writes next to the old one and renames over it, so a power cut leaves
+ * either the old or the new file. Records appended to the old file in
+ * the meantime are carried over before the rename.
+ */
+void ProgramData::compact() {
+  if (compact_state != COMPACT_IDLE) {
+    store_fail();  // the file being written is already out of date
+    return;
+  }
+  int recsize = sizeof(ProgramLogRecord)+PROGRAMSTRUCT_SIZE+ndurations;
+  size_t len = sizeof(ProgramFileHeader) + (size_t)nprograms*recsize;
+  byte *image = (byte*) malloc(len);
+  if (!image) {
+    DEBUG_PRINTLN("out of memory for program file compaction");
+    store_failed = 1;
+    return;
+  }
+  ProgramFileHeader hdr;
+  hdr.magic = PROGRAM_FILE_MAGIC;
+  hdr.version = PROGRAM_FILE_VERSION;
+  hdr.recsize = PROGRAMSTRUCT_SIZE;
+  hdr.ndurations = ndurations;
+  hdr.reserved = 0;
+  memcpy(image, &hdr, sizeof(hdr));
+
+  // crcs are left to the thread
+  ProgramLogRecord rec;
+  rec.crc = 0;
+  rec.op = PROGRAM_LOG_ADD;
+  rec.reserved = 0;
+  byte *p = image+sizeof(hdr);
+  for (uint16_t pid = 0; pid < nprograms; pid++, p += recsize) {
+    ProgramStruct *prog = pool+order[pid];
+    rec.pid = pid;
+    memcpy(p, &rec, sizeof(rec));
+    memcpy(p+sizeof(rec), prog, PROGRAMSTRUCT_SIZE);
+    memcpy(p+sizeof(rec)+PROGRAMSTRUCT_SIZE, prog->durations, ndurations);
+  }
+
+  compact_job.image = image;
+  compact_job.len = len;
+  compact_job.nrec = nprograms;
+  compact_job.recsize = recsize;
+  compact_job.snap_size = store_size;
+  strncpy(compact_job.path, get_filename_fullpath(PROGRAMS_FILENAME), PATH_MAX-1);
+  compact_job.path[PATH_MAX-1] = 0;
+  snprintf(compact_job.tmp, sizeof(compact_job.tmp), "%s.tmp", compact_job.path);
+  // a change the old file misses from now on can't be carried over
+  compact_stale = (store_fd < 0 || store_failed);
+  compact_state = COMPACT_RUNNING;
+  if (pthread_create(&compact_tid, NULL, compact_run, NULL)) {
+    DEBUG_PRINTLN("can't start program file compaction");
+    free(image);
+    compact_state = COMPACT_IDLE;
+    store_failed = 1;
+  }
+}
+
+/** Compaction thread: write the image, then switch over to it */
+void *ProgramData::compact_run(void *) {
+  byte *p = compact_job.image+sizeof(ProgramFileHeader);
+  for (uint16_t i = 0; i < compact_job.nrec; i++, p += compact_job.recsize) {
+    ProgramLogRecord rec;
+    memcpy(&rec, p, sizeof(rec));
+    rec.crc = crc32(&rec.op, sizeof(rec)-sizeof(rec.crc));
+    rec.crc = crc32(p+sizeof(rec), compact_job.recsize-sizeof(rec), rec.crc);
+    memcpy(p, &rec, sizeof(rec));
+  }
+  int fd = open(compact_job.tmp, O_RDWR|O_CREAT|O_TRUNC, 0644);
+  bool ok = fd >= 0 && write(fd, compact_job.image, compact_job.len) == (ssize_t)compact_job.len &&
+            fdatasync(fd) == 0;
+  free(compact_job.image);
+  off_t size = compact_job.len;
 
-  RuntimeQueueStruct *q = queue;
-  DEBUG_PRINT("de:");
-  for(;q<queue+nqueue;q++) {
-    DEBUG_PRINT("[");
-    DEBUG_PRINT(q->sid);
-    DEBUG_PRINT(",");
-    DEBUG_PRINT(q->dur);
-    DEBUG_PRINT(",");
-    DEBUG_PRINT(q->st);
-    DEBUG_PRINT("]");
+  pthread_mutex_lock(&store_mutex);
+  if (ok && compact_stale) {
+    ok = false;  // not an error, compact_check starts over
+  } else if (ok && store_size > compact_job.snap_size) {
+    // records appended while the image was written
+    byte buf[4096];
+    for (off_t pos = compact_job.snap_size; ok && pos < store_size; ) {
+      ssize_t n = (store_size-pos < (off_t)sizeof(buf)) ? store_size-pos : sizeof(buf);
+      ok = pread(store_fd, buf, n, pos) == n && pwrite(fd, buf, n, size) == n;
+      pos += n;
+      size += n;
+    }
+    ok = ok && fdatasync(fd) == 0;
+    if (!ok)  DEBUG_PRINTLN("program file compaction failed");
+  } else if (!ok) {
+    DEBUG_PRINTLN("program file compaction failed");
+  }
+  if (ok && rename(compact_job.tmp, compact_job.path) != 0) {
+    DEBUG_PRINTLN("program file compaction failed");
+    ok = false;
+  }
+  if (ok) {
+    if (store_fd >= 0)  close(store_fd);
+    store_fd = fd;
+    store_size = size;
+    store_failed = 0;
+  } else {
+    if (fd >= 0)  close(fd);
+    remove(compact_job.tmp);
+    store_failed = 1;
   }
-  DEBUG_PRINTLN("");
+  pthread_mutex_unlock(&store_mutex);
+  __atomic_store_n(&compact_state, COMPACT_DONE, __ATOMIC_RELEASE);
+  return NULL;
 }
 
-/** Load program count from NVM */
-void ProgramData::load_count() {
-  nprograms = nvm_read_byte((byte *) ADDR_PROGRAMCOUNTER);
+/** Wait for the compaction in progress, if any, to finish */
+void ProgramData::compact_wait() {
+  if (compact_state == COMPACT_IDLE)  return;
+  pthread_join(compact_tid, NULL);
+  compact_state = COMPACT_IDLE;
 }
 
-/** Save program count to NVM */
-void ProgramData::save_count() {
-  nvm_write_byte((byte *) ADDR_PROGRAMCOUNTER, nprograms);
+/** Compact the program store file once most of it is superseded
+ * Called from the main loop: it only starts the compaction thread, or
+ * collects one that has finished.
+ */
+void ProgramData::compact_check() {
+  if (__atomic_load_n(&compact_state, __ATOMIC_ACQUIRE) == COMPACT_RUNNING)  return;
+  compact_wait();
+  off_t live = sizeof(ProgramFileHeader) + (off_t)nprograms * (sizeof(ProgramLogRecord)+PROGRAMSTRUCT_SIZE+ndurations);
+  if (store_failed || (store_size > 2*live && store_size-live > PROGRAM_COMPACT_MIN)) {
+    compact();
+  }
+}
+
+/** Start a batch of changes
+ * The programs in RAM change as usual, but their log records are
+ * held back and written with a single sync by batch_commit, or
+ * dropped by batch_rollback, which restores the programs as they were.
+ */
+void ProgramData::batch_begin() {
+  batch_active = 1;
+  batch_len = 0;
+  batch_nundo = 0;
+  memset(batch_saved, 0, sizeof(batch_saved));
+  batch_nprograms = nprograms;
+  batch_nfree = nfree;
+  memcpy(batch_order, order, nprograms*sizeof(uint16_t));
+  memcpy(batch_free_slots, free_slots, nfree*sizeof(uint16_t));
+}
+
+/** Save the content of a pool slot before a batch overwrites it
+ * Returns false if there is no memory for the copy: the change must not
+ * be made, since the batch could not undo it.
+ */
+bool ProgramData::batch_save(uint16_t slot) {
+  if (!batch_active || (batch_saved[slot>>3]&(1<<(slot&7))))  return true;
+  if (!batch_undo) {
+    batch_undo = (BatchSlot*) malloc(MAX_NUMBER_PROGRAMS*sizeof(BatchSlot));
+    if (!batch_undo)  return false;
+  }
+  byte *durations = (byte*) malloc(ndurations);
+  if (!durations)  return false;
+  memcpy(durations, pool[slot].durations, ndurations);
+  batch_saved[slot>>3] |= 1<<(slot&7);
+  batch_undo[batch_nundo].slot = slot;
+  batch_undo[batch_nundo].ndurations = ndurations;
+  batch_undo[batch_nundo].prog = pool[slot];
+  batch_undo[batch_nundo].prog.durations = durations;
+  batch_nundo++;
+  return true;
+}
+
+/** Free the pool slots saved by batch_save */
+void ProgramData::batch_discard() {
+  while (batch_nundo)  free(batch_undo[--batch_nundo].prog.durations);
+}
+
+void ProgramData::batch_commit() {
+  if (!batch_active)  return;
+  batch_active = 0;
+  batch_discard();
+  if (batch_len)  store_write(batch_log, batch_len);
+}
+
+void ProgramData::batch_rollback() {
+  if (!batch_active)  return;
+  batch_active = 0;
+  nprograms = batch_nprograms;
+  nfree = batch_nfree;
+  memcpy(order, batch_order, nprograms*sizeof(uint16_t));
+  memcpy(free_slots, batch_free_slots, nfree*sizeof(uint16_t));
+  for (uint16_t i = 0; i < batch_nundo; i++) {
+    BatchSlot *u = batch_undo+i;
+    ProgramStruct *prog = pool+u->slot;
+    memcpy(prog, &u->prog, PROGRAMSTRUCT_SIZE);
+    memcpy(prog->durations, u->prog.durations, u->ndurations);
+    memset(prog->durations+u->ndurations, 0, ndurations-u->ndurations);
+  }
+  batch_discard();
+  index_invalidate();
+  store_gen++;
 }
 
 /** Erase all program data */
 void ProgramData::eraseall() {
   printf("Got here erasing all program data\n");
-  nprograms = 0;
-  save_count();
+  apply(PROGRAM_LOG_ERASEALL, 0, NULL);
 }
 
-/** Read a program from NVM*/
-void ProgramData::read(byte pid, ProgramStruct *buf) {
+/** Read a program
+ * The durations are copied to buf->durations, which the caller points at
+ * room for MAX_NUM_STATIONS of them. The copy is the caller's: it stays
+ * valid when the program changes or the durations table is reallocated.
+ */
+void ProgramData::read(uint16_t pid, ProgramStruct *buf) {
   if (pid >= nprograms) return;
-  unsigned int addr = ADDR_PROGRAMDATA + (unsigned int)pid * PROGRAMSTRUCT_SIZE;
-  nvm_read_block((void*)buf, (const void *)addr, PROGRAMSTRUCT_SIZE);  
+  ProgramStruct *prog = pool+order[pid];
+  byte *durations = buf->durations;
+  memcpy(buf, prog, PROGRAMSTRUCT_SIZE);
+  memcpy(durations, prog->durations, ndurations);
+  buf->durations = durations;
 }
 
 /** Add a program */
 byte ProgramData::add(ProgramStruct *buf) {
-  if (nprograms >= MAX_NUMBER_PROGRAMS)  return 0;
-  unsigned int addr = ADDR_PROGRAMDATA + (unsigned int)nprograms * PROGRAMSTRUCT_SIZE;
-  nvm_write_block((const void*)buf, (void *)addr, PROGRAMSTRUCT_SIZE);
-  nprograms ++;
-  save_count();
-  return 1;
+  return apply(PROGRAM_LOG_ADD, nprograms, buf);
 }
 
 /** Move a program up (i.e. swap a program with the one above it) */
-void ProgramData::moveup(byte pid) {
-  if(pid >= nprograms || pid == 0) return;
-  // swap program pid-1 and pid
-  unsigned int src = ADDR_PROGRAMDATA + (unsigned int)(pid-1) * PROGRAMSTRUCT_SIZE;
-  unsigned int dst = src + PROGRAMSTRUCT_SIZE;
-  ProgramStruct tmp1, tmp2;
-  nvm_read_block(&tmp1, (void *)src, PROGRAMSTRUCT_SIZE);
-  nvm_read_block(&tmp2, (void *)dst, PROGRAMSTRUCT_SIZE);
-  nvm_write_block(&tmp1, (void *)dst, PROGRAMSTRUCT_SIZE);
-  nvm_write_block(&tmp2, (void *)src, PROGRAMSTRUCT_SIZE);
+void ProgramData::moveup(uint16_t pid) {
+  apply(PROGRAM_LOG_MOVEUP, pid, NULL);
 }
 
 /** Modify a program */
-byte ProgramData::modify(byte pid, ProgramStruct *buf) {
-  if (pid >= nprograms)  return 0;
-  unsigned int addr = ADDR_PROGRAMDATA + (unsigned int)pid * PROGRAMSTRUCT_SIZE;
-  nvm_write_block((const void*)buf, (void *)addr, PROGRAMSTRUCT_SIZE);
-  return 1;
+byte ProgramData::modify(uint16_t pid, ProgramStruct *buf) {
+  return apply(PROGRAM_LOG_MODIFY, pid, buf);
 }
 
 /** Delete program(s) */
-byte ProgramData::del(byte pid) {
-  if (pid >= nprograms)  return 0;
-  if (nprograms == 0) return 0;
-  ProgramStruct copy;
-  unsigned int addr = ADDR_PROGRAMDATA + (unsigned int)(pid+1) * PROGRAMSTRUCT_SIZE;
-  // erase by copying backward
-  for (; addr < ADDR_PROGRAMDATA + nprograms * PROGRAMSTRUCT_SIZE; addr += PROGRAMSTRUCT_SIZE) {
-    nvm_read_block((void*)&copy, (const void *)addr, PROGRAMSTRUCT_SIZE);  
-    nvm_write_block((const void*)&copy, (void *)(addr-PROGRAMSTRUCT_SIZE), PROGRAMSTRUCT_SIZE);
-  }
-  nprograms --;
-  save_count();
-  return 1;
+byte ProgramData::del(uint16_t pid) {
+  return apply(PROGRAM_LOG_DELETE, pid, NULL);
+}
+
+/** Queue pid as reported in json and logs */
+uint16_t ProgramData::report_pid(uint16_t qpid) {
+  if (qpid == QUEUE_PID_MANUAL)  return 99;
+  if (qpid == QUEUE_PID_RUNONCE) return 254;
+  return qpid;
 }
 
 /** Decode a sunrise/sunset start time to actual start time */
@@ -235,13 +843,21 @@ byte ProgramStruct::check_match(time_t t) {
   // check program enable status
   if (!enabled) return 0;
 
+  unsigned int current_minute = (t%86400L)/60;
+  return check_minute_match(current_minute, check_day_match(t), check_day_match(t-86400L));
+}
+
+// Check if a minute of the day matches program's start time
+// today / yesterday tell whether the current / previous day
+// matches the program's start day
+byte ProgramStruct::check_minute_match(unsigned int current_minute, byte today, byte yesterday) {
+
   int16_t start = starttime_decode(starttimes[0]);
   int16_t repeat = starttimes[1];
   int16_t interval = starttimes[2];
-  unsigned int current_minute = (t%86400L)/60;
 
   // first assume program starts today
-  if (check_day_match(t)) {
+  if (today) {
     // t matches the program's start day
 
     if (starttime_type) {
@@ -269,7 +885,7 @@ byte ProgramStruct::check_match(time_t t) {
   if (starttime_type || !interval)  return 0;
 
   // next, assume program started the previous day and ran over night
-  if (check_day_match(t-86400L)) {
+  if (yesterday) {
     // t-86400L matches the program's start day
     int16_t c = (current_minute - start + 1440) / interval;
     if ((c * interval == (current_minute - start + 1440)) && c <= repeat) {
@@ -279,6 +895,89 @@ byte ProgramStruct::check_match(time_t t) {
   return 0;
 }
 
+/** Find the program's next start
+ * Returns the first minute (counted from epoch) at or after the given minute
+ * for which check_match returns 1. If there is none within NEXT_MATCH_HORIZON
+ * days, the minute at the end of the horizon is returned, so the search
+ * continues from there.
+ */
+ulong ProgramStruct::next_match(ulong minute) {
+  ulong day = minute / 1440;
+  ulong end = day + NEXT_MATCH_HORIZON;
+  unsigned int cm = minute % 1440;
+
+  if (!enabled) return end * 1440;
+  // interval programs with zero interval never match
+  if (type == PROGRAM_TYPE_INTERVAL && days[1] == 0) return end * 1440;
+
+  byte yesterday = check_day_match((day-1) * SECS_PER_DAY);
+  for(; day < end; day++, cm = 0) {
+    byte today = check_day_match(day * SECS_PER_DAY);
+    if (today || (yesterday && !starttime_type)) {
+      int16_t m = first_minute_match(cm, today, yesterday);
+      if (m >= 0)  return day * 1440 + m;
+    }
+    yesterday = today;
+  }
+  return end * 1440;
+}
+
+// first minute at or after from in the series start + k*interval, going
+// back from start as well; a series without a (positive) interval is
+// only its start
+static int next_repeat(int start, int interval, int from) {
+  if (interval <= 0)  return start;
+  if (from >= start)  return start + (from - start + interval - 1) / interval * interval;
+  return start - (start - from) / interval * interval;
+}
+
+/** First minute of the day, at or after current_minute, that
+ * check_minute_match accepts, or -1 if there is none
+ * Rather than trying every minute, this only tries the minutes the start
+ * times allow: each fixed start time, or on a repeating program the next
+ * repeat of today's run and of the run that started yesterday. The repeat
+ * count is left to check_minute_match: once the next repeat is past it,
+ * so are all the later ones.
+ */
+int16_t ProgramStruct::first_minute_match(int16_t current_minute, byte today, byte yesterday) {
+  int cand[MAX_NUM_STARTTIMES+3];
+  byte n = 0;
+  if (starttime_type) {
+    if (!today)  return -1;
+    for(byte i=0;i<MAX_NUM_STARTTIMES;i++)  cand[n++] = starttime_decode(starttimes[i]);
+  } else {
+    int start = starttime_decode(starttimes[0]);
+    int interval = starttimes[2];
+    if (today && start >= 0)  cand[n++] = next_repeat(start, interval, current_minute > start ? current_minute : start);
+    if (yesterday && interval) {
+      // yesterday's run, in minutes of today; check_minute_match also
+      // accepts some repeats before its start (its arithmetic wraps
+      // around for start times past the end of the day)
+      int base = start - 1440;
+      cand[n++] = next_repeat(base, interval, current_minute);
+      cand[n++] = next_repeat(base, interval, current_minute > base ? current_minute : base);
+      cand[n++] = base + interval;
+    }
+  }
+  int16_t first = -1;
+  for(byte i=0;i<n;i++) {
+    int m = cand[i];
+    if (m < current_minute || m >= 1440 || (first >= 0 && m >= first))  continue;
+    if (check_minute_match(m, today, yesterday))  first = m;
+  }
+  return first;
+}
+
+/** Whether a start time is relative to sunrise or sunset */
+byte ProgramStruct::uses_sun_time() {
+  byte n = starttime_type ? MAX_NUM_STARTTIMES : 1;
+  for(byte i=0;i<n;i++) {
+    int16_t t = starttimes[i];
+    if (!((t>>15)&1) && (((t>>STARTTIME_SUNRISE_BIT)&1) || ((t>>STARTTIME_SUNSET_BIT)&1)))  return 1;
+  }
+  return 0;
+}
+
 // convert absolute remainder (reference time 1970 01-01) to relative remainder (reference time today)
 // absolute remainder is stored in nvm, relative remainder is presented to web
 void ProgramData::drem_to_relative(byte days[2]) {
@@ -297,3 +996,170 @@ void ProgramData::drem_to_absolute(byte days[2]) {
 }
 
 
+
+/** Mark the next start index for a full rebuild
+ * Called when the programs are (re)loaded or a batch is undone; other
+ * changes update the index in place (see index_update)
+ */
+void ProgramData::index_invalidate() {
+  index_dirty = 1;
+}
+
+/** Move the program at heap position i up or down to its place */
+void ProgramData::index_sift(uint16_t i) {
+  uint16_t pid = index_heap[i];
+  ulong minute = next_minute[pid];
+  while (i > 0 && next_minute[index_heap[(i-1)/2]] > minute) {
+    index_heap[i] = index_heap[(i-1)/2];
+    index_pos[index_heap[i]] = i;
+    i = (i-1)/2;
+  }
+  for (;;) {
+    uint16_t c = 2*i+1;
+    if (c >= index_size)  break;
+    if (c+1 < index_size && next_minute[index_heap[c+1]] < next_minute[index_heap[c]])  c++;
+    if (next_minute[index_heap[c]] >= minute)  break;
+    index_heap[i] = index_heap[c];
+    index_pos[index_heap[i]] = i;
+    i = c;
+  }
+  index_heap[i] = pid;
+  index_pos[pid] = i;
+}
+
+/** Set a program's next start, adding the program to the index if
+ * it is the next program id past the ones in it */
+void ProgramData::index_set(uint16_t pid, ulong minute) {
+  next_minute[pid] = minute;
+  if (pid == index_size) {
+    index_heap[index_size] = pid;
+    index_pos[pid] = index_size++;
+  }
+  index_sift(index_pos[pid]);
+}
+
+/** Recompute the next start of all programs */
+void ProgramData::index_rebuild(ulong curr_minute) {
+  index_size = 0;
+  for (uint16_t pid = 0; pid < nprograms; pid++) {
+    index_set(pid, pool[order[pid]].next_match(curr_minute));
+  }
+  index_sunrise = os.nvdata.sunrise_time;
+  index_sunset = os.nvdata.sunset_time;
+  index_dirty = 0;
+}
+
+/** Update the index after a program change (op on program id pid)
+ * Only a program added or modified gets its next start recomputed, from
+ * the minute after the last one checked. The other programs keep theirs,
+ * and move along when a delete or move up changes their ids.
+ */
+void ProgramData::index_update(byte op, uint16_t pid) {
+  if (index_dirty)  return;
+  uint16_t i;
+  switch (op) {
+  case PROGRAM_LOG_ADD:
+    pid = nprograms-1;
+    // fall through
+  case PROGRAM_LOG_MODIFY:
+    index_set(pid, pool[order[pid]].next_match(index_minute+1));
+    break;
+
+  case PROGRAM_LOG_DELETE:
+    // take the program out, then renumber the ones after it
+    i = index_pos[pid];
+    index_heap[i] = index_heap[--index_size];
+    index_pos[index_heap[i]] = i;
+    if (i < index_size)  index_sift(i);
+    memmove(next_minute+pid, next_minute+pid+1, (index_size-pid)*sizeof(ulong));
+    for (i = 0; i < index_size; i++) {
+      if (index_heap[i] > pid)  index_pos[--index_heap[i]] = i;
+    }
+    break;
+
+  case PROGRAM_LOG_MOVEUP:
+    // the two programs swap ids, their next starts go with them
+    i = index_pos[pid];
+    index_heap[i] = pid-1;
+    index_heap[index_pos[pid-1]] = pid;
+    index_pos[pid] = index_pos[pid-1];
+    index_pos[pid-1] = i;
+    {
+      ulong minute = next_minute[pid];
+      next_minute[pid] = next_minute[pid-1];
+      next_minute[pid-1] = minute;
+    }
+    break;
+
+  case PROGRAM_LOG_ERASEALL:
+    index_size = 0;
+    break;
+  }
+}
+
+/** Whether sunrise or sunset moved since the index was built */
+bool ProgramData::index_sun_changed() {
+  return index_sunrise != os.nvdata.sunrise_time ||
+         index_sunset != os.nvdata.sunset_time;
+}
+
+/** Recompute the next start of the programs with start times relative
+ * to sunrise or sunset, after these moved */
+void ProgramData::index_sun_update(ulong curr_minute) {
+  for (uint16_t pid = 0; pid < nprograms; pid++) {
+    ProgramStruct *prog = pool+order[pid];
+    if (prog->uses_sun_time())  index_set(pid, prog->next_match(curr_minute));
+  }
+  index_sunrise = os.nvdata.sunrise_time;
+  index_sunset = os.nvdata.sunset_time;
+}
+
+/** Whether the index needs a full rebuild: it was invalidated, or the
+ * clock moved backwards (a timezone change moving forward needs nothing:
+ * the starts skipped over are not run, see index_pop_due) */
+bool ProgramData::index_stale(ulong curr_minute) {
+  return index_dirty || curr_minute < index_minute;
+}
+
+/** Get the programs that start at the given minute
+ * Program ids are stored in pids in increasing order, and the number
+ * of programs is returned. This is equivalent to calling check_match
+ * on every program, but only touches the programs that are due.
+ */
+uint16_t ProgramData::index_pop_due(ulong curr_minute, uint16_t pids[]) {
+  if (index_stale(curr_minute)) {
+    index_rebuild(curr_minute);
+  } else if (index_sun_changed()) {
+    index_sun_update(curr_minute);
+  }
+  index_minute = curr_minute;
+
+  uint16_t n = 0;
+  while (index_size > 0 && next_minute[index_heap[0]] <= curr_minute) {
+    uint16_t pid = index_heap[0];
+    ProgramStruct *prog = pool+order[pid];
+    // a start missed because the clock jumped forward is not run
+    ulong next = next_minute[pid];
+    if (next < curr_minute)  next = prog->next_match(curr_minute);
+    if (next == curr_minute) {
+      // insert sorted by pid
+      uint16_t i = n++;
+      for (; i > 0 && pids[i-1] > pid; i--)  pids[i] = pids[i-1];
+      pids[i] = pid;
+      next = prog->next_match(curr_minute+1);
+    }
+    index_set(pid, next);
+  }
+  return n;
+}
+
+/** Get the minute of the next program start after curr_minute
+ * If the index is out of date, that is the next minute, when
+ * index_pop_due brings it up to date.
+ */
+ulong ProgramData::index_next_due(ulong curr_minute) {
+  if (index_stale(curr_minute) || index_sun_changed())  return curr_minute+1;
+  if (!index_size)  return curr_minute + NEXT_MATCH_HORIZON*1440UL;
+  ulong next = next_minute[index_heap[0]];
+  return (next > curr_minute) ? next : curr_minute+1;
+}
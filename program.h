@@ -29,12 +29,13 @@
 #define PROGRAM_NAME_SIZE   20
 #define RUNTIME_QUEUE_SIZE  MAX_NUM_STATIONS
 
+#include <stddef.h>
 #include "OpenHome.h"
 
 /** Log data structure */
 struct LogStruct {
-  byte station;
-  byte program;
+  uint16_t station;
+  uint16_t program;
   uint16_t duration;
   uint32_t endtime;
 };
@@ -48,6 +49,8 @@ struct LogStruct {
 #define STARTTIME_SUNSET_BIT  13
 #define STARTTIME_SIGN_BIT    12
 
+#define NEXT_MATCH_HORIZON    400   // number of days searched ahead for a program's next start
+
 /** Program data structure */
 class ProgramStruct {
 public:
@@ -94,25 +97,89 @@ public:
   //   else: standard start time (value between 0 to 1440, by bits 0 to 10)
   int16_t starttimes[MAX_NUM_STARTTIMES];
 
-  byte durations[MAX_NUM_STATIONS];  // duration / water time of each station
-  
   char name[PROGRAM_NAME_SIZE];
 
+  // duration / water time of each station (ProgramData::ndurations of them)
+  // not part of the saved program; ProgramData::read copies them here
+  byte *durations;
+
   byte check_match(time_t t);
+  ulong next_match(ulong minute); // first minute (since epoch) at or after the given one that check_match accepts
   int16_t starttime_decode(int16_t t);  
+  byte uses_sun_time();  // whether a start time is relative to sunrise or sunset
 protected:
   byte check_day_match(time_t t);
+  byte check_minute_match(unsigned int current_minute, byte today, byte yesterday);
+  int16_t first_minute_match(int16_t current_minute, byte today, byte yesterday);
 
 };
 
+/** Program data saved by older firmware (in nvm and version 1 program files)
+ * The same as ProgramStruct, with durations for LEGACY_NUM_STATIONS in place.
+ */
+struct LegacyProgramStruct {
+  byte flags;   // enabled .. dummy1 of ProgramStruct
+  byte days[2];
+  int16_t starttimes[MAX_NUM_STARTTIMES];
+  byte durations[LEGACY_NUM_STATIONS];
+  char name[PROGRAM_NAME_SIZE];
+};
+
 /** Program data nvm addresses */
-#define PROGRAMSTRUCT_SIZE         (sizeof(ProgramStruct))
+#define PROGRAMSTRUCT_SIZE         (offsetof(ProgramStruct, durations))  // saved part of ProgramStruct
 #define ADDR_PROGRAMTYPEVERSION     ADDR_NVM_PROGRAMS
 #define ADDR_PROGRAMCOUNTER        (ADDR_NVM_PROGRAMS+1)
 #define ADDR_PROGRAMDATA           (ADDR_NVM_PROGRAMS+2)
 
-// maximum number of programs, restricted by internal NVM size
-#define MAX_NUMBER_PROGRAMS        ((MAX_PROGRAMDATA-2)/PROGRAMSTRUCT_SIZE)
+// maximum number of programs in nvm, only used to import programs from old firmware
+#define MAX_NVM_PROGRAMS           ((MAX_PROGRAMDATA-2)/sizeof(LegacyProgramStruct))
+
+// maximum number of programs in the program store file
+#define MAX_NUMBER_PROGRAMS        2048
+
+/** Program store file
+ * Programs are kept in RAM and persisted to an append-only log file.
+ * Each change (add, modify, delete, move up, erase all) appends one record,
+ * and the program list is rebuilt by replaying the log at boot. Once most of
+ * the log is superseded, it is compacted into a new file with one add record
+ * per program. A thread writes that file, so the main loop does not wait
+ * for the disk.
+ *
+ * A program is saved as PROGRAMSTRUCT_SIZE bytes followed by its
+ * durations, as many as the header says. Version 1 files (programs
+ * saved as LegacyProgramStruct) are converted when they are loaded.
+ */
+#define PROGRAM_FILE_MAGIC     0x47504F48UL  // "OHPG"
+#define PROGRAM_FILE_VERSION   2
+#define PROGRAM_FILE_V1_HEADER 8  // size of the version 1 header, which ends after recsize
+
+struct ProgramFileHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t recsize;     // size of ProgramStruct the file was written with
+  uint16_t ndurations;  // durations saved with each program
+  uint16_t reserved;
+};
+
+#define PROGRAM_LOG_ADD       1
+#define PROGRAM_LOG_MODIFY    2
+#define PROGRAM_LOG_DELETE    3
+#define PROGRAM_LOG_MOVEUP    4
+#define PROGRAM_LOG_ERASEALL  5
+
+#define PROGRAM_COMPACT_MIN   65536 // superseded bytes before the store file is compacted
+
+struct ProgramLogRecord {
+  uint32_t crc;       // crc of the rest of the record, including program data
+  byte op;
+  byte reserved;
+  uint16_t pid;
+};
+
+// queue pids of stations not started by a program
+// they are reported as the legacy values 99 and 254
+#define QUEUE_PID_MANUAL      0xFFFE  // manually started (test) stations
+#define QUEUE_PID_RUNONCE     0xFFFF  // run-once program
 
 extern OpenHome os;
 
@@ -122,35 +189,116 @@ class RuntimeQueueStruct {
 public:
   ulong    st;  // start time
   uint16_t dur; // water time
-  byte  sid;
-  byte  pid;
+  uint16_t sid;
+  uint16_t pid; // program index+1, or QUEUE_PID_MANUAL / QUEUE_PID_RUNONCE
+  uint16_t next;  // next element of the same station (starting later), or 0xFFFF
 };
 
 class ProgramData {
 public:  
-  static RuntimeQueueStruct queue[];
-  static byte nqueue;         // number of queue elements
-  static byte station_qid[];  // this array stores the queue element index for each scheduled station
-  static byte nprograms;      // number of programs
+  static RuntimeQueueStruct queue[];  // pool of queue elements
+  static uint16_t nqueue;         // number of queue elements
+  static uint16_t station_qid[];  // first element (earliest start) of each scheduled station, or 0xFFFF
+  static uint16_t pending[];      // elements enqueued and waiting for a start time, in order
+  static uint16_t npending;
+  static uint16_t edge_heap[];    // scheduled stations, as a min-heap on their next start or stop time
+  static uint16_t nedges;
+  static uint64_t edge_bits[];    // the stations in edge_heap, as a station bitset (see station_bit)
+  static uint16_t nprograms;  // number of programs
+  static uint16_t ndurations; // durations kept for each program, at least os.nstations
   static LogStruct lastrun;
-  static ulong last_seq_stop_time;  // the last stop time of a sequential station
+  static ulong store_gen;     // generation of the program store, bumped by every change
   
   static void reset_runtime();
-  static RuntimeQueueStruct* enqueue(); // this returns a pointer to the next available slot in the queue
-  static void dequeue(byte qid);  // this removes an element from the queue
+  static RuntimeQueueStruct* enqueue(); // this returns a pointer to a free element, added to pending
+  static void insert_pending();   // add the pending elements to their stations, once they have start times
+  static void dequeue(uint16_t qid);  // this removes an element from the queue
+  static void edge_update(uint16_t sid);      // re-sort a station after its first element or its bit changed
+  static uint16_t edge_due(ulong curr_time);  // a station whose next start or stop is due, or 0xFFFF
+  static ulong edge_next();   // the earliest next start or stop (edge_heap must not be empty)
 
   static void init();
   static void eraseall();
-  static void read(byte pid, ProgramStruct *buf);
+  static void durations_resize(uint16_t n); // keep (at least) n durations for each program
+  static void read(uint16_t pid, ProgramStruct *buf);
   static byte add(ProgramStruct *buf);
-  static byte modify(byte pid, ProgramStruct *buf);
-  static void moveup(byte pid);  
-  static byte del(byte pid);
+  static byte modify(uint16_t pid, ProgramStruct *buf);
+  static void moveup(uint16_t pid);  
+  static byte del(uint16_t pid);
+  static void compact_check();  // compact the program store file if mostly superseded
+  static void compact_wait();   // wait for a compaction in progress to finish
+  static void batch_begin();    // hold back changes from the store file until batch_commit
+  static void batch_commit();   // write the changes made since batch_begin with one sync
+  static void batch_rollback(); // undo the changes made since batch_begin
+  static uint16_t report_pid(uint16_t qpid); // queue pid as reported in json and logs
   static void drem_to_relative(byte days[2]); // absolute to relative reminder conversion
   static void drem_to_absolute(byte days[2]);
+
+  static void index_invalidate();  // mark the next start index for a full rebuild
+  static uint16_t index_pop_due(ulong curr_minute, uint16_t pids[]); // get programs starting at curr_minute, in pid order
+  static ulong index_next_due(ulong curr_minute);  // minute of the next program start after curr_minute
 private:  
-  static void load_count();
-  static void save_count();
+  static void load_store();
+  static void import_nvm();
+  static void import_legacy(const LegacyProgramStruct *old, ProgramStruct *buf);
+  static bool durations_grow(uint16_t n);
+  static void store(uint16_t slot, ProgramStruct *buf);
+  static byte apply(byte op, uint16_t pid, ProgramStruct *buf);
+  static bool replay(ProgramLogRecord *rec, ProgramStruct *buf);
+  static void append(ProgramLogRecord *rec, ProgramStruct *buf);
+  static void compact();        // start rewriting the store file, in a thread
+  static void *compact_run(void *);
+  static void store_write(const byte *data, int len);
+  static void store_fail();
+  static void edge_set(uint16_t sid, ulong t);
+  static void edge_remove(uint16_t sid);
+  static void edge_sift(uint16_t i);
+  static bool index_stale(ulong curr_minute);
+  static bool index_sun_changed();
+  static void index_rebuild(ulong curr_minute);
+  static void index_sun_update(ulong curr_minute);
+  static void index_update(byte op, uint16_t pid);
+  static void index_set(uint16_t pid, ulong minute);
+  static void index_sift(uint16_t i);
+
+  static uint16_t queue_free;   // unused queue elements, linked by next
+  static ulong edge_time[];     // next start or stop time of each scheduled station
+  static uint16_t edge_pos[];   // position of each station in edge_heap, or 0xFFFF
+
+  // program store: programs live in pool slots, order maps program index to slot
+  static ProgramStruct pool[];
+  static byte *pool_durations;  // durations of each pool slot, ndurations per slot
+  static uint16_t order[];
+  static uint16_t free_slots[];
+  static uint16_t nfree;
+  static int store_fd;
+  static off_t store_size;      // bytes in the program store file
+  static byte store_failed;     // a write failed (or the durations grew), the file must be rewritten
+
+  // batch: log records held back, and what is needed to undo the changes
+  static byte batch_active;
+  static byte *batch_log;
+  static int batch_len;
+  static int batch_cap;
+  static uint16_t batch_nprograms;
+  static uint16_t batch_nfree;
+  static uint16_t batch_order[];
+  static uint16_t batch_free_slots[];
+  static byte batch_saved[];          // bit per pool slot saved in batch_undo
+  static struct BatchSlot { uint16_t slot; uint16_t ndurations; ProgramStruct prog; } *batch_undo;  // prog.durations is a copy
+  static uint16_t batch_nundo;
+  static bool batch_save(uint16_t slot);
+  static void batch_discard();
+
+  // next start index: min-heap of program ids keyed by their next start minute
+  static ulong next_minute[];
+  static uint16_t index_heap[];
+  static uint16_t index_pos[];      // position of each program in index_heap
+  static uint16_t index_size;
+  static byte index_dirty;
+  static ulong index_minute;        // last minute the index was checked against
+  static uint16_t index_sunrise;    // sunrise and sunset the index was built with
+  static uint16_t index_sunset;
 };
 
 #endif  // _PROGRAM_H
@@ -27,20 +27,23 @@
 #include <stdarg.h>
 #include <iostream>
 #include <stdlib.h>
+#include <signal.h>
+#include <pthread.h>
 #include "etherport.h"
 #include "server.h"
 
-extern char ether_buffer[];
-extern EthernetClient *m_client;
+extern thread_local char ether_buffer[];
+extern thread_local EthernetClient *m_client;
+extern EthernetServer *m_server;
 
-extern BufferFiller bfill;
-extern char tmp_buffer[];
+extern thread_local BufferFiller bfill;
+extern thread_local char tmp_buffer[];
 extern OpenHome os;
 extern ProgramData pd;
 
 void write_log(byte type, ulong curr_time);
 void schedule_all_stations(ulong curr_time);
-void turn_off_station(byte sid, ulong curr_time);
+void turn_off_station(uint16_t sid, ulong curr_time);
 void process_dynamic_events(ulong curr_time);
 void check_network(time_t curr_time);
 void check_weather(time_t curr_time);
@@ -50,7 +53,7 @@ void delete_log(char *name);
 void reset_all_stations_immediate();
 void reset_all_stations();
 void make_logfile_name(char *name);
-int available_ether_buffer();
+unsigned char h2int(char c);
 
 // Define return error code
 #define HTML_OK                0x00
@@ -77,6 +80,14 @@ static const char htmlNoCache[] PROGMEM =
   "Cache-Control: max-age=0, no-cache, no-store, must-revalidate\r\n"
 ;
 
+static const char html304NotModified[] PROGMEM =
+  "HTTP/1.1 304 Not Modified\r\n"
+;
+
+static const char htmlRevalidate[] PROGMEM =
+  "Cache-Control: no-cache\r\n"
+;
+
 static const char htmlContentHTML[] PROGMEM =
   "Content-Type: text/html\r\n"
 ;
@@ -87,7 +98,15 @@ static const char htmlAccessControl[] PROGMEM =
 
 static const char htmlContentJSON[] PROGMEM =
   "Content-Type: application/json\r\n"
-  "Connection: close\r\n"
+;
+
+static const char htmlContentCBOR[] PROGMEM =
+  "Content-Type: application/cbor\r\n"
+  "Vary: Accept\r\n"
+;
+
+static const char htmlContentEvents[] PROGMEM =
+  "Content-Type: text/event-stream\r\n"
 ;
 
 static const char htmlMobileHeader[] PROGMEM =
@@ -98,25 +117,573 @@ static const char htmlReturnHome[] PROGMEM =
   "<script>window.location=\"/\";</script>\n"
 ;
 
+/** Entity tags of json responses
+ * Endpoints whose output only depends on data with a generation counter
+ * tag their responses with the counters (and the server's start time, as
+ * counters start over). A client that sends the tag back in If-None-Match
+ * gets 304 Not Modified, without the response being rendered. Tagged
+ * responses may be stored by the client, but must be revalidated.
+ * /jc and /ja carry the device time, so they are not tagged.
+ */
+static time_t server_start_time = 0;  // controller time at startup, simulated in a simulation
+static thread_local char etag_buf[80];
+static thread_local const char *response_etag = NULL;  // tag of the response being rendered
+static thread_local bool response_cbor = false;         // json response to be sent in cbor
+
+/** Generation counters the output of a json section (o, p, n or s) depends on,
+ * false if the section has none */
+static bool section_gens(char sec, ulong gens[3]) {
+  gens[2] = 0;
+  switch(sec) {
+  case 'o': gens[0] = os.options_gen; gens[1] = 0; break;
+  case 'p': // interval programs are shown relative to the current day
+    gens[0] = pd.store_gen; gens[1] = os.options_gen; gens[2] = os.now_tz()/86400UL; break;
+  case 'n': gens[0] = os.stations_gen; gens[1] = os.options_gen; break;
+  case 's': gens[0] = os.runtime_gen; gens[1] = os.options_gen; break;
+  default: return false;
+  }
+  return true;
+}
+
+/** Tag of the current data of an endpoint, false if the endpoint is not tagged */
+static bool make_etag(const char *com, char *buf) {
+  ulong gens[3];
+  if (com[0]!='j' || !section_gens(com[1], gens)) return false;
+  snprintf(buf, sizeof(etag_buf), "W/\"%lx.%c%lx.%lx.%lx%s\"", (ulong)server_start_time, com[1], gens[0], gens[1], gens[2],
+           response_cbor ? ".cbor" : "");
+  return true;
+}
+
+/** Whether the request's If-None-Match lists the tag (weak comparison) */
+static bool etag_match(const char *req, const char *etag) {
+  const char *hdr_end = strstr(req, "\r\n\r\n");
+  if (!hdr_end) hdr_end = strstr(req, "\n\n");
+  const char *v = strcasestr(req, "\nIf-None-Match:");
+  if (!v || !hdr_end || v > hdr_end) return false;
+  v += 15;
+  const char *eol = strchr(v, '\n');
+  const char *opaque = strchr(etag, '"');  // the tag without W/
+  size_t len = strlen(opaque);
+  for (const char *t = v; t && t < eol; t = strchr(t+1, ',')) {
+    while (*t==',' || *t==' ') t++;
+    if (*t=='*') return true;
+    if (t[0]=='W' && t[1]=='/') t += 2;
+    if (strncmp(t, opaque, len)==0) return true;
+  }
+  return false;
+}
+
+static void print_etag() {
+  char line[sizeof(etag_buf)+10];
+  int n = snprintf(line, sizeof(line), "ETag: %s\r\n", response_etag);
+  m_client->write_static(htmlRevalidate, sizeof(htmlRevalidate)-1);
+  m_client->write((const uint8_t *)line, n);
+}
+
+/** Answer a conditional request whose data has not changed */
+static void print_not_modified() {
+  m_client->write_static(html304NotModified, sizeof(html304NotModified)-1);
+  print_etag();
+  m_client->write_static(htmlAccessControl, sizeof(htmlAccessControl)-1);
+  m_client->end_headers(false);
+}
+
+/** Json responses in CBOR (RFC 8949)
+ * A client that prefers application/cbor in its Accept header gets the
+ * json endpoints in CBOR. The handlers still describe json with emit_p,
+ * and bfill writes it in CBOR: the arguments are encoded from their types
+ * ($D and $L as integers, $J and $N as text), while the json text of the
+ * format (brackets, keys, literal values) and json passed in $S goes
+ * through a small reader. Arrays and objects become arrays and maps of
+ * indefinite length, other numbers become floats (single precision when
+ * that is exact), and strings are unescaped into text strings.
+ */
+#define CBOR_VALUE    0
+#define CBOR_STRING   1
+#define CBOR_ESCAPE   2
+#define CBOR_UNICODE  3
+#define CBOR_NUMBER   4
+#define CBOR_LITERAL  5
+
+struct CborEncoder {
+  BufferFiller *out;    // bfill of the thread, kept to spare its lookups
+  bool active;
+  byte state;
+  byte hex_digits;      // \u escape: digits read so far
+  uint16_t hex;
+  uint16_t surrogate;   // high surrogate waiting for the low one
+  char *tok;            // string, number or literal being read
+  size_t tok_len, tok_cap;
+};
+
+static thread_local CborEncoder cbor;
+
+static void cbor_put(const void *buf, size_t len) {
+  cbor.out->put((const char*) buf, len);
+}
+
+/** Initial byte of a data item, and its argument in the fewest bytes */
+static void cbor_head(byte major, uint64_t v) {
+  byte h[9];
+  if (v < 24) {
+    h[0] = (major<<5) | v;
+    cbor_put(h, 1);
+    return;
+  }
+  byte ai = (v <= 0xFF) ? 24 : (v <= 0xFFFF) ? 25 : (v <= 0xFFFFFFFFUL) ? 26 : 27;
+  int size = 1 << (ai-24);
+  h[0] = (major<<5) | ai;
+  for (int i = size; i > 0; i--, v >>= 8) h[i] = v & 0xFF;
+  cbor_put(h, size+1);
+}
+
+static bool cbor_tok_add(const char *s, size_t len) {
+  if (cbor.tok_len + len + 1 > cbor.tok_cap) {
+    size_t cap = (cbor.tok_len + len + 1) * 2;
+    char *tok = (char*) realloc(cbor.tok, cap);
+    if (!tok) return false;
+    cbor.tok = tok;
+    cbor.tok_cap = cap;
+  }
+  memcpy(cbor.tok + cbor.tok_len, s, len);
+  cbor.tok_len += len;
+  return true;
+}
+
+/** Add a code point, utf-8 encoded, to the string being read */
+static void cbor_tok_utf8(uint32_t cp) {
+  char u[4];
+  int n;
+  if (cp < 0x80) { u[0] = cp; n = 1; }
+  else if (cp < 0x800) { u[0] = 0xC0 | (cp>>6); u[1] = 0x80 | (cp&0x3F); n = 2; }
+  else if (cp < 0x10000) { u[0] = 0xE0 | (cp>>12); u[1] = 0x80 | ((cp>>6)&0x3F); u[2] = 0x80 | (cp&0x3F); n = 3; }
+  else { u[0] = 0xF0 | (cp>>18); u[1] = 0x80 | ((cp>>12)&0x3F); u[2] = 0x80 | ((cp>>6)&0x3F); u[3] = 0x80 | (cp&0x3F); n = 4; }
+  cbor_tok_add(u, n);
+}
+
+/** Encode the number or literal that has been read */
+static void cbor_token_end() {
+  cbor.tok[cbor.tok_len] = 0;
+  if (cbor.state == CBOR_LITERAL) {
+    if (!strcmp(cbor.tok, "true")) cbor_head(7, 21);
+    else if (!strcmp(cbor.tok, "false")) cbor_head(7, 20);
+    else if (!strcmp(cbor.tok, "null")) cbor_head(7, 22);
+  } else if (strpbrk(cbor.tok, ".eE")) {
+    double d = strtod(cbor.tok, NULL);
+    float f = (float) d;
+    byte b[9];
+    int n;
+    if ((double) f == d) {
+      uint32_t bits;
+      memcpy(&bits, &f, 4);
+      b[0] = 0xFA;
+      for (n = 4; n > 0; n--, bits >>= 8) b[n] = bits & 0xFF;
+      n = 5;
+    } else {
+      uint64_t bits;
+      memcpy(&bits, &d, 8);
+      b[0] = 0xFB;
+      for (n = 8; n > 0; n--, bits >>= 8) b[n] = bits & 0xFF;
+      n = 9;
+    }
+    cbor_put(b, n);
+  } else if (cbor.tok[0] == '-') {
+    long long v = strtoll(cbor.tok, NULL, 10);
+    cbor_head(1, (uint64_t) -(v+1));
+  } else {
+    cbor_head(0, strtoull(cbor.tok, NULL, 10));
+  }
+  cbor.tok_len = 0;
+  cbor.state = CBOR_VALUE;
+}
+
+/** Encode json values until one is cut off by the end of the piece; returns where it stopped */
+static const char* cbor_values(const char *s, const char *end) {
+  static const byte array_start = 0x9F, map_start = 0xBF, stop = 0xFF;  // indefinite length
+  while (s < end) {
+    char c = *s++;
+    if (c == ',' || c == ':' || c == ' ' || c == '\n' || c == '\r' || c == '\t') continue;
+    if (c == '[') {
+      cbor_put(&array_start, 1);
+    } else if (c == '{') {
+      cbor_put(&map_start, 1);
+    } else if (c == ']' || c == '}') {
+      cbor_put(&stop, 1);
+    } else if (c == '"') {
+      // a string that is all here, with nothing to unescape, is copied as it is
+      const char *str = s;
+      while (s < end && *s != '"' && *s != '\\') s++;
+      if (s < end && *s == '"') {
+        cbor_head(3, s-str);
+        cbor_put(str, s-str);
+        s++;
+        continue;
+      }
+      cbor.state = CBOR_STRING;
+      cbor.tok_len = 0;
+      cbor.surrogate = 0;
+      cbor_tok_add(str, s-str);
+      return s;
+    } else if (c == '-' || (c >= '0' && c <= '9')) {
+      // so is an integer
+      const char *num = s-1;
+      uint64_t v = (c == '-') ? 0 : c-'0';
+      while (s < end && *s >= '0' && *s <= '9' && s-num < 19) v = v*10 + (*s++ - '0');
+      if (s < end && s-num > (c=='-') && *s != '.' && *s != 'e' && *s != 'E' && (*s < '0' || *s > '9')) {
+        if (c == '-' && v) cbor_head(1, v-1);
+        else cbor_head(0, v);
+        continue;
+      }
+      cbor.state = CBOR_NUMBER;
+      cbor_tok_add(num, s-num);
+      return s;
+    } else if (c >= 'a' && c <= 'z') {
+      cbor.state = CBOR_LITERAL;
+      cbor_tok_add(&c, 1);
+      return s;
+    }
+  }
+  return s;
+}
+
+/** Encode a piece of json */
+static void cbor_feed(const char *s, size_t len) {
+  const char *end = s + len;
+  while (s < end) {
+    char c = *s;
+    switch (cbor.state) {
+    case CBOR_VALUE:
+      s = cbor_values(s, end);
+      break;
+    case CBOR_STRING: {
+      // characters that need no unescaping go in one piece
+      const char *run = s;
+      while (s < end && *s != '"' && *s != '\\') s++;
+      cbor_tok_add(run, s - run);
+      if (s == end) break;
+      if (*s++ == '\\') {
+        cbor.state = CBOR_ESCAPE;
+      } else {
+        cbor_head(3, cbor.tok_len);
+        cbor_put(cbor.tok, cbor.tok_len);
+        cbor.tok_len = 0;
+        cbor.state = CBOR_VALUE;
+      }
+      break;
+    }
+    case CBOR_ESCAPE:
+      s++;
+      cbor.state = CBOR_STRING;
+      switch (c) {
+      case 'n': c = '\n'; break;
+      case 'r': c = '\r'; break;
+      case 't': c = '\t'; break;
+      case 'b': c = '\b'; break;
+      case 'f': c = '\f'; break;
+      case 'u':
+        cbor.state = CBOR_UNICODE;
+        cbor.hex = 0;
+        cbor.hex_digits = 0;
+        continue;
+      }
+      cbor_tok_add(&c, 1);
+      break;
+    case CBOR_UNICODE:
+      s++;
+      cbor.hex = (cbor.hex<<4) | h2int(c);
+      if (++cbor.hex_digits < 4) break;
+      cbor.state = CBOR_STRING;
+      if (cbor.hex >= 0xD800 && cbor.hex < 0xDC00) {
+        cbor.surrogate = cbor.hex;
+      } else if (cbor.hex >= 0xDC00 && cbor.hex < 0xE000 && cbor.surrogate) {
+        cbor_tok_utf8(0x10000 + ((uint32_t)(cbor.surrogate-0xD800)<<10) + (cbor.hex-0xDC00));
+        cbor.surrogate = 0;
+      } else {
+        cbor_tok_utf8(cbor.hex);
+      }
+      break;
+    default:  // number or literal, up to the first character that cannot be part of it
+      if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || c == '.' || c == '-' || c == '+' || c == 'E') {
+        cbor_tok_add(&c, 1);
+        s++;
+      } else {
+        cbor_token_end();
+      }
+    }
+  }
+}
+
+/** An integer argument, followed by the format character next
+ * It is encoded as it is, unless it is part of a string (or of a number
+ * the format goes on with). */
+static void cbor_integer(unsigned long v, bool neg, char next) {
+  if (cbor.state == CBOR_VALUE && !(next && strchr("0123456789.eE", next))) {
+    if (neg) cbor_head(1, v-1);
+    else cbor_head(0, v);
+    return;
+  }
+  char num[24];
+  int n = snprintf(num, sizeof(num), neg ? "-%lu" : "%lu", v);
+  if (cbor.state == CBOR_STRING) cbor_tok_add(num, n);
+  else cbor_feed(num, n);
+}
+
+/** A string argument, the text of a json string */
+static void cbor_text(const char *s, size_t len) {
+  if (cbor.state == CBOR_STRING) {
+    cbor_tok_add(s, len);
+  } else {
+    cbor_head(3, len);
+    cbor_put(s, len);
+  }
+}
+
+/** Start encoding the body of the response */
+static void cbor_begin() {
+  cbor.out = &bfill;
+  cbor.active = true;
+  cbor.state = CBOR_VALUE;
+  cbor.tok_len = 0;
+  bfill.set_cbor(true);
+}
+
+/** Encode what is left of the body of the response */
+static void cbor_end() {
+  if (!cbor.active) return;
+  if (cbor.state == CBOR_NUMBER || cbor.state == CBOR_LITERAL) cbor_token_end();
+  cbor.active = false;
+  bfill.set_cbor(false);
+}
+
+/** Whether the Accept header of a request ranks application/cbor above json */
+static bool request_prefers_cbor(const char *req) {
+  const char *hdr_end = strstr(req, "\r\n\r\n");
+  if (!hdr_end) hdr_end = strstr(req, "\n\n");
+  const char *v = strcasestr(req, "\nAccept:");
+  if (!v || !hdr_end || v > hdr_end) return false;
+  v += 8;
+  const char *eol = strchr(v, '\n');
+  float q_cbor = 0, q_json = 0;
+  for (const char *t = v; t && t < eol; t = strchr(t, ',')) {
+    while (*t==',' || *t==' ') t++;
+    const char *q = strpbrk(t, ",\n");
+    const char *param = strstr(t, ";q=");
+    float qv = (param && (!q || param < q)) ? atof(param+3) : 1;
+    if (!strncasecmp(t, "application/cbor", 16)) q_cbor = qv;
+    else if (!strncasecmp(t, "application/json", 16)) q_json = qv;
+  }
+  return q_cbor > q_json;
+}
+
+// header lines are static, so they are referenced by the response instead of copied
 void print_html_standard_header() {
-  m_client->write((const uint8_t *)html200OK, strlen(html200OK));
-  m_client->write((const uint8_t *)htmlContentHTML, strlen(htmlContentHTML));
-  m_client->write((const uint8_t *)htmlNoCache, strlen(htmlNoCache));
-  m_client->write((const uint8_t *)htmlAccessControl, strlen(htmlAccessControl));
-  m_client->write((const uint8_t *)"\r\n", 2);
+  m_client->write_static(html200OK, sizeof(html200OK)-1);
+  m_client->write_static(htmlContentHTML, sizeof(htmlContentHTML)-1);
+  m_client->write_static(htmlNoCache, sizeof(htmlNoCache)-1);
+  m_client->write_static(htmlAccessControl, sizeof(htmlAccessControl)-1);
+  m_client->end_headers();
 }
 
 void print_json_header(bool bracket=true) {
-  m_client->write((const uint8_t *)html200OK, strlen(html200OK));
-  m_client->write((const uint8_t *)htmlContentJSON, strlen(htmlContentJSON));
-  m_client->write((const uint8_t *)htmlNoCache, strlen(htmlNoCache));
-  m_client->write((const uint8_t *)htmlAccessControl, strlen(htmlAccessControl));
-  if(bracket) m_client->write((const uint8_t *)"\r\n{", 3);
-  else m_client->write((const uint8_t *)"\r\n", 2);
+  m_client->write_static(html200OK, sizeof(html200OK)-1);
+  if (response_cbor) m_client->write_static(htmlContentCBOR, sizeof(htmlContentCBOR)-1);
+  else m_client->write_static(htmlContentJSON, sizeof(htmlContentJSON)-1);
+  if (response_etag) print_etag();
+  else m_client->write_static(htmlNoCache, sizeof(htmlNoCache)-1);
+  m_client->write_static(htmlAccessControl, sizeof(htmlAccessControl)-1);
+  m_client->end_headers();
+  if (response_cbor) cbor_begin();
+  if(bracket) bfill.emit_p(PSTR("{"));
+}
+
+/** Query parameter index
+ * The query string of a request is split into key/value spans once,
+ * and findKeyVal looks keys up in a small hash table instead of
+ * rescanning the request line for every key. Keys must match exactly,
+ * and the first occurrence of a key wins. Values are not decoded here;
+ * handlers url-decode the values they read.
+ * POST requests add the parameters of their body, either a form
+ * (key1=val1&key2=val2...) or a flat json object. Json string values
+ * are indexed verbatim, without their quotes, and go through the same
+ * url decoding as form values.
+ * A request with more parameters than the index holds is refused, rather
+ * than served without the ones that did not fit.
+ */
+// enough for a full /cs: a name per station, six attribute bytes per board, pw
+#define QUERY_MAX_PARAMS  (MAX_NUM_STATIONS+6*(MAX_EXT_BOARDS+1)+32)
+#define QUERY_HASH_SIZE   8192  // power of two, at least twice QUERY_MAX_PARAMS
+
+struct QueryParam {
+  const char *key;
+  const char *val;
+  uint16_t keylen;
+  uint16_t vallen;
+  uint16_t slot;  // hash slot of the key
+  bool encoded;   // value is url-encoded (query string or form)
+};
+
+// the index is per thread, each http worker serves its own request
+static thread_local QueryParam query_params[QUERY_MAX_PARAMS];
+static thread_local uint16_t query_hash[QUERY_HASH_SIZE];  // parameter index+1, 0 means empty
+static thread_local const char *query_str = NULL;      // query string the index was built for
+static thread_local uint16_t query_count = 0;
+static thread_local bool query_full = false;         // parameters were left out of the index
+/** FNV-1a hash of a key */
+static uint16_t query_hash_key(const char *key, int len) {
+  uint32_t h = 2166136261UL;
+  while(len--) {
+    h ^= (byte)*key++;
+    h *= 16777619UL;
+  }
+  return h & (QUERY_HASH_SIZE-1);
+}
+
+/** Find the hash slot of a key: either the slot holding it, or the empty slot it would go in */
+static uint16_t* query_slot(const char *key, int len) {
+  uint16_t h = query_hash_key(key, len);
+  while(query_hash[h]) {
+    QueryParam *qp = query_params + query_hash[h]-1;
+    if(qp->keylen==len && strncmp(qp->key, key, len)==0) break;
+    h = (h+1) & (QUERY_HASH_SIZE-1);
+  }
+  return query_hash+h;
+}
+
+/** Add one parameter to the index */
+static void query_add(const char *key, int keylen, const char *val, int vallen, bool encoded) {
+  uint16_t *slot = query_slot(key, keylen);
+  if(*slot) return;
+  if(query_count>=QUERY_MAX_PARAMS) {
+    query_full = true;
+    return;
+  }
+  QueryParam *qp = query_params + query_count;
+  qp->key = key;
+  qp->keylen = keylen;
+  qp->val = val;
+  qp->vallen = vallen;
+  qp->slot = slot-query_hash;
+  qp->encoded = encoded;
+  *slot = ++query_count;
+}
+
+/** Add the parameters of a form (key1=val1&key2=val2...) */
+static void query_add_form(const char *str) {
+  while(*str && *str!=' ' && *str!='\n' && !query_full) {
+    const char *key = str;
+    while(*str && *str!=' ' && *str!='\n' && *str!='&' && *str!='=') str++;
+    if(*str=='=') {
+      const char *val = ++str;
+      while(*str && *str!=' ' && *str!='\n' && *str!='&') str++;
+      query_add(key, val-1-key, val, str-val, true);
+    }
+    if(*str=='&') str++;
+  }
+}
+
+/** Skip a json string, str points at its opening quote */
+static const char* json_skip_string(const char *str) {
+  for(str++; *str && *str!='"'; str++) {
+    if(*str=='\\' && str[1]) str++;
+  }
+  return str;  // closing quote, or the end
+}
+
+/** Add the members of a flat json object ({"key1":val1,"key2":"val2"...}) */
+static void query_add_json(const char *str) {
+  while(isspace(*str)) str++;
+  if(*str++!='{') return;
+  while(!query_full) {
+    while(isspace(*str) || *str==',') str++;
+    if(*str!='"') return;
+    const char *key = str+1;
+    str = json_skip_string(str);
+    if(*str!='"') return;
+    int keylen = str-key;
+    str++;
+    while(isspace(*str)) str++;
+    if(*str++!=':') return;
+    while(isspace(*str)) str++;
+    const char *val = str;
+    if(*str=='"') {
+      // string: index what is between the quotes
+      str = json_skip_string(str);
+      if(*str!='"') return;
+      query_add(key, keylen, val+1, str-val-1, false);
+      str++;
+      continue;
+    }
+    // number, literal, or a nested array/object kept as raw text
+    int depth = 0;
+    for(; *str; str++) {
+      if(*str=='"') { str = json_skip_string(str); if(!*str) return; continue; }
+      if(*str=='[' || *str=='{') depth++;
+      else if(*str==']' || *str=='}') { if(!depth) break; depth--; }
+      else if(!depth && (*str==',' || isspace(*str))) break;
+    }
+    if(depth) return;
+    query_add(key, keylen, val, str-val, false);
+  }
+}
+
+/** Build the parameter index of a query string (key1=val1&key2=val2...) */
+void query_index(const char *str) {
+  // empty the slots of the previous request, not the whole table
+  for(uint16_t i=0;i<query_count;i++) query_hash[query_params[i].slot] = 0;
+  query_count = 0;
+  query_full = false;
+  query_str = str;
+  query_add_form(str);
+}
+
+/** Find the body of a request, and the end of its headers; NULL if there is none */
+static char* request_body(const char *req, const char **hdr_end=NULL) {
+  char *body = (char*) strstr(req, "\r\n\r\n");
+  if(hdr_end) *hdr_end = body;
+  if(body) return body+4;
+  body = (char*) strstr(req, "\n\n");
+  if(hdr_end) *hdr_end = body;
+  return body ? body+2 : NULL;
+}
+
+/** Add the body of a POST request to the index, req is the whole request */
+static void query_index_body(const char *req) {
+  const char *hdr_end;
+  const char *body = request_body(req, &hdr_end);
+  if(!body) return;
+  // look for a json content type among the headers
+  const char *ct = req;
+  while((ct = strcasestr(ct, "\nContent-Type:")) && ct < hdr_end) {
+    const char *v = ct + 14;
+    while(*v==' ') v++;
+    if(strncasecmp(v, "application/json", 16)==0) {
+      query_add_json(body);
+      return;
+    }
+    ct = v;
+  }
+  query_add_form(body);
+}
+
+/** Drop the parameter index (the request buffer is about to change) */
+void query_reset() {
+  query_str = NULL;
 }
 
 byte findKeyVal (const char *str,char *strbuf, uint8_t maxlen,const char *key,bool key_in_pgm=false,uint8_t *keyfound=NULL)
 {
+  if (str && str==query_str) {
+    // look up the request's parameter index
+    uint16_t idx = *query_slot(key, strlen(key));
+    if (keyfound) *keyfound = idx ? 1 : 0;
+    if (!idx) return 0;
+    QueryParam *qp = query_params + idx-1;
+    uint8_t i = (qp->vallen < maxlen-1) ? qp->vallen : maxlen-1;
+    memcpy(strbuf, qp->val, i);
+    strbuf[i] = '\0';
+    return i;
+  }
+
   uint8_t found=0;
   uint8_t i=0;
   const char *kp;
@@ -151,61 +718,323 @@ byte findKeyVal (const char *str,char *strbuf, uint8_t maxlen,const char *key,bo
   return(i);
 }
 
+void urlDecode(char *urlbuf);
+
+/** Value of a parameter of the request being handled, decoded and
+ * zero-terminated in place, or NULL. There is no length limit and no copy;
+ * other parameters can still be looked up afterwards */
+char* findKeyValInPlace(const char *str, const char *key) {
+  if (!str || str!=query_str) return NULL;
+  uint16_t idx = *query_slot(key, strlen(key));
+  if (!idx) return NULL;
+  QueryParam *qp = query_params + idx-1;
+  char *val = (char*) qp->val;
+  val[qp->vallen] = 0;  // the separator after the value
+  qp->vallen = 0;       // the value is consumed
+  if (qp->encoded) {
+    urlDecode(val);
+  } else {
+    // json: drop the whitespace between list items, so it parses like a query value
+    char *dst = val;
+    bool quoted = false;
+    for(char *src=val; *src; src++) {
+      if (*src=='"' && (src==val || src[-1]!='\\')) quoted = !quoted;
+      if (quoted || !isspace(*src)) *dst++ = *src;
+    }
+    *dst = 0;
+  }
+  return val;
+}
+
+/** Make room for len more bytes, flushing what is there if needed.
+ * Only bfill has a flush function; it sends the buffer and rewinds bfill */
+bool BufferFiller::room(size_t len) {
+  if ((size_t)(end - ptr) >= len) return true;
+  if (flush && ptr != start) {
+    *ptr = 0;
+    flush();
+  }
+  return (size_t)(end - ptr) >= len;
+}
+
+/** Copy len bytes across flushes of the buffer. False if the output is cut off */
+bool BufferFiller::put_pieces(const char *s, size_t len) {
+  while (len) {
+    size_t n = end - ptr;
+    if (!n) {
+      if (!room(1)) return false;
+      continue;
+    }
+    if (n > len) n = len;
+    memcpy(ptr, s, n);
+    ptr += n;
+    s += n;
+    len -= n;
+  }
+  return true;
+}
+
+/** Write the decimal digits of v backwards, ending at buf_end; returns where they start.
+ * Two digits are taken at a time, from a table */
+static char* format_ulong(char *buf_end, unsigned long v) {
+  static const char pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+  while (v >= 100) {
+    const char *d = pairs + (v % 100) * 2;
+    v /= 100;
+    *--buf_end = d[1];
+    *--buf_end = d[0];
+  }
+  if (v >= 10) {
+    *--buf_end = pairs[v*2+1];
+    *--buf_end = pairs[v*2];
+  } else {
+    *--buf_end = '0' + v;
+  }
+  return buf_end;
+}
+
+/** Output the decimal digits of v, preceded by a minus sign if neg is set */
+void BufferFiller::put_ulong(unsigned long v, bool neg) {
+  size_t len = neg ? 2 : 1;
+  for (unsigned long p = 10; v >= p; p *= 10) {
+    len++;
+    if (p > ULONG_MAX/10) break;
+  }
+  if ((size_t)(end - ptr) >= len) {
+    // the digits go straight in place
+    char *b = format_ulong(ptr + len, v);
+    if (neg) *--b = '-';
+    ptr += len;
+  } else {
+    char num[24];
+    char *b = format_ulong(num + sizeof(num), v);
+    if (neg) *--b = '-';
+    put(b, num + sizeof(num) - b);
+  }
+}
 
+/** Copy a string, escaped for a json string value */
+void BufferFiller::put_json(const char *s) {
+  static const char hex[] = "0123456789abcdef";
+  while (true) {
+    // characters that need no escape go in one piece
+    const char *run = s;
+    while ((byte)*s >= 0x20 && *s != '"' && *s != '\\') s++;
+    if (s != run && !put(run, s - run)) return;
+    char c = *s++;
+    if (!c) return;
+    char esc[6] = {'\\', c, 0, 0, 0, 0};
+    size_t len = 2;
+    switch (c) {
+    case '"': case '\\': break;
+    case '\n': esc[1] = 'n'; break;
+    case '\r': esc[1] = 'r'; break;
+    case '\t': esc[1] = 't'; break;
+    default:
+      esc[1] = 'u'; esc[2] = '0'; esc[3] = '0';
+      esc[4] = hex[(byte)c >> 4]; esc[5] = hex[c & 0x0F];
+      len = 6;
+    }
+    if (!put(esc, len)) return;
+  }
+}
+
+/** Copy the string at an nvm address, in chunks, escaped for json if json is set */
+void BufferFiller::put_nvm(const byte *addr, bool json) {
+  char chunk[64];
+  int n;
+  do {
+    n = nvm_read_string(chunk, addr, sizeof(chunk));
+    if (json) put_json(chunk);
+    else put(chunk, n);
+    addr += n;
+  } while (n == sizeof(chunk)-1);
+}
+
+/** Formatted output in CBOR, of the json emit_p would write
+ * $S, $F and $E hold json text, like the format; the other arguments
+ * are encoded as they are.
+ */
+static void emit_cbor(const char *fmt, va_list ap) {
+  while (*fmt) {
+    const char *run = fmt;
+    while (*fmt && *fmt != '$') fmt++;
+    if (fmt != run) cbor_feed(run, fmt - run);
+    if (*fmt != '$' || !fmt[1]) break;
+    char c = fmt[1];
+    fmt += 2;
+    switch (c) {
+    case 'D': {
+      long v = va_arg(ap, int);
+      cbor_integer((v < 0) ? (unsigned long)-v : (unsigned long)v, v < 0, *fmt);
+      break;
+    }
+    case 'L':
+      cbor_integer(va_arg(ap, unsigned long), false, *fmt);
+      break;
+    case 'S':
+    case 'F': {
+      const char *str = va_arg(ap, const char*);
+      cbor_feed(str, strlen(str));
+      break;
+    }
+    case 'J': {
+      const char *str = va_arg(ap, const char*);
+      cbor_text(str, strlen(str));
+      break;
+    }
+    case 'E':
+    case 'N': {
+      // in chunks, like put_nvm
+      const byte *addr = va_arg(ap, const byte*);
+      char chunk[64];
+      int n;
+      do {
+        n = nvm_read_string(chunk, addr, sizeof(chunk));
+        if (c == 'N') cbor_text(chunk, n);
+        else cbor_feed(chunk, n);
+        addr += n;
+      } while (n == sizeof(chunk)-1);
+      break;
+    }
+    default:
+      cbor_feed(&c, 1);
+    }
+  }
+}
+
+/** Formatted output
+ * $D int, $L unsigned long, $S and $F strings, $E string in nvm,
+ * $J string escaped for json, $N string in nvm escaped for json.
+ * Other characters after $ are written as they are.
+ */
 void BufferFiller::emit_p(const char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
-  for (;;) {
-    char c = *fmt++;
-    if (c == 0)
-      break;
-    if (c != '$') {
-      *ptr++ = c;
-      continue;
+  if (cbor) {
+    emit_cbor(fmt, ap);
+    va_end(ap);
+    return;
+  }
+  while (*fmt) {
+    // literal text is copied as the format is scanned
+    while (*fmt && *fmt != '$') {
+      if (ptr == end && !room(1)) break;
+      *ptr++ = *fmt++;
     }
-    c = *fmt++;
+    if (*fmt != '$' || !fmt[1]) break;  // end of the format, or cut off
+    char c = fmt[1];
+    fmt += 2;
     switch (c) {
-    case 'D':
-      itoa(va_arg(ap, int), (char*) ptr, 10);  // ray
+    case 'D': {
+      long v = va_arg(ap, int);
+      put_ulong((v < 0) ? (unsigned long)-v : (unsigned long)v, v < 0);
       break;
+    }
     case 'L':
-      ultoa(va_arg(ap, long), (char*) ptr, 10); // ray
+      put_ulong(va_arg(ap, unsigned long), false);
       break;
     case 'S':
-    case 'F':
-      strcpy((char*) ptr, va_arg(ap, const char*));
+    case 'F': {
+      const char *str = va_arg(ap, const char*);
+      put(str, strlen(str));
       break;
-    case 'E': {
-      byte* s = va_arg(ap, byte*);
-      char d;
-      while ((d = nvm_read_byte(s++)) != 0)
-        *ptr++ = d;
-      continue;
     }
+    case 'E':
+      put_nvm(va_arg(ap, const byte*), false);
+      break;
+    case 'J':
+      put_json(va_arg(ap, const char*));
+      break;
+    case 'N':
+      put_nvm(va_arg(ap, const byte*), true);
+      break;
     default:
-      *ptr++ = c;
-      continue;
+      put(&c, 1);
     }
-    ptr += strlen((char*) ptr);
   }
-  *(ptr)=0;
+  if (ptr) *ptr = 0;
   va_end(ap);
 }
 
+static void flush_packet();
+
 void rewind_ether_buffer() {
-  bfill = ether_buffer;
+  bfill = BufferFiller(ether_buffer, ETHER_BUFFER_SIZE, flush_packet, cbor.active);
+}
+
+/** Pre-rendered json sections
+ * /jn, /jp and /jo (and their parts of /ja and the home page) only
+ * change with generation counters. Their output is kept along with the
+ * counters it was rendered for, and copied into responses until one of
+ * the counters moves on. Workers serve requests at the same time, so
+ * the first one to find a copy out of date renders it while the others
+ * wait for it. Json and CBOR output are kept apart, each rendered the
+ * first time it is asked for.
+ */
+struct SectionCopy {
+  bool valid;
+  bool failed;    // out of memory while keeping the output
+  ulong gens[3];  // counters the output was rendered for
+  char *data;
+  size_t len, cap;
+};
+
+struct SectionCache {
+  pthread_mutex_t mutex;
+  SectionCopy copy[2];  // json, CBOR
+};
+
+static SectionCache stations_cache = {PTHREAD_MUTEX_INITIALIZER};
+static SectionCache programs_cache = {PTHREAD_MUTEX_INITIALIZER};
+static SectionCache options_cache = {PTHREAD_MUTEX_INITIALIZER};
+
+static thread_local SectionCopy *section_capture = NULL;  // section being rendered
+static thread_local unsigned int section_start = 0;       // where it starts in the buffer
+
+/** Keep output of the section being rendered */
+static void section_capture_add(const char *buf, size_t len) {
+  SectionCopy *c = section_capture;
+  if (c->failed || !len) return;
+  if (c->len + len > c->cap) {
+    size_t cap = (c->len + len) * 2;
+    char *data = (char*) realloc(c->data, cap);
+    if (!data) {
+      c->failed = true;
+      return;
+    }
+    c->data = data;
+    c->cap = cap;
+  }
+  memcpy(c->data + c->len, buf, len);
+  c->len += len;
 }
 
 void send_packet(bool final=false) {
-  m_client->write((const uint8_t *)ether_buffer, strlen(ether_buffer));
+  if (final) cbor_end();  // a number the CBOR encoding holds back
+  if (section_capture) {
+    section_capture_add(ether_buffer+section_start, bfill.position()-section_start);
+    section_start = 0;
+  }
+  m_client->write((const uint8_t *)ether_buffer, bfill.position());
   if (final)
     m_client->stop();
   else
     rewind_ether_buffer();
 }
 
-int available_ether_buffer() {
-  return ETHER_BUFFER_SIZE - (int)bfill.position();
+/** Send what is in the buffer: as part of the response being served,
+ * or to the event streams when there is none */
+static void flush_packet() {
+  if (m_client) {
+    send_packet();
+  } else {
+    m_server->broadcast(ether_buffer, bfill.position());
+    rewind_ether_buffer();
+  }
 }
 
 /** Convert a single hex digit character to its integer value */
@@ -226,6 +1055,7 @@ unsigned char h2int(char c)
 /** Decode a url string e.g "hello%20joe" or "hello+joe" becomes "hello joe" */
 void urlDecode (char *urlbuf)
 {
+    if (urlbuf == query_str) query_reset(); // decoding in place moves the indexed values
     char c;
     char *dst = urlbuf;
     while ((c = *urlbuf) != 0) {
@@ -254,10 +1084,10 @@ boolean check_password(char *p)
 
 void server_json_stations_attrib(const char* name, int addr)
 {
-  byte *attrib = (byte*)tmp_buffer;
+  byte attrib[MAX_EXT_BOARDS+1];
   os.station_attrib_bits_load(addr, attrib);
   bfill.emit_p(PSTR("\"$F\":["), name);
-  for(byte i=0;i<os.nboards;i++) {
+  for(uint16_t i=0;i<os.nboards;i++) {
     bfill.emit_p(PSTR("$D"), attrib[i]);
     if(i!=os.nboards-1)
       bfill.emit_p(PSTR(","));
@@ -265,7 +1095,38 @@ void server_json_stations_attrib(const char* name, int addr)
   bfill.emit_p(PSTR("],"));
 }
 
-void server_json_stations_main()
+static bool section_gens(char sec, ulong gens[3]);
+
+/** Output a json section, from its pre-rendered copy if that is up to date
+ * Sections start and end between values, so their CBOR does not depend
+ * on what surrounds them either. */
+static void print_section(SectionCache *sc, char sec, void (*render)()) {
+  ulong gens[3];
+  section_gens(sec, gens);
+  pthread_mutex_lock(&sc->mutex);
+  SectionCopy *c = sc->copy + (cbor.active ? 1 : 0);
+  bool between = !cbor.active || cbor.state == CBOR_VALUE;
+  if (between && c->valid && memcmp(gens, c->gens, sizeof(gens))==0) {
+    send_packet();  // what precedes the section
+    m_client->write((const uint8_t *)c->data, c->len);
+  } else {
+    c->valid = false;
+    c->failed = false;
+    c->len = 0;
+    section_capture = c;
+    section_start = bfill.position();
+    render();
+    section_capture_add(ether_buffer+section_start, bfill.position()-section_start);
+    section_capture = NULL;
+    if (!c->failed && between && (!cbor.active || cbor.state == CBOR_VALUE)) {
+      memcpy(c->gens, gens, sizeof(gens));
+      c->valid = true;
+    }
+  }
+  pthread_mutex_unlock(&sc->mutex);
+}
+
+static void render_json_stations()
 {
   server_json_stations_attrib(PSTR("masop"), ADDR_NVM_MAS_OP);
   server_json_stations_attrib(PSTR("ignore_rain"), ADDR_NVM_IGNRAIN);
@@ -275,18 +1136,18 @@ void server_json_stations_main()
   server_json_stations_attrib(PSTR("stn_spe"), ADDR_NVM_STNSPE);
 
   bfill.emit_p(PSTR("\"snames\":["));
-  byte sid;
+  uint16_t sid;
   for(sid=0;sid<os.nstations;sid++) {
     os.get_station_name(sid, tmp_buffer);
-    bfill.emit_p(PSTR("\"$S\""), tmp_buffer);
+    bfill.emit_p(PSTR("\"$J\""), tmp_buffer);
     if(sid!=os.nstations-1)
       bfill.emit_p(PSTR(","));
-    if (available_ether_buffer()<80) {
-      send_packet();
-    }
   }
   bfill.emit_p(PSTR("],\"maxlen\":$D}"), STATION_NAME_SIZE);
-  delay(1);
+}
+
+void server_json_stations_main() {
+  print_section(&stations_cache, 'n', render_json_stations);
 }
 
 /** Output stations data */
@@ -298,21 +1159,19 @@ byte server_json_stations(char *p) {
 
 /** Output station special attribute */
 byte server_json_station_special(char *p) {
-  byte sid;
+  uint16_t sid;
   byte comma=0;
-  int stepsize=sizeof(StationSpecialData);
-  StationSpecialData *stn = (StationSpecialData *)tmp_buffer;
+  SpecialStationEntry *stn;
   print_json_header();
   for(sid=0;sid<os.nstations;sid++) {
-    if(os.station_attrib_bits_read(ADDR_NVM_STNSPE+(sid>>3))&(1<<(sid&0x07))) {
-      read_from_file(stns_filename, (char*)stn, stepsize, sid*stepsize);
+    if(station_bit(os.attrib_spe, sid)) {
+      stn = os.special_stations+sid;
       if (comma) bfill.emit_p(PSTR(","));
       else {comma=1;}
-      bfill.emit_p(PSTR("\"$D\":{\"st\":$D,\"sd\":\"$S\"}"), sid, stn->type, stn->data);
+      bfill.emit_p(PSTR("\"$D\":{\"st\":$D,\"sd\":\"$J\"}"), sid, stn->type, stn->data);
     }
   }
   bfill.emit_p(PSTR("}"));
-  delay(1);
   return HTML_OK;
 }
 
@@ -320,8 +1179,8 @@ void server_change_stations_attrib(char *p, char header, int addr)
 {
   byte attrib[MAX_EXT_BOARDS+1];
   os.station_attrib_bits_load(addr, attrib);
-  char tbuf2[3] = {0, 0, 0};
-  byte bid;
+  char tbuf2[5] = {0, 0, 0, 0, 0};
+  uint16_t bid;
   tbuf2[0]=header;
   for(bid=0;bid<os.nboards;bid++) {
     itoa(bid, tbuf2+1, 10);
@@ -335,6 +1194,7 @@ void server_change_stations_attrib(char *p, char header, int addr)
 /**
  * Change Station Name and Attributes
  * Command: /cs?pw=xxx&s?=x&m?=x&i?=x&n?=x&d?=x
+ * (or POST /cs with the parameters in a form or json body)
  *
  * pw: password
  * s?: station name (? is station index, starting from 0)
@@ -347,8 +1207,8 @@ void server_change_stations_attrib(char *p, char header, int addr)
  */
 byte server_change_stations(char *p)
 {
-  byte sid;
-  char tbuf2[4] = {'s', 0, 0, 0};
+  uint16_t sid;
+  char tbuf2[6] = {'s', 0, 0, 0, 0, 0};
   // process station names
   for(sid=0;sid<os.nstations;sid++) {
     itoa(sid, tbuf2+1, 10);
@@ -397,6 +1257,7 @@ byte server_change_stations(char *p)
 	  }
 
       write_to_file(stns_filename, tmp_buffer, strlen(tmp_buffer)+1, stepsize*sid, false);
+      os.special_station_update(sid, (StationSpecialData *)tmp_buffer);
     } else {
       return HTML_DATA_MISSING;
     }
@@ -404,7 +1265,9 @@ byte server_change_stations(char *p)
   return HTML_SUCCESS;
 }
 
-/** Parse one number from a comma separate list */
+/** Parse one number from a comma separated list
+ * A list ends at its ']' (or the end of the string): p stays there, and
+ * the numbers read past the end are 0. */
 uint16_t parse_listdata(char **p) {
   char* pv;
   int i=0;
@@ -417,11 +1280,17 @@ uint16_t parse_listdata(char **p) {
       break;
   }
   tmp_buffer[i]=0;
-  *p = pv+1;
+  if (*pv==',') pv++;
+  *p = pv;
   return (uint16_t)atol(tmp_buffer);
 }
 
-void manual_start_program(byte, byte);
+/** Step over a bracket or comma of a list, if it is the next character */
+static void parse_listchar(char **p, char c) {
+  if (**p==c) (*p)++;
+}
+
+void manual_start_program(uint16_t, byte);
 /** Manual start program
  * Command: /mp?pw=xxx&pid=xxx&uwt=xxx
  *
@@ -455,43 +1324,32 @@ byte server_manual_program(char *p) {
 /**
  * Change run-once program
  * Command: /cr?pw=xxx&t=[x,x,x...]
+ * (or POST /cr with the parameters in a form or json body)
  *
  * pw: password
  * t:  station water time
  */
 byte server_change_runonce(char *p) {
-  // decode url first
-  urlDecode(p);
-  // search for the start of v=[
-  char *pv;
-  boolean found=false;
-  for(pv=p;(*pv)!=0 && pv<p+100;pv++) {
-    if(strncmp(pv, "t=[", 3)==0) {
-      found=true;
-      break;
-    }
-  }
-  if(!found)  return HTML_DATA_MISSING;
-  pv+=3;
+  char *pv = findKeyValInPlace(p, "t");
+  if(!pv || *pv!='[')  return HTML_DATA_MISSING;
+  pv++;
 
   // reset all stations and prepare to run one-time program
   reset_all_stations_immediate();
 
-  byte sid, bid, s;
+  uint16_t sid;
   uint16_t dur;
   boolean match_found = false;
   for(sid=0;sid<os.nstations;sid++) {
     dur=parse_listdata(&pv);
-    bid=sid>>3;
-    s=sid&0x07;
     // if non-zero duration is given
     // and if the station has not been disabled
-    if (dur>0 && !(os.station_attrib_bits_read(ADDR_NVM_STNDISABLE+bid)&(1<<s))) {
+    if (dur>0 && !station_bit(os.attrib_dis, sid)) {
       RuntimeQueueStruct *q = pd.enqueue();
       if (q) {
         q->st = 0;
         q->dur = water_time_resolve(dur);
-        q->pid = 254;
+        q->pid = QUEUE_PID_RUNONCE;
         q->sid = sid;
         match_found = true;
       }
@@ -551,6 +1409,7 @@ byte server_moveup_program(char *p) {
 /**
  * Change a program
  * Command: /cp?pw=xxx&pid=x&v=[flag,days0,days1,[start0,start1,start2,start3],[dur0,dur1,dur2..]]&name=x
+ * (or POST /cp with the parameters in a form or json body)
  *
  * pw:    password
  * pid:   program index
@@ -562,9 +1421,11 @@ byte server_moveup_program(char *p) {
 const char _str_program[] PROGMEM = "Program ";
 byte server_change_program(char *p) {
   printf("Attempting to change a program\n");
-  byte i;
+  uint16_t i;
 
   ProgramStruct prog;
+  byte durations[MAX_NUM_STATIONS];
+  prog.durations = durations;
 
   // parse program index
   if (!findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("pid"), true)) {
@@ -582,43 +1443,28 @@ byte server_change_program(char *p) {
     itoa((pid==-1)? (pd.nprograms+1): (pid+1), prog.name+8, 10);
   }
 
-  // do a full string decoding
-  urlDecode(p);
-
   // parse ad-hoc v=[...
-  // search for the start of v=[
-  char *pv;
-  boolean found=false;
-
-  for(pv=p;(*pv)!=0 && pv<p+100;pv++) {
-    if(strncmp(pv, "v=[", 3)==0) {
-      found=true;
-      break;
-    }
-  }
-
-  if(!found)  return HTML_DATA_MISSING;
-  pv+=3;
+  char *pv = findKeyValInPlace(p, "v");
+  if(!pv || *pv!='[')  return HTML_DATA_MISSING;
+  pv++;
   // parse headers
   *(char*)(&prog) = parse_listdata(&pv);
   prog.days[0]= parse_listdata(&pv);
   prog.days[1]= parse_listdata(&pv);
   // parse start times
-  pv++; // this should be a '['
+  parse_listchar(&pv, '[');
   for (i=0;i<MAX_NUM_STARTTIMES;i++) {
     prog.starttimes[i] = parse_listdata(&pv);
   }
-  pv++; // this should be a ','
-  pv++; // this should be a '['
+  parse_listchar(&pv, ']');
+  parse_listchar(&pv, ',');
+  // parse durations, the stations missing from the list get none
+  parse_listchar(&pv, '[');
   for (i=0;i<os.nstations;i++) {
     uint16_t pre = parse_listdata(&pv);
     prog.durations[i] = water_time_encode(pre);
   }
-  pv++; // this should be a ']'
-  pv++; // this should be a ']'
-  // parse program name
 
-  // i should be equal to os.nstations at this point
   for(;i<MAX_NUM_STATIONS;i++) {
     prog.durations[i] = 0;     // clear unused field
   }
@@ -652,6 +1498,8 @@ byte server_enable_program(char *p) {
   byte i;
 
   ProgramStruct prog;
+  byte durations[MAX_NUM_STATIONS];
+  prog.durations = durations;
 
   // parse program index
   if (!findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("pid"), true)) {
@@ -681,7 +1529,7 @@ byte server_enable_program(char *p) {
   return HTML_SUCCESS;
 }
 
-void server_json_options_main() {
+static void render_json_options() {
   byte oid;
   for(oid=0;oid<NUM_OPTIONS;oid++) {
     if (oid==OPTION_USE_NTP     || oid==OPTION_USE_DHCP    ||
@@ -705,7 +1553,10 @@ void server_json_options_main() {
   }
 
   bfill.emit_p(PSTR(",\"dexp\":$D,\"mexp\":$D,\"hwt\":$D}"), -1, MAX_EXT_BOARDS, os.hw_type);
-  delay(1);
+}
+
+void server_json_options_main() {
+  print_section(&options_cache, 'o', render_json_options);
 }
 
 /** Output Options */
@@ -715,11 +1566,14 @@ byte server_json_options(char *p) {
   return HTML_OK;
 }
 
-void server_json_programs_main() {
-  bfill.emit_p(PSTR("\"nprogs\":$D,\"nboards\":$D,\"mnp\":$D,\"mnst\":$D,\"pnsize\":$D,\"pd\":["),
-               pd.nprograms, os.nboards, MAX_NUMBER_PROGRAMS, MAX_NUM_STARTTIMES, PROGRAM_NAME_SIZE);
-  byte pid, i;
+static void render_json_programs() {
+  bfill.emit(PFMT("\"nprogs\":$D,\"nboards\":$D,\"mnp\":$D,\"mnst\":$D,\"pnsize\":$D,\"pd\":["),
+             pd.nprograms, os.nboards, MAX_NUMBER_PROGRAMS, MAX_NUM_STARTTIMES, PROGRAM_NAME_SIZE);
+  uint16_t pid;
+  uint16_t i;
   ProgramStruct prog;
+  byte durations[MAX_NUM_STATIONS];
+  prog.durations = durations;
   for(pid=0;pid<pd.nprograms;pid++) {
     pd.read(pid, &prog);
     if (prog.type == PROGRAM_TYPE_INTERVAL && prog.days[1] > 1) {
@@ -727,34 +1581,32 @@ void server_json_programs_main() {
     }
 
     byte bytedata = *(char*)(&prog);
-    bfill.emit_p(PSTR("[$D,$D,$D,["), bytedata, prog.days[0], prog.days[1]);
+    bfill.emit(PFMT("[$D,$D,$D,["), bytedata, prog.days[0], prog.days[1]);
     // start times data
     for (i=0;i<(MAX_NUM_STARTTIMES-1);i++) {
-      bfill.emit_p(PSTR("$D,"), prog.starttimes[i]);
+      bfill.emit(PFMT("$D,"), prog.starttimes[i]);
     }
-    bfill.emit_p(PSTR("$D],["), prog.starttimes[i]);  // this is the last element
+    bfill.emit(PFMT("$D],["), prog.starttimes[i]);  // this is the last element
     // station water time
     for (i=0; i<os.nstations-1; i++) {
-      bfill.emit_p(PSTR("$L,"),(unsigned long)water_time_decode(prog.durations[i]));
+      bfill.emit(PFMT("$L,"),(unsigned long)water_time_decode(prog.durations[i]));
     }
-    bfill.emit_p(PSTR("$L],\""),(unsigned long)water_time_decode(prog.durations[i])); // this is the last element
+    bfill.emit(PFMT("$L],\""),(unsigned long)water_time_decode(prog.durations[i])); // this is the last element
     // program name
     strncpy(tmp_buffer, prog.name, PROGRAM_NAME_SIZE);
     tmp_buffer[PROGRAM_NAME_SIZE] = 0;  // make sure the string ends
-    bfill.emit_p(PSTR("$S"), tmp_buffer);
+    bfill.emit(PFMT("$J"), tmp_buffer);
     if(pid!=pd.nprograms-1) {
-      bfill.emit_p(PSTR("\"],"));
+      bfill.emit(PFMT("\"],"));
     } else {
-      bfill.emit_p(PSTR("\"]"));
-    }
-    // push out a packet if available
-    // buffer size is getting small
-    if (available_ether_buffer() < 250) {
-      send_packet();
+      bfill.emit(PFMT("\"]"));
     }
   }
-  bfill.emit_p(PSTR("]}"));
-  delay(1);
+  bfill.emit(PFMT("]}"));
+}
+
+void server_json_programs_main() {
+  print_section(&programs_cache, 'p', render_json_programs);
 }
 
 /** Output program data */
@@ -771,14 +1623,37 @@ byte server_view_scripturl(char *p) {
   return HTML_OK;
 }
 
-extern ulong flow_count;
+/** Output station bits */
+static void print_station_bits() {
+  bfill.emit(PFMT("\"sbits\":["));
+  for(uint16_t bid=0;bid<os.nboards;bid++)
+    bfill.emit(PFMT("$D,"), board_bits(os.station_bits, bid));
+  bfill.emit(PFMT("0]"));
+}
+
+/** Output the program, remaining and start time of each station */
+static void print_station_queue(ulong curr_time) {
+  bfill.emit(PFMT("\"ps\":["));
+  for(uint16_t sid=0;sid<os.nstations;sid++) {
+    unsigned long rem = 0;
+    uint16_t qid = pd.station_qid[sid];
+    RuntimeQueueStruct *q = pd.queue + qid;
+    if (qid<RUNTIME_QUEUE_SIZE) {
+      rem = (curr_time >= q->st) ? (q->st+q->dur-curr_time) : q->dur;
+      if(rem>65535) rem = 0;
+    }
+    bfill.emit(PFMT("[$D,$L,$L]"), (qid<RUNTIME_QUEUE_SIZE)?pd.report_pid(q->pid):0, rem, (qid<RUNTIME_QUEUE_SIZE)?q->st:0);
+    if (sid<os.nstations-1) bfill.emit(PFMT(","));
+    else bfill.emit(PFMT("]"));
+  }
+}
+
 void server_json_controller_main() {
-  byte bid, sid;
   ulong curr_time = os.now_tz();
   //os.nvm_string_get(ADDR_NVM_LOCATION, tmp_buffer);
-  bfill.emit_p(PSTR("\"devt\":$L,\"nbrd\":$D,\"en\":$D,\"rd\":$D,\"rs\":$D,\"rdst\":$L,"
-                    "\"loc\":\"$E\",\"wtkey\":\"$E\",\"sunrise\":$D,\"sunset\":$D,\"eip\":$L,\"lwc\":$L,\"lswc\":$L,"
-                    "\"lrun\":[$D,$D,$D,$L],"),
+  bfill.emit(PFMT("\"devt\":$L,\"nbrd\":$D,\"en\":$D,\"rd\":$D,\"rs\":$D,\"rdst\":$L,"
+                  "\"loc\":\"$N\",\"wtkey\":\"$N\",\"sunrise\":$D,\"sunset\":$D,\"eip\":$L,\"lwc\":$L,\"lswc\":$L,"
+                  "\"lrun\":[$D,$D,$D,$L],"),
               curr_time,
               os.nboards,
               os.status.enabled,
@@ -793,43 +1668,22 @@ void server_json_controller_main() {
               os.checkwt_lasttime,
               os.checkwt_success_lasttime,
               pd.lastrun.station,
-              pd.lastrun.program,
+              pd.report_pid(pd.lastrun.program),
               pd.lastrun.duration,
               pd.lastrun.endtime);
 
   if(os.options[OPTION_SENSOR_TYPE]==SENSOR_TYPE_FLOW) {
-    bfill.emit_p(PSTR("\"flcrt\":$L,\"flwrt\":$D,"), os.flowcount_rt, FLOWCOUNT_RT_WINDOW);
+    bfill.emit(PFMT("\"flcrt\":$L,\"flwrt\":$D,"), os.flowcount_rt, FLOWCOUNT_RT_WINDOW);
   }
 
-  bfill.emit_p(PSTR("\"sbits\":["));
-  // print sbits
-  for(bid=0;bid<os.nboards;bid++)
-    bfill.emit_p(PSTR("$D,"), os.station_bits[bid]);
-  bfill.emit_p(PSTR("0],\"ps\":["));
-  // print ps
-  for(sid=0;sid<os.nstations;sid++) {
-    unsigned long rem = 0;
-    byte qid = pd.station_qid[sid];
-    RuntimeQueueStruct *q = pd.queue + qid;
-    if (qid<255) {
-      rem = (curr_time >= q->st) ? (q->st+q->dur-curr_time) : q->dur;
-      if(rem>65535) rem = 0;
-    }
-    bfill.emit_p(PSTR("[$D,$L,$L]"), (qid<255)?q->pid:0, rem, (qid<255)?q->st:0);
-    bfill.emit_p((sid<os.nstations-1)?PSTR(","):PSTR("]"));
-
-    // if available ether buffer is getting small
-    // send out a packet
-    if(available_ether_buffer() < 80) {
-      send_packet();
-    }
-  }
+  print_station_bits();
+  bfill.emit(PFMT(","));
+  print_station_queue(curr_time);
 
   if(read_from_file(wtopts_filename, tmp_buffer)) {
-    bfill.emit_p(PSTR(",\"wto\":{$S}"), tmp_buffer);
+    bfill.emit(PFMT(",\"wto\":{$S}"), tmp_buffer);
   }
-  bfill.emit_p(PSTR("}"));
-  delay(1);
+  bfill.emit(PFMT("}"));
 }
 
 /** Output controller variables in json */
@@ -1052,6 +1906,7 @@ byte server_change_options(char *p)
   }
 
   os.options_save();
+  pd.durations_resize(os.nstations);
 
   if(time_change) {
     os.status.req_ntpsync = 1;
@@ -1098,14 +1953,13 @@ byte server_change_password(char *p)
 
 void server_json_status_main() {
   bfill.emit_p(PSTR("\"sn\":["));
-  byte sid;
+  uint16_t sid;
 
   for (sid=0;sid<os.nstations;sid++) {
-    bfill.emit_p(PSTR("$D"), (os.station_bits[(sid>>3)]>>(sid&0x07))&1);
+    bfill.emit_p(PSTR("$D"), station_bit(os.station_bits, sid));
     if(sid!=os.nstations-1) bfill.emit_p(PSTR(","));
   }
   bfill.emit_p(PSTR("],\"nstations\":$D}"), os.nstations);
-  delay(1);
 }
 
 /** Output station status */
@@ -1152,25 +2006,21 @@ byte server_change_manual(char *p) {
       // schedule manual station
       // skip if the station is a master station
       // (because master cannot be scheduled independently)
-      byte bid = sid>>3;
-      byte s = sid&0x07;
       if ((os.status.mas==sid+1) || (os.status.mas2==sid+1))
         return HTML_NOT_PERMITTED;
 
-      RuntimeQueueStruct *q = NULL;
-      byte sqi = pd.station_qid[sid];
+      uint16_t sqi = pd.station_qid[sid];
       // check if the station already has a schedule
-      if (sqi!=0xFF) {  // if we, we will overwrite the schedule
-        q = pd.queue+sqi;
-      } else {  // otherwise create a new queue element
-        q = pd.enqueue();
+      if (sqi!=0xFFFF) {  // if we, we will replace the schedule
+        pd.dequeue(sqi);
       }
+      RuntimeQueueStruct *q = pd.enqueue();
       // if the queue is not full
       if (q) {
         q->st = 0;
         q->dur = timer;
         q->sid = sid;
-        q->pid = 99;  // testing stations are assigned program index 99
+        q->pid = QUEUE_PID_MANUAL;  // testing stations are reported as program index 99
         schedule_all_stations(curr_time);
       } else {
         return HTML_NOT_PERMITTED;
@@ -1273,16 +2123,10 @@ byte server_json_log(char *p) {
       if (comma)  bfill.emit_p(PSTR(","));
       else {comma=1;}
       bfill.emit_p(PSTR("$S"), tmp_buffer);
-      // if the available ether buffer size is getting small
-      // push out a packet
-      if (available_ether_buffer() < 80) {
-        send_packet();
-      }
     }
   }
 
   bfill.emit_p(PSTR("]"));
-  delay(1);
   return HTML_OK;
 }
 /**
@@ -1309,23 +2153,122 @@ byte server_json_all(char *p) {
   print_json_header();
   bfill.emit_p(PSTR("\"settings\":{"));
   server_json_controller_main();
-  send_packet();
   bfill.emit_p(PSTR(",\"programs\":{"));
   server_json_programs_main();
-  send_packet();
   bfill.emit_p(PSTR(",\"options\":{"));
   server_json_options_main();
-  send_packet();
   bfill.emit_p(PSTR(",\"status\":{"));
   server_json_status_main();
-  send_packet();
   bfill.emit_p(PSTR(",\"stations\":{"));
   server_json_stations_main();
   bfill.emit_p(PSTR("}"));
-  delay(1);
   return HTML_OK;
 }
 
+extern const char _url_keys[] PROGMEM;
+extern const byte num_urls;
+
+/** Output run-time statistics
+ * sched: main loop passes, and scheduler passes with the microseconds
+ * they ran past their deadline as [passes, mean, max], for all of them
+ * and for those that turned stations on or off
+ * http: per endpoint (the home page and unknown paths under ""),
+ * [responses, send calls, tcp segments, bytes]
+ */
+void server_json_stats_main() {
+  bfill.emit_p(PSTR("\"nvm\":{\"reads\":$L,\"writes\":$L,\"flushes\":$L,\"syscalls\":$L,\"gen\":$L},"),
+               __atomic_load_n(&nvm_stats.reads, __ATOMIC_RELAXED),  // counted by the workers too
+               nvm_stats.writes, nvm_stats.flushes, nvm_stats.syscalls, nvm_get_generation());
+  SchedulerStats *ss = &sched_stats;
+  bfill.emit_p(PSTR("\"sched\":{\"wakeups\":$L,\"late\":[$L,$L,$L],\"switch_late\":[$L,$L,$L]},\"http\":{"),
+               ss->wakeups, ss->runs, ss->runs ? ss->late_sum/ss->runs : 0, ss->late_max,
+               ss->switches, ss->switches ? ss->switch_late_sum/ss->switches : 0, ss->switch_late_max);
+  bool comma = false;
+  for(byte i=0;i<=num_urls && i<ETHER_STATS_TAGS;i++) {
+    EthernetStats st;
+    EthernetServer::get_stats(i, &st);
+    if (!st.responses) continue;
+    char key[3] = {0};
+    if (i) {
+      key[0] = pgm_read_byte(_url_keys+2*(i-1));
+      key[1] = pgm_read_byte(_url_keys+2*(i-1)+1);
+    }
+    bfill.emit_p(PSTR("$F\"$S\":[$L,$L,$L,$L]"), comma ? PSTR(",") : PSTR(""), key,
+                 st.responses, st.syscalls, st.segments, st.bytes);
+    comma = true;
+  }
+  bfill.emit_p(PSTR("}}"));
+}
+
+/**
+ * Get run-time statistics
+ * Command: /jt?pw=xxx
+ */
+byte server_json_stats(char *p) {
+  print_json_header();
+  server_json_stats_main();
+  return HTML_OK;
+}
+
+/** Output one event with the controller state selected by events
+ * (EVENT_* bits). The keys are those of /jc, so clients can merge
+ * events into the controller variables they have */
+static void server_json_event(byte events) {
+  ulong curr_time = os.now_tz();
+  bfill.emit_p(PSTR("data: {\"devt\":$L"), curr_time);
+  if (events & EVENT_STATUS) {
+    bfill.emit_p(PSTR(",\"en\":$D,\"rd\":$D,\"rs\":$D,\"rdst\":$L"),
+                 os.status.enabled, os.status.rain_delayed, os.status.rain_sensed, os.nvdata.rd_stop_time);
+  }
+  if (events & EVENT_STATIONS) {
+    bfill.emit_p(PSTR(","));
+    print_station_bits();
+  }
+  if (events & EVENT_QUEUE) {
+    bfill.emit_p(PSTR(",\"lrun\":[$D,$D,$D,$L],"),
+                 pd.lastrun.station, pd.report_pid(pd.lastrun.program), pd.lastrun.duration, pd.lastrun.endtime);
+    print_station_queue(curr_time);
+  }
+  if (events & EVENT_WEATHER) {
+    bfill.emit_p(PSTR(",\"sunrise\":$D,\"sunset\":$D,\"eip\":$L,\"lwc\":$L,\"lswc\":$L,\"wl\":$D"),
+                 os.nvdata.sunrise_time, os.nvdata.sunset_time, os.nvdata.external_ip,
+                 os.checkwt_lasttime, os.checkwt_success_lasttime, os.options[OPTION_WATER_PERCENTAGE]);
+  }
+  bfill.emit_p(PSTR("}\n\n"));
+}
+
+/**
+ * Stream controller state changes (server-sent events)
+ * Command: /ev?pw=xxx
+ *
+ * The connection stays open. The first event holds the complete state,
+ * the following ones only what has changed, once per main loop pass.
+ * Runs in the main loop, so no change falls in between the first event
+ * and the broadcasts.
+ */
+byte server_event_stream(char *p) {
+  if (!m_client->stream()) return HTML_NOT_PERMITTED;
+  m_client->write_static(html200OK, sizeof(html200OK)-1);
+  m_client->write_static(htmlContentEvents, sizeof(htmlContentEvents)-1);
+  m_client->write_static(htmlRevalidate, sizeof(htmlRevalidate)-1);
+  m_client->write_static(htmlAccessControl, sizeof(htmlAccessControl)-1);
+  m_client->end_headers();
+  server_json_event(EVENT_ALL);
+  return HTML_OK;
+}
+
+/** Broadcast the controller state that changed since the last call
+ * to the event streams. Called by the main loop with the state lock held */
+void server_push_events() {
+  byte events = os.events;
+  if (!events) return;
+  os.events = 0;
+  if (!EthernetServer::streams()) return;
+  rewind_ether_buffer();
+  server_json_event(events);
+  flush_packet();
+}
+
 typedef byte (*URLHandler)(char*);
 /*struct URLStruct{
   PGM_P PROGMEM url;
@@ -1361,7 +2304,12 @@ const char _url_keys[] PROGMEM =
   "dl"
   "su"
   "cu"
-  "ja";
+  "ja"
+  "jt"
+  "ev"
+  "cb";
+
+byte server_change_batch(char *p);
 
 // Server function handlers
 URLHandler urls[] = {
@@ -1386,20 +2334,191 @@ URLHandler urls[] = {
   server_delete_log,      // dl
   server_view_scripturl,  // su
   server_change_scripturl,// cu
-  server_json_all         // ja
+  server_json_all,        // ja
+  server_json_stats,      // jt
+  server_event_stream,    // ev
+  server_change_batch     // cb
+};
+const byte num_urls = sizeof(urls)/sizeof(URLHandler);
+
+/** Copy of a file changed by a batch, to put back if the batch fails */
+struct BatchFile {
+  const char *name;
+  bool saved;
+  char *data;   // NULL if the file did not exist
+  long size;
 };
 
+/** Copy a file before a batch changes it
+ * Returns false if the copy can't be made: the command must not run,
+ * since its change could not be undone.
+ */
+static bool batch_file_save(BatchFile *f) {
+  if (f->saved) return true;
+  f->data = NULL;
+  f->size = 0;
+  FILE *file = fopen(get_filename_fullpath(f->name), "rb");
+  if (file) {
+    fseek(file, 0, SEEK_END);
+    f->size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (f->size >= 0) f->data = (char*) malloc(f->size+1);
+    bool ok = f->data && fread(f->data, 1, f->size, file) == (size_t)f->size;
+    fclose(file);
+    if (!ok) {
+      free(f->data);
+      f->data = NULL;
+      return false;
+    }
+  }
+  f->saved = true;
+  return true;
+}
+
+static void batch_file_restore(BatchFile *f) {
+  if (!f->saved) return;
+  if (f->data) write_to_file(f->name, f->data, f->size);
+  else remove_file(f->name);
+}
+
+/**
+ * Change a batch of programs, stations and options
+ * Command: POST /cb?pw=xxx, with one command per line in the body:
+ *   cp?pid=-1&v=[...]&name=x
+ *   cs?s0=x&d0=x
+ *   co?o1=x
+ *
+ * pw: password
+ * The commands cp, dp, up, ep, cs and co run in order, as they would
+ * as separate requests. If all succeed, their changes are saved together;
+ * otherwise none of them takes effect. "ops" lists the result of each.
+ */
+#define BATCH_MAX_OPS  256
+static const char batch_commands[] PROGMEM = "cpdpupepcsco";
+
+byte server_change_batch(char *p)
+{
+  char *line = request_body(p);
+  if (!line || !*line) return HTML_DATA_MISSING;
+
+  byte results[BATCH_MAX_OPS];
+  int nops = 0;
+  byte ret = HTML_SUCCESS;
+  BatchFile stns = {stns_filename, false}, wtopts = {wtopts_filename, false};
+  NVMSavepoint savepoint;
+
+  nvm_begin();
+  nvm_savepoint(&savepoint);
+  pd.batch_begin();
+  while (*line) {
+    char *next = strchr(line, '\n');
+    if (next) *next++ = 0;
+    else next = line+strlen(line);
+    char *cr = strchr(line, '\r');
+    if (cr) *cr = 0;
+    if (*line == '/') line++;
+    if (!*line) {
+      line = next;
+      continue;
+    }
+
+    if (nops == BATCH_MAX_OPS) {
+      ret = HTML_DATA_OUTOFBOUND;
+      break;
+    }
+    byte r = HTML_PAGE_NOT_FOUND;
+    const char *com;
+    for (com = batch_commands; *com; com += 2) {
+      if (com[0]==line[0] && com[1]==line[1] && (line[2]=='?' || !line[2])) break;
+    }
+    if (*com) {
+      byte i;
+      for (i=0; i<num_urls; i++) {
+        if (pgm_read_byte(_url_keys+2*i)==com[0] && pgm_read_byte(_url_keys+2*i+1)==com[1]) break;
+      }
+      // special station data and weather options are kept in files
+      BatchFile *f = (com[0]=='c' && com[1]=='s') ? &stns : (com[0]=='c' && com[1]=='o') ? &wtopts : NULL;
+      if (f && !batch_file_save(f)) {
+        r = HTML_DATA_OUTOFBOUND;
+      } else {
+        char *dat = line + (line[2] ? 3 : 2);
+        query_index(dat);
+        r = urls[i](dat);
+        query_reset();
+      }
+    }
+    results[nops++] = r;
+    if (r != HTML_SUCCESS && ret == HTML_SUCCESS) ret = r;
+    line = next;
+  }
+
+  if (ret == HTML_SUCCESS) {
+    pd.batch_commit();
+  } else {
+    // put back everything the commands changed
+    pd.batch_rollback();
+    nvm_rollback(&savepoint);
+    batch_file_restore(&wtopts);
+    batch_file_restore(&stns);
+    os.options_load();
+    os.attribs_load();
+    if (stns.saved) os.special_stations_load();
+    os.options_gen++;
+    os.stations_gen++;
+  }
+  nvm_commit();
+  free(stns.data);
+  free(wtopts.data);
+
+  print_json_header();
+  bfill.emit_p(PSTR("\"result\":$D,\"ops\":["), ret);
+  for (int k=0; k<nops; k++) {
+    bfill.emit_p((k<nops-1) ? PSTR("$D,") : PSTR("$D"), results[k]);
+  }
+  bfill.emit_p(PSTR("]}"));
+  return HTML_OK;
+}
+
+
 // handle Ethernet request
+/** Run the handler of an endpoint, or answer 304 if the client has its current data */
+static byte serve_handler(byte i, const char *com, char *dat, const char *req) {
+  if (strncmp(req, "GET ", 4)==0 && make_etag(com, etag_buf)) {
+    if (etag_match(req, etag_buf)) {
+      response_etag = etag_buf;
+      print_not_modified();
+      response_etag = NULL;
+      return HTML_OK;
+    }
+    response_etag = etag_buf;
+  }
+  byte ret = (urls[i])(dat);
+  response_etag = NULL;
+  return ret;
+}
+
+/** Requests that only read controller state: the home page and the json endpoints */
+static bool request_is_readonly(const char *p)
+{
+  if (strncmp(p, "GET ", 4)) return false;
+  const char *com = p+5;
+  return com[0]==' ' || com[0]=='j';
+}
+
 void handle_web_request(char *p)
 {
+  cbor.active = false;
   rewind_ether_buffer();
+  bool readonly = request_is_readonly(p);
+  response_cbor = false;
 
-  // assume this is a GET request
-  // GET /xx?xxxx
-  char *com = p+5;
+  // GET /xx?xxxx, or POST /xx?xxxx with more parameters in the body
+  bool post = (strncmp(p, "POST ", 5)==0);
+  char *com = p + (post ? 6 : 5);
   char *dat = com+3;
 
   if(com[0]==' ') {
+    m_client->set_tag(0);
     server_home();  // home page handler
     send_packet(true);
   } else {
@@ -1408,11 +2527,23 @@ void handle_web_request(char *p)
     for(i=0;i<sizeof(urls)/sizeof(URLHandler);i++) {
       if(pgm_read_byte(_url_keys+2*i)==com[0]
        &&pgm_read_byte(_url_keys+2*i+1)==com[1]) {
+        m_client->set_tag(i+1);  // statistics slot of the endpoint
 
         // check password
         byte ret = HTML_UNAUTHORIZED;
 
-        if (com[0]=='s' && com[1]=='u') { // for /su do not require password
+        // nvm changes made by a handler are committed together
+        // (read-only handlers may run on several threads at once)
+        if (!readonly) nvm_begin();
+        response_cbor = (com[0]=='j') && request_prefers_cbor(p);
+
+        // index the query parameters once for all lookups
+        query_index(dat);
+        if (post) query_index_body(p);
+
+        if (query_full) {
+          ret = HTML_DATA_OUTOFBOUND;  // too many parameters to see them all
+        } else if (com[0]=='s' && com[1]=='u') { // for /su do not require password
           ret = (urls[i])(dat);
         } else if ((com[0]=='j' && com[1]=='o') ||
                    (com[0]=='j' && com[1]=='a'))  { // for /jo and /ja we output fwv if password fails
@@ -1422,16 +2553,18 @@ void handle_web_request(char *p)
                    op_json_names+0, os.options[0]);
             ret = HTML_OK;
           } else {
-            ret = (urls[i])(dat);
+            ret = serve_handler(i, com, dat, p);
           }
         } else {
           // first check password
           if(check_password(dat)==false) {
             ret = HTML_UNAUTHORIZED;
           } else {
-            ret = (urls[i])(dat);
+            ret = serve_handler(i, com, dat, p);
           }
         }
+        if (!readonly) nvm_commit();
+        query_reset();
         switch(ret) {
         case HTML_OK:
           break;
@@ -1455,4 +2588,175 @@ void handle_web_request(char *p)
     send_packet(true);
   }
   //delay(50); // add a bit of delay here
-}
\ No newline at end of file
+}
+
+/** ====== HTTP worker pool ======
+ * Read-only requests are served by worker threads, holding the state lock
+ * for reading. Requests that change state are passed back to the main loop
+ * through a lock-free command queue, and run there with the state lock
+ * held for writing, in between scheduler ticks.
+ */
+
+// writers are preferred, so polling clients cannot hold up the scheduler
+static pthread_rwlock_t state_rwlock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+
+static pthread_mutex_t job_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static EthernetConnection *jobs[ETHER_MAX_CONNECTIONS]; // connections waiting for a worker
+static byte job_head = 0, job_count = 0;
+static byte nworkers = 0;
+
+/** Request passed from a worker to the main loop */
+struct ServerCommand {
+  ServerCommand *next;
+  EthernetConnection *conn;
+  int len;
+  char *request;
+};
+
+// multi-producer single-consumer queue (Dmitry Vyukov's intrusive design):
+// workers push at the head, the main loop pops at the tail
+static ServerCommand cmd_stub = {NULL, NULL, 0, NULL};
+static ServerCommand *cmd_head = &cmd_stub;
+static ServerCommand *cmd_tail = &cmd_stub;
+
+static void command_push(ServerCommand *cmd) {
+  cmd->next = NULL;
+  ServerCommand *prev = __atomic_exchange_n(&cmd_head, cmd, __ATOMIC_ACQ_REL);
+  __atomic_store_n(&prev->next, cmd, __ATOMIC_RELEASE);
+}
+
+/** Pop the oldest command, or NULL if there is none (or a push is half done;
+ * its producer wakes the main loop once it completes) */
+static ServerCommand* command_pop() {
+  ServerCommand *tail = cmd_tail;
+  ServerCommand *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  if (tail == &cmd_stub) {
+    if (!next) return NULL;
+    cmd_tail = tail = next;
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  }
+  if (next) {
+    cmd_tail = next;
+    return tail;
+  }
+  if (tail != __atomic_load_n(&cmd_head, __ATOMIC_ACQUIRE)) return NULL;
+  command_push(&cmd_stub);
+  next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  if (next) {
+    cmd_tail = next;
+    return tail;
+  }
+  return NULL;
+}
+
+// requests are received here rather than in ether_buffer, which the response
+// is written to: a full /cs at MAX_NUM_STATIONS is many times its size
+static thread_local char *request_buffer = NULL;
+
+/** The calling thread's request buffer, of ETHER_REQUEST_SIZE bytes */
+static char *get_request_buffer() {
+  if (!request_buffer) request_buffer = (char*) malloc(ETHER_REQUEST_SIZE);
+  return request_buffer;
+}
+
+/** Serve one request in the calling thread */
+static void serve_request(EthernetClient *client, char *req, int len) {
+  m_client = client;
+  req[len] = 0;  // put a zero at the end of the packet
+  handle_web_request(req);
+  m_client = 0;
+}
+
+static void *server_worker(void *arg) {
+  while(true) {
+    pthread_mutex_lock(&job_mutex);
+    while(!job_count) pthread_cond_wait(&job_cond, &job_mutex);
+    EthernetConnection *conn = jobs[job_head];
+    job_head = (job_head+1) % ETHER_MAX_CONNECTIONS;
+    job_count--;
+    pthread_mutex_unlock(&job_mutex);
+
+    EthernetClient client(conn);
+    char *req = get_request_buffer();
+    if (!req) continue;
+    int len = client.read((uint8_t*) req, ETHER_REQUEST_SIZE-1);
+    if (len <= 0) continue;
+    if (request_is_readonly(req)) {
+      pthread_rwlock_rdlock(&state_rwlock);
+      serve_request(&client, req, len);
+      pthread_rwlock_unlock(&state_rwlock);
+    } else {
+      ServerCommand *cmd = (ServerCommand*) malloc(sizeof(ServerCommand)+len+1);
+      if (!cmd) continue;
+      cmd->request = (char*) (cmd+1);
+      memcpy(cmd->request, req, len);
+      cmd->len = len;
+      cmd->conn = client.release();
+      command_push(cmd);
+      m_server->wake();
+    }
+  }
+  return NULL;
+}
+
+/** Start the http worker threads, 0 serves all requests in the main loop */
+void server_start_workers(int n) {
+  server_start_time = now();
+  if (n > HTTP_MAX_WORKERS) n = HTTP_MAX_WORKERS;
+  // termination signals are left to the main loop
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  for(nworkers=0; nworkers<n; nworkers++) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, server_worker, NULL)) {
+      DEBUG_PRINTLN("can't start http worker");
+      break;
+    }
+    pthread_detach(tid);
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/** Pass a request returned by EthernetServer::available() on to be served
+ * Returns true if it was served right away, by the main loop */
+bool server_dispatch(EthernetClient &client) {
+  if (!nworkers) {
+    char *req = get_request_buffer();
+    int len = req ? client.read((uint8_t*) req, ETHER_REQUEST_SIZE-1) : 0;
+    if (len > 0) serve_request(&client, req, len);
+    return true;
+  }
+  pthread_mutex_lock(&job_mutex);
+  if (job_count < ETHER_MAX_CONNECTIONS) {
+    jobs[(job_head+job_count) % ETHER_MAX_CONNECTIONS] = client.release();
+    job_count++;
+    pthread_cond_signal(&job_cond);
+  }
+  pthread_mutex_unlock(&job_mutex);
+  return false;
+}
+
+/** Run the state changing requests queued by the workers
+ * Must be called with the state lock held. Returns true if there were any */
+bool server_run_commands() {
+  ServerCommand *cmd;
+  bool ran = false;
+  while((cmd = command_pop())) {
+    EthernetClient client(cmd->conn);
+    serve_request(&client, cmd->request, cmd->len);
+    free(cmd);
+    ran = true;
+  }
+  return ran;
+}
+
+/** Lock the controller state against the http workers */
+void state_lock() {
+  pthread_rwlock_wrlock(&state_rwlock);
+}
+
+void state_unlock() {
+  pthread_rwlock_unlock(&state_rwlock);
+}
@@ -24,19 +24,117 @@
 #ifndef _SERVER_H
 #define _SERVER_H
 
+/** Formatted output into a buffer of fixed size
+ * emit_p never writes past the end of the buffer: when the next piece
+ * does not fit, the flush function is called to send what is there and
+ * rewind, or, without one, the output is cut off. The output is always
+ * zero terminated, and its length is the position.
+ * With cbor set, the json the formats describe is written in CBOR instead
+ * (see server.cpp); the output is binary then.
+ * emit does what emit_p does, with a PFMT format that is split into its
+ * literal pieces and directives at compile time, for the hot json paths.
+ * The pieces are inlined even in unoptimized builds (build.sh makes those).
+ */
+
+/** A format for BufferFiller::emit, readable at compile time */
+#define PFMT(s) ([] { return s; })
+
 class BufferFiller {
     char *start; //!< Pointer to start of buffer
     char *ptr; //!< Pointer to cursor position
+    char *end; //!< Last byte of the buffer, kept for the terminating zero
+    void (*flush) (); //!< Sends the output and rewinds the buffer, may be NULL
+    bool cbor; //!< Write CBOR rather than json
+    void put_ulong (unsigned long v, bool neg);
+    void put_json (const char *s);
+    void put_nvm (const byte *addr, bool json);
+    bool room (size_t len);
+    bool put_pieces (const char *s, size_t len);
+
+    /** Where the literal text of a format that starts at pos ends */
+    static constexpr size_t fmt_literal_end (const char *f, size_t pos) {
+        while (f[pos] && f[pos] != '$') pos++;
+        return pos;
+    }
+
+    static constexpr bool fmt_takes_arg (char c) {
+        return c == 'D' || c == 'L' || c == 'S' || c == 'F' || c == 'E' || c == 'J' || c == 'N';
+    }
+
+    /** The format from pos on: its literal text, then the next directive */
+    template <size_t pos, class F, class... Args>
+    __attribute__((always_inline)) void emit_from (F fmt, Args... args) {
+        constexpr const char *f = fmt ();
+        constexpr size_t lit = fmt_literal_end (f, pos);
+        if constexpr (lit > pos) put (f + pos, lit - pos);
+        if constexpr (f[lit] == '$' && f[lit+1] != 0) {
+            if constexpr (fmt_takes_arg (f[lit+1])) {
+                emit_arg<f[lit+1], lit+2> (fmt, args...);
+            } else {
+                put (f + lit + 1, 1);
+                emit_from<lit+2> (fmt, args...);
+            }
+        } else {
+            static_assert (sizeof... (args) == 0, "more arguments than the format takes");
+        }
+    }
+
+    /** Directive c with its argument, then the format from next on */
+    template <char c, size_t next, class F, class A, class... Args>
+    __attribute__((always_inline)) void emit_arg (F fmt, A a, Args... args) {
+        if constexpr (c == 'D') {
+            long v = (int) a;
+            put_ulong ((v < 0) ? (unsigned long)-v : (unsigned long)v, v < 0);
+        } else if constexpr (c == 'L') {
+            put_ulong ((unsigned long) a, false);
+        } else if constexpr (c == 'S' || c == 'F') {
+            const char *s = a;
+            put (s, strlen (s));
+        } else if constexpr (c == 'J') {
+            put_json (a);
+        } else {
+            put_nvm ((const byte *) a, c == 'N');
+        }
+        emit_from<next> (fmt, args...);
+    }
+
+    template <char c, size_t next, class F>
+    void emit_arg (F fmt) {
+        static_assert (c == 0, "the format takes more arguments");
+    }
 public:
-    BufferFiller () {}
+    BufferFiller () : start (NULL), ptr (NULL), end (NULL), flush (NULL), cbor (false) {}
 
-    BufferFiller (char *buf) : start (buf), ptr (buf) {}
+    BufferFiller (char *buf, size_t size, void (*flush_fn) () = NULL, bool cbor_out = false)
+        : start (buf), ptr (buf), end (buf + size - 1), flush (flush_fn), cbor (cbor_out) {}
 
     void emit_p (const char *fmt, ...);
 
+    template <class F, class... Args>
+    void emit (F fmt, Args... args) {
+        if (cbor) {
+            emit_p (fmt (), args...);
+            return;
+        }
+        emit_from<0> (fmt, args...);
+        if (ptr) *ptr = 0;
+    }
+
+    /** Copy len bytes, in pieces if the buffer fills up. False if the output is cut off */
+    __attribute__((always_inline)) bool put (const char *s, size_t len) {
+        if ((size_t)(end - ptr) < len) return put_pieces (s, len);
+        memcpy (ptr, s, len);
+        ptr += len;
+        return true;
+    }
+
+    void set_cbor (bool on) { cbor = on; }
+
     char* buffer () const { return start; }
 
     unsigned int position () const { return ptr - start; }
+
+    unsigned int available () const { return end - ptr; }
 };
 
 #endif // _SERVER_H
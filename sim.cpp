@@ -0,0 +1,497 @@
+/* OpenHome Firmware
+ * Copyright (C) 2015 by Charles Remeikas
+ *
+ * Simulation functions
+ *
+ * This file is part of the OpenHome library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "etherport.h"
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <algorithm>
+#include <vector>
+#include "OpenHome.h"
+#include "utils.h"
+#include "sim.h"
+
+extern thread_local EthernetClient *m_client;
+extern OpenHome os;
+void handle_web_request(char *p);
+
+/** Simulation of the controller (-S script)
+ * The main loop runs against a virtual clock, which each pass moves
+ * straight to the next scheduler event or scripted request, so that a
+ * season of schedules replays in seconds. There is no network: requests
+ * and weather service responses come from the script. Station switches
+ * and the responses to the requests are recorded, logs are written as
+ * usual. The record only depends on the script and the data files, the
+ * time taken goes to stderr.
+ *
+ * Script lines (# starts a comment):
+ *   start 2024-04-01 06:00      start, utc date [time] or unix time
+ *   end 365d                    end, after the start
+ *   <offset> GET /path?query    a request
+ *   <offset> POST /path?query body
+ *                               (\n in the body for a line break)
+ *   <offset> send GET /jc HTTP/1.1\r\n\r\nGET /jo ...
+ *                               bytes sent on a connection to the http
+ *                               server, with \r, \n and \\ escapes; the
+ *                               responses are recorded with their headers
+ *   <offset> weather &scale=80&sunrise=360
+ *                               weather service response from then on,
+ *                               'none' for no response
+ * Offsets are from the start, in seconds or with units, e.g. 90s, 10m, 1d6h.
+ */
+
+#define SIM_DEFAULT_START 1704067200L   // 2024-01-01 00:00 utc
+#define SIM_DEFAULT_END   86400L        // a day after the last scripted line
+
+struct SimEvent {
+  time_t t;
+  char *line;   // the request or weather command
+};
+
+/** Response to a scripted request, read from the other end of its socket */
+struct SimCapture {
+  int fd;
+  char *buf;
+  size_t len;
+  size_t size;
+  bool done;    // the other end closed
+};
+
+static bool sim = false;
+static bool sim_finished = false;
+static FILE *sim_out = NULL;
+static std::vector<SimEvent> sim_events;
+static size_t sim_next = 0;
+static time_t sim_start, sim_stop;
+static const char *sim_weather_resp = NULL;
+static uint64_t sim_bits[STATION_WORDS];  // station bits as last recorded
+static ulong sim_passes = 0, sim_switches = 0, sim_requests = 0;
+static struct timespec sim_wall;
+
+/** Parse an offset such as 90, 10m or 1d6h into seconds */
+static bool parse_offset(const char *s, time_t *t) {
+  time_t total = 0;
+  if (!*s) return false;
+  while (*s) {
+    if (!isdigit(*s)) return false;
+    char *e;
+    long v = strtol(s, &e, 10);
+    switch (*e) {
+    case 'w': v *= 7*86400L; e++; break;
+    case 'd': v *= 86400L; e++; break;
+    case 'h': v *= 3600; e++; break;
+    case 'm': v *= 60; e++; break;
+    case 's': e++; break;
+    case 0: break;
+    default: return false;
+    }
+    total += v;
+    s = e;
+  }
+  *t = total;
+  return true;
+}
+
+/** Parse a utc date and time (YYYY-MM-DD [HH:MM[:SS]]) or unix time */
+static bool parse_time(const char *s, time_t *t) {
+  char *e;
+  long long v = strtoll(s, &e, 10);
+  if (e != s && *e == 0) {
+    *t = v;
+    return true;
+  }
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  int n = sscanf(s, "%d-%d-%d %d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+                 &tm.tm_hour, &tm.tm_min, &tm.tm_sec);
+  if (n < 3 || n == 4) return false;
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+  *t = timegm(&tm);
+  return true;
+}
+
+static bool sim_event_before(const SimEvent &a, const SimEvent &b) {
+  return a.t < b.t;
+}
+
+static bool sim_parse(const char *script) {
+  FILE *fp = fopen(script, "r");
+  if (!fp) {
+    fprintf(stderr, "can't open %s\n", script);
+    return false;
+  }
+  char *buf = NULL;
+  size_t bufsize = 0;
+  int lineno = 0;
+  time_t end = -1;
+  bool ok = true;
+  sim_start = SIM_DEFAULT_START;
+  while (ok && getline(&buf, &bufsize, fp) >= 0) {
+    lineno++;
+    char *p = buf;
+    while (isspace(*p)) p++;
+    char *e = p + strlen(p);
+    while (e > p && isspace(e[-1])) *--e = 0;
+    if (!*p || *p == '#') continue;
+
+    char *arg = p;
+    while (*arg && !isspace(*arg)) arg++;
+    if (*arg) *arg++ = 0;
+    while (isspace(*arg)) arg++;
+
+    SimEvent ev;
+    if (!strcmp(p, "start")) {
+      ok = parse_time(arg, &sim_start);
+    } else if (!strcmp(p, "end")) {
+      ok = parse_offset(arg, &end);
+    } else if (!parse_offset(p, &ev.t)) {
+      ok = false;
+    } else if (!strncmp(arg, "GET /", 5) || !strncmp(arg, "POST /", 6) ||
+               (!strncmp(arg, "send ", 5) && arg[5]) ||
+               (!strncmp(arg, "weather ", 8) && arg[8])) {
+      ev.line = strdup(arg);
+      sim_events.push_back(ev);
+    } else {
+      ok = false;
+    }
+    if (!ok) fprintf(stderr, "%s:%d: can't parse '%s'\n", script, lineno, p);
+  }
+  free(buf);
+  fclose(fp);
+  if (!ok) return false;
+
+  // lines run in time order, the ones at the same time in script order
+  std::stable_sort(sim_events.begin(), sim_events.end(), sim_event_before);
+  if (end < 0) end = (sim_events.empty() ? 0 : sim_events.back().t) + SIM_DEFAULT_END;
+  for (size_t i=0; i<sim_events.size(); i++) sim_events[i].t += sim_start;
+  sim_stop = sim_start + end;
+  return true;
+}
+
+/** Start the simulation of a script, recording to the file out (stdout if NULL)
+ * The data files are the ones in the current directory. */
+bool sim_begin(const char *script, const char *out) {
+  if (!sim_parse(script)) return false;
+  sim_out = out ? fopen(out, "w") : stdout;
+  if (!sim_out) {
+    fprintf(stderr, "can't write %s\n", out);
+    return false;
+  }
+  set_runtime_path("./");
+  clock_set(sim_start);
+  clock_gettime(CLOCK_MONOTONIC, &sim_wall);
+  sim = true;
+  return true;
+}
+
+bool sim_active() {
+  return sim;
+}
+
+bool sim_done() {
+  return sim_finished;
+}
+
+/** Start a record line with the local time */
+static void sim_print_time() {
+  time_t t = now() + os.tz_offset();
+  struct tm tm;
+  gmtime_r(&t, &tm);
+  fprintf(sim_out, "%04d-%02d-%02d %02d:%02d:%02d ", tm.tm_year+1900, tm.tm_mon+1,
+          tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+/** Record the stations switched since the last call */
+static void sim_record_bits() {
+  for (uint16_t w=0; w<STATION_WORDS; w++) {
+    uint64_t diff = os.station_bits[w] ^ sim_bits[w];
+    while (diff) {
+      uint16_t sid = (w<<6) + __builtin_ctzll(diff);
+      diff &= diff-1;
+      sim_print_time();
+      fprintf(sim_out, "station %d %s\n", sid+1, station_bit(os.station_bits, sid) ? "on" : "off");
+      sim_switches++;
+    }
+    sim_bits[w] = os.station_bits[w];
+  }
+}
+
+static void *sim_drain(void *arg) {
+  SimCapture *cap = (SimCapture *)arg;
+  while (true) {
+    if (cap->len + 4096 > cap->size) {
+      cap->size = cap->size*2 + 4096;
+      cap->buf = (char *)realloc(cap->buf, cap->size);
+    }
+    ssize_t n = ::read(cap->fd, cap->buf + cap->len, cap->size - cap->len - 1);
+    if (n <= 0) break;
+    cap->len += n;
+  }
+  cap->buf[cap->len] = 0;
+  __atomic_store_n(&cap->done, true, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+/** Start reading what comes back on fd, in another thread, so that
+ * responses can be of any size */
+static bool sim_capture(SimCapture *cap, int fd, pthread_t *tid) {
+  memset(cap, 0, sizeof(*cap));
+  cap->fd = fd;
+  if (pthread_create(tid, NULL, sim_drain, cap)) {
+    DEBUG_PRINTLN("can't start response reader");
+    return false;
+  }
+  return true;
+}
+
+/** Buffer for a scripted request, the same size as for requests over http */
+static char *sim_request_buffer() {
+  static char *req = NULL;
+  if (!req && !(req = (char*) malloc(ETHER_REQUEST_SIZE)))
+    DEBUG_PRINTLN("can't allocate request buffer");
+  return req;
+}
+
+/** Copy s to out, with the escapes \r, \n and \\ replaced; returns the
+ * length (out has room for size bytes and ends up zero terminated; with
+ * out NULL the length is only counted) */
+static int sim_unescape(const char *s, char *out, int size) {
+  int len = 0;
+  for (; *s && (!out || len < size-1); s++, len++) {
+    char c = *s;
+    if (c == '\\' && (s[1] == 'r' || s[1] == 'n' || s[1] == '\\')) {
+      s++;
+      c = (*s == 'r') ? '\r' : (*s == 'n') ? '\n' : '\\';
+    }
+    if (out) out[len] = c;
+  }
+  if (out) out[len] = 0;
+  return len;
+}
+
+/** Serve a scripted request as if it came from a client, and record the response */
+static void sim_request(const char *cmd) {
+  char *req = sim_request_buffer();
+  if (!req) return;
+  int len;
+  if (!strncmp(cmd, "POST ", 5)) {
+    const char *path = cmd+5;
+    const char *body = strchr(path, ' ');
+    int plen = body ? body-path : strlen(path);
+    body = body ? body+1 : "";
+    int blen = sim_unescape(body, NULL, 0);
+    len = snprintf(req, ETHER_REQUEST_SIZE,
+                   "%.*s HTTP/1.1\r\nContent-Type: %s\r\nContent-Length: %d\r\n\r\n",
+                   plen+5, cmd, (*body=='{' || *body=='[') ? "application/json" : "application/x-www-form-urlencoded",
+                   blen);
+    if (len < ETHER_REQUEST_SIZE) sim_unescape(body, req+len, ETHER_REQUEST_SIZE-len);
+    len += blen;
+  } else {
+    len = snprintf(req, ETHER_REQUEST_SIZE, "%s HTTP/1.1\r\n\r\n", cmd);
+  }
+  sim_print_time();
+  fprintf(sim_out, "%s\n", cmd);
+  sim_requests++;
+  if (len >= ETHER_REQUEST_SIZE) {
+    fprintf(sim_out, "request too long\n");
+    return;
+  }
+
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+    DEBUG_PRINTLN("can't create socket pair");
+    return;
+  }
+  SimCapture cap;
+  pthread_t tid;
+  if (!sim_capture(&cap, fds[1], &tid)) {
+    close(fds[0]);
+    close(fds[1]);
+    return;
+  }
+  {
+    EthernetClient client(fds[0]);  // closed once the response is sent
+    m_client = &client;
+    handle_web_request(req);
+    m_client = 0;
+  }
+  pthread_join(tid, NULL);
+  close(fds[1]);
+
+  char *body = strstr(cap.buf, "\r\n\r\n");
+  body = body ? body+4 : cap.buf;
+  len = strlen(body);
+  fprintf(sim_out, "%s%s", body, (len && body[len-1]=='\n') ? "" : "\n");
+  free(cap.buf);
+}
+
+/** Record the responses received on a connection, with their status
+ * lines and headers (\r\n as \n), each body ending a line */
+static void sim_record_responses(char *p) {
+  while (*p) {
+    char *hdr_end = strstr(p, "\r\n\r\n");
+    if (!hdr_end) {
+      fprintf(sim_out, "%s\n", p);  // cut off
+      return;
+    }
+    *hdr_end = 0;
+    char *v = strcasestr(p, "\r\nContent-Length:");
+    size_t body_len = v ? strtoul(v+17, NULL, 10) :
+                      (!strncmp(p+8, " 304", 4) || !strncmp(p+8, " 204", 4)) ? 0 : strlen(hdr_end+4);
+    for (; *p; p++) {
+      if (*p != '\r') fputc(*p, sim_out);
+    }
+    fprintf(sim_out, "\n\n");
+    p = hdr_end+4;
+    if (body_len > strlen(p)) body_len = strlen(p);
+    fwrite(p, 1, body_len, sim_out);
+    if (body_len && p[body_len-1] != '\n') fputc('\n', sim_out);
+    p += body_len;
+  }
+}
+
+/** Send raw bytes (send line) to the http server on a new connection
+ * The server reads and answers them as it does on the network, with
+ * keep-alive, pipelining and framing. Once it closes the connection (the
+ * end of the bytes is the end of what the client sends), the responses
+ * are recorded in full.
+ */
+static void sim_send(const char *cmd) {
+  static EthernetServer *server = NULL;
+  if (!server) {
+    server = new EthernetServer(0);  // no listen socket, connections come from here
+    if (!server->begin()) {
+      DEBUG_PRINTLN("can't start the http server");
+      delete server;
+      server = NULL;
+      return;
+    }
+  }
+  char *req = sim_request_buffer();
+  if (!req) return;
+  sim_print_time();
+  fprintf(sim_out, "%s\n", cmd);
+  sim_requests++;
+
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+    DEBUG_PRINTLN("can't create socket pair");
+    return;
+  }
+  int len = sim_unescape(cmd+5, req, ETHER_REQUEST_SIZE);
+  if (write(fds[1], req, len) != len) DEBUG_PRINTLN("can't send the request");
+  shutdown(fds[1], SHUT_WR);
+  SimCapture cap;
+  pthread_t tid;
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  if (!sim_capture(&cap, fds[1], &tid)) {
+    close(fds[0]);
+    close(fds[1]);
+    return;
+  }
+  server->adopt(fds[0]);
+  // the clock does not move here, so the server's timeouts do not either:
+  // a connection that stays open with nothing to do is given up on
+  int idle = 0;
+  while (!__atomic_load_n(&cap.done, __ATOMIC_ACQUIRE)) {
+    EthernetClient client = server->available(10);
+    if (!client) {
+      if (++idle == 100) shutdown(fds[1], SHUT_RDWR);
+      continue;
+    }
+    idle = 0;
+    int n = client.read((uint8_t*) req, ETHER_REQUEST_SIZE-1);
+    if (n <= 0) continue;
+    req[n] = 0;
+    m_client = &client;
+    handle_web_request(req);
+    m_client = 0;
+  }
+  pthread_join(tid, NULL);
+  close(fds[1]);
+  sim_record_responses(cap.buf);
+  free(cap.buf);
+}
+
+/** Wait of the main loop in a simulation
+ * Moves the clock to t (utc), the next scheduler event, or to the next
+ * scripted line if that comes first, and runs the lines that are due.
+ * With t 0 the clock stays. True if a request was served.
+ */
+bool sim_wait(time_t t) {
+  sim_passes++;
+  sim_record_bits();  // switched by the last pass
+
+  time_t curr = now();
+  if (t) {
+    // a deadline that has passed is met a second later, as with the wall clock
+    time_t target = (t > curr) ? t : curr+1;
+    if (sim_next < sim_events.size() && sim_events[sim_next].t < target) target = sim_events[sim_next].t;
+    if (target >= sim_stop) {
+      target = sim_stop;
+      sim_finished = true;
+    }
+    if (target > curr) clock_set(target);
+  }
+
+  bool ran = false;
+  while (sim_next < sim_events.size() && sim_events[sim_next].t <= now()) {
+    const char *cmd = sim_events[sim_next++].line;
+    if (!strncmp(cmd, "weather ", 8)) {
+      sim_weather_resp = strcmp(cmd+8, "none") ? cmd+8 : NULL;
+    } else if (!strncmp(cmd, "send ", 5)) {
+      sim_send(cmd);
+      ran = true;
+    } else {
+      sim_request(cmd);
+      ran = true;
+    }
+  }
+  return ran;
+}
+
+/** The weather service response at this time, false if there is none */
+bool sim_weather(char *buf, int size) {
+  if (!sim_weather_resp) return false;
+  strncpy(buf, sim_weather_resp, size-1);
+  buf[size-1] = 0;
+  return true;
+}
+
+/** Finish the record, and report the time the simulation took */
+void sim_end() {
+  if (!sim) return;
+  sim_record_bits();
+  struct timespec wall;
+  clock_gettime(CLOCK_MONOTONIC, &wall);
+  double secs = (wall.tv_sec - sim_wall.tv_sec) + (wall.tv_nsec - sim_wall.tv_nsec) / 1e9;
+  double span = sim_stop - sim_start;
+  fprintf(stderr, "simulated %.1f days in %.3f s (%.0fx real time): %lu passes, %lu station switches, %lu requests\n",
+          span/86400, secs, secs > 0 ? span/secs : 0, sim_passes, sim_switches, sim_requests);
+  if (sim_out == stdout) fflush(sim_out);
+  else fclose(sim_out);
+}
@@ -0,0 +1,36 @@
+/* OpenHome Firmware
+ * Copyright (C) 2015 by Charles Remeikas
+ *
+ * Simulation functions header file
+ *
+ * This file is part of the OpenHome library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _SIM_H
+#define _SIM_H
+
+#include <time.h>
+
+bool sim_begin(const char *script, const char *out);
+bool sim_active();
+bool sim_wait(time_t t);
+bool sim_done();
+void sim_end();
+bool sim_weather(char *buf, int size);
+
+#endif  // _SIM_H
@@ -0,0 +1,312 @@
+#!/bin/bash
+# Regression tests, run in the simulation mode (see sim.cpp): each test
+# writes a script, runs it against an empty data directory, and checks
+# the record of requests and responses.
+# Usage: tests/run.sh [path/to/OpenHome]   (built with ./build.sh demo)
+
+BIN=$(realpath "${1:-./OpenHome}")
+T=$(mktemp -d)
+trap 'rm -rf "$T"' EXIT
+fail=0
+
+# run the script $T/$1.sim, its record goes to $T/$1.out
+# (in an empty data directory, unless $2 is "keep")
+run() {
+  [ "$2" == keep ] || { rm -rf "$T/data" && mkdir "$T/data"; }
+  (cd "$T/data" && "$BIN" -S "$T/$1.sim" -o "$T/$1.out" >/dev/null 2>&1)
+}
+
+# in the record of test $1, the response to the request for $2 matches
+# the regex $3; $4 says what that shows
+check() {
+  if grep -A1 -E " (GET|POST) $2" "$T/$1.out" | tail -1 | grep -qE -- "$3"; then
+    echo "ok   $1: $4"
+  else
+    echo "FAIL $1: $4"
+    fail=1
+  fi
+}
+
+# the station switches in the record of test $1 are the lines of $2
+check_switches() {
+  if diff <(grep ' station ' "$T/$1.out") <(printf "$2") >/dev/null; then
+    echo "ok   $1: $3"
+  else
+    echo "FAIL $1: $3"
+    fail=1
+  fi
+}
+
+# a program run on the virtual clock: it starts at its start time, the
+# record is the same each time the script runs
+name=sim_clock
+cat > "$T/$name.sim" <<EOF
+start 2024-04-01 00:00
+end 1d
+0 GET /co?pw=Undine12&o1=48
+1 GET /cp?pw=Undine12&pid=-1&v=[1,127,0,[360,0,0,0],[60,120]]&name=Morning
+EOF
+run $name
+check_switches $name "2024-04-01 06:00:01 station 1 on
+2024-04-01 06:01:01 station 1 off
+2024-04-01 06:01:01 station 2 on
+2024-04-01 06:03:01 station 2 off\n" "the program runs at 06:00, on the virtual clock"
+cp "$T/$name.out" "$T/$name.first"
+run $name
+if cmp -s "$T/$name.out" "$T/$name.first"; then
+  echo "ok   $name: the record is the same on a second run"
+else
+  echo "FAIL $name: the record is the same on a second run"
+  fail=1
+fi
+
+# a /cs query setting every station name and attribute of $1 stations
+cs_query() {
+  local n=$1 b=$(($1/8)) q="pw=Undine12" i
+  for ((i=0;i<n;i++)); do q+="&s$i=Back%20yard%20drip%20Z$((i+1))"; done
+  for k in m i n d q p; do
+    for ((i=0;i<b-1;i++)); do q+="&$k$i=0"; done
+  done
+  # the last board: ignore rain on its first and last station
+  for k in m n d p; do q+="&$k$((b-1))=0"; done
+  echo "$q&i$((b-1))=129&q$((b-1))=255"
+}
+
+# one /cs with all the names and attributes of 168, 328 and 2048 stations
+# (the last one about 80 KB, several times the response buffer)
+for n in 168 328 2048; do
+  name=cs_full_$n
+  cat > "$T/$name.sim" <<EOF
+end 1m
+0 GET /co?pw=Undine12&o15=$((n/8-1))
+1 GET /cs?$(cs_query $n)
+2 GET /jn?pw=Undine12
+EOF
+  run $name
+  check $name /cs '^\{"result":1\}' "/cs accepted"
+  check $name /jn "\"Back yard drip Z$((n-1))\",\"Back yard drip Z$n\"\]" "last station names saved"
+  check $name /jn '"ignore_rain":\[(0,)+129\]' "attributes of the last board saved"
+done
+
+# lists shorter than the station count: the stations left out get no
+# water time, rather than what the request buffer held from before
+name=short_lists
+cat > "$T/$name.sim" <<EOF
+end 2m
+0 GET /co?pw=Undine12&o15=20
+1 GET /cs?$(cs_query 168)
+2 GET /cp?pw=Undine12&pid=-1&v=[1,127,0,[480,0,0,0],[60,0,0,0,0,0,0,0]]&name=Short
+3 GET /jp?pw=Undine12
+4 GET /cr?pw=Undine12&t=[0,30]
+EOF
+run $name
+check $name /jp '"pd":\[\[1,127,0,\[480,0,0,0\],\[60(,0){167}\],"Short"\]\]' "/cp durations past the list are 0"
+check $name /cr '^\{"result":1\}' "/cr accepted"
+if [ "$(grep -c ' station .* on$' "$T/$name.out")" == 1 ] && grep -q ' station 2 on$' "$T/$name.out"; then
+  echo "ok   $name: /cr runs only the station it lists"
+else
+  echo "FAIL $name: /cr runs only the station it lists"
+  fail=1
+fi
+
+# a program modified until most of the program file is superseded: the
+# file is compacted (in the background), and reads back after a restart
+name=compaction
+{
+  echo "end 1m"
+  echo "0 GET /co?pw=Undine12&o15=20"
+  echo "1 GET /cp?pw=Undine12&pid=-1&v=[1,127,0,[480,0,0,0],[60]]&name=M0"
+  for ((i=1;i<=500;i++)); do
+    echo "2 GET /cp?pw=Undine12&pid=0&v=[1,127,0,[480,0,0,0],[60]]&name=M$i"
+  done
+} > "$T/$name.sim"
+run $name
+printf 'end 1m\n0 GET /jp?pw=Undine12\n' > "$T/$name-reload.sim"
+run $name-reload keep
+if [ "$(stat -c %s "$T/data/progs.dat")" -lt 4096 ] && [ ! -e "$T/data/progs.dat.tmp" ]; then
+  echo "ok   $name: program file compacted"
+else
+  echo "FAIL $name: program file compacted"
+  fail=1
+fi
+check $name-reload /jp '"nprogs":1,.*,"M500"\]\]' "the last change survives a restart"
+
+# /ep reads a program and writes it back: its durations come through,
+# also after the durations table grew with the station count
+name=program_read
+durs=$(for ((i=0;i<168;i++)); do echo -n "$((i%59+1)),"; done)
+durs=${durs%,}
+cat > "$T/$name.sim" <<EOF
+end 1m
+0 GET /co?pw=Undine12&o15=20
+1 GET /cp?pw=Undine12&pid=-1&v=[1,127,0,[480,0,0,0],[$durs]]&name=Read
+2 GET /ep?pw=Undine12&pid=0&en=0
+3 GET /co?pw=Undine12&o15=40
+4 GET /ep?pw=Undine12&pid=0&en=1
+5 GET /jp?pw=Undine12
+EOF
+run $name
+check $name /jp "\"pd\":\[\[1,127,0,\[480,0,0,0\],\[$durs(,0){160}\],\"Read\"\]\]" "durations kept by /ep"
+
+# programs changed, moved and deleted after the schedule is running:
+# each one keeps its own start times, and one relative to sunrise
+# moves with it
+name=program_changes
+cat > "$T/$name.sim" <<EOF
+start 2024-04-01 00:00
+end 2d
+0 weather &sunrise=600&sunset=1200
+0 GET /co?pw=Undine12&o1=48
+1 GET /cp?pw=Undine12&pid=-1&v=[1,127,0,[360,0,0,0],[60]]&name=A
+1 GET /cp?pw=Undine12&pid=-1&v=[1,127,0,[420,0,0,0],[0,60]]&name=B
+1 GET /cp?pw=Undine12&pid=-1&v=[1,127,0,[480,0,0,0],[0,0,60]]&name=C
+1 GET /cp?pw=Undine12&pid=-1&v=[1,127,0,[16444,0,0,0],[0,0,0,0,60]]&name=Sun
+2m GET /cp?pw=Undine12&pid=0&v=[1,127,0,[390,0,0,0],[60]]&name=A
+3m GET /up?pw=Undine12&pid=2
+4m GET /dp?pw=Undine12&pid=0
+5m GET /cp?pw=Undine12&pid=-1&v=[1,127,0,[540,0,0,0],[0,0,0,60]]&name=D
+6m GET /ep?pw=Undine12&pid=0&en=0
+20h weather &sunrise=720&sunset=1200
+EOF
+run $name
+check_switches $name "2024-04-01 07:00:01 station 2 on
+2024-04-01 07:01:01 station 2 off
+2024-04-01 09:00:01 station 4 on
+2024-04-01 09:01:01 station 4 off
+2024-04-01 11:00:01 station 5 on
+2024-04-01 11:01:01 station 5 off
+2024-04-02 07:00:01 station 2 on
+2024-04-02 07:01:01 station 2 off
+2024-04-02 09:00:01 station 4 on
+2024-04-02 09:01:01 station 4 off
+2024-04-02 13:00:01 station 5 on
+2024-04-02 13:01:01 station 5 off\n" "B, D and Sun run, at their times after the changes"
+
+# a batch whose last command fails: none of its changes to programs,
+# station names, options and weather options stays, also after a restart
+name=batch_rollback
+cat > "$T/$name.sim" <<EOF
+end 1m
+0 GET /co?pw=Undine12&wto="scale":80
+0 GET /cs?pw=Undine12&s0=Front
+0 GET /cp?pw=Undine12&pid=-1&v=[1,127,0,[480,0,0,0],[60]]&name=Keep
+1 POST /cb?pw=Undine12 cp?pid=0&v=[1,127,0,[480,0,0,0],[30]]&name=Changed\ncp?pid=-1&v=[1,127,0,[600,0,0,0],[60]]&name=New\ncs?s0=Back\nco?wto="scale":50&o1=48\ndp?pid=9
+2 GET /jp?pw=Undine12
+2 GET /jn?pw=Undine12
+2 GET /jo?pw=Undine12
+EOF
+run $name
+printf 'end 1m\n0 GET /ja?pw=Undine12\n' > "$T/$name-reload.sim"
+run $name-reload keep
+check $name /cb '^\{"result":17,"ops":\[1,1,1,1,17\]\}' "the failing command fails the batch"
+check $name /jp '"nprogs":1,.*\[60(,0){7}\],"Keep"\]\]' "program changes undone"
+check $name /jn '"snames":\["Front",' "station name change undone"
+check $name /jo '"tz":28,' "option change undone"
+check $name-reload /ja '"wto":\{"scale":80\}.*"nprogs":1,.*"snames":\["Front",' "the files are as before, after a restart"
+
+# nvm.dat holds two generations; with the newer one corrupted (a commit
+# torn by a power cut), the older one is loaded, and the next commit
+# writes a good slot again
+name=nvm_slots
+printf 'end 1m\n0 GET /co?pw=Undine12&o1=48\n1 GET /co?pw=Undine12&o1=52\n' > "$T/$name.sim"
+run $name
+nvm="$T/data/nvm.dat"
+slot=$(($(stat -c %s "$nvm")/2))   # header and image
+g0=$(od -A n -t u4 -j 4 -N 4 "$nvm")
+g1=$(od -A n -t u4 -j $((slot+4)) -N 4 "$nvm")
+pos=$(( (g1 > g0 ? slot : 0) + 16 + 100 ))   # a byte of the newer image
+b=$(od -A n -t u1 -j $pos -N 1 "$nvm")
+printf "\\x$(printf %02x $((b ^ 255)))" | dd of="$nvm" bs=1 seek=$pos conv=notrunc 2>/dev/null
+printf 'end 1m\n0 GET /jo?pw=Undine12\n1 GET /co?pw=Undine12&o1=56\n' > "$T/$name-torn.sim"
+run $name-torn keep
+printf 'end 1m\n0 GET /jo?pw=Undine12\n' > "$T/$name-reload.sim"
+run $name-reload keep
+check $name-torn /jo '"tz":48,' "the older generation is loaded"
+check $name-reload /jo '"tz":56,' "a change after that is kept"
+
+# the Connection headers and the first json keys of the responses to the
+# $2-th request line in the record of test $1
+responses() {
+  awk -v k=$2 '/^[0-9-]+ [0-9:]+ /{n++; next}
+    n==k && /^Connection:/{printf "%s ", $2}
+    n==k && /^\{"/{split($0, a, "\""); printf "%s ", a[2]}' "$T/$1.out"
+}
+
+# pipelined requests on a kept-alive connection are answered in order,
+# until one asks to close it; HTTP/1.0 closes after each response
+name=pipelining
+cat > "$T/$name.sim" <<EOF
+end 1m
+0 send GET /jo?pw=Undine12 HTTP/1.1\r\n\r\nGET /jn?pw=Undine12 HTTP/1.1\r\n\r\nGET /jc?pw=Undine12 HTTP/1.1\r\nConnection: close\r\n\r\nGET /jp?pw=Undine12 HTTP/1.1\r\n\r\n
+1 send GET /jo?pw=Undine12 HTTP/1.0\r\n\r\nGET /jn?pw=Undine12 HTTP/1.0\r\n\r\n
+EOF
+run $name
+if [ "$(responses $name 1)" == "keep-alive fwv keep-alive masop close devt " ]; then
+  echo "ok   $name: three responses in order on one connection, the last closes it"
+else
+  echo "FAIL $name: three responses in order on one connection, the last closes it"
+  fail=1
+fi
+if [ "$(responses $name 2)" == "close fwv " ]; then
+  echo "ok   $name: HTTP/1.0 gets one response"
+else
+  echo "FAIL $name: HTTP/1.0 gets one response"
+  fail=1
+fi
+
+# the run queue: sequential stations (1-4) run one after another, also
+# when a second program adds one while the first still runs; parallel
+# stations (5-8) start right away, a second apart
+name=queue_order
+cat > "$T/$name.sim" <<EOF
+start 2024-04-01 00:00
+end 1d
+0 GET /co?pw=Undine12&o1=48
+0 GET /cs?pw=Undine12&q0=15
+1 GET /cp?pw=Undine12&pid=-1&v=[1,127,0,[360,0,0,0],[60,60,60,0,60,120,0,0]]&name=First
+1 GET /cp?pw=Undine12&pid=-1&v=[1,127,0,[361,0,0,0],[0,0,0,30,0,0,120,0]]&name=Second
+EOF
+run $name
+check_switches $name "2024-04-01 06:00:01 station 1 on
+2024-04-01 06:00:01 station 5 on
+2024-04-01 06:00:02 station 6 on
+2024-04-01 06:01:01 station 1 off
+2024-04-01 06:01:01 station 2 on
+2024-04-01 06:01:01 station 5 off
+2024-04-01 06:01:01 station 7 on
+2024-04-01 06:02:01 station 2 off
+2024-04-01 06:02:01 station 3 on
+2024-04-01 06:02:02 station 6 off
+2024-04-01 06:03:01 station 3 off
+2024-04-01 06:03:01 station 4 on
+2024-04-01 06:03:01 station 7 off
+2024-04-01 06:03:31 station 4 off\n" "sequential stations queue up, parallel ones do not"
+
+# conditional requests: the tag of /jp, sent back in If-None-Match, gets
+# 304 until a program changes (the tag is the same in each run, as it
+# holds the simulated start time)
+name=etag
+cat > "$T/$name.sim" <<EOF
+start 2024-04-01 00:00
+end 1m
+0 send GET /jp?pw=Undine12 HTTP/1.1\r\nConnection: close\r\n\r\n
+EOF
+run $name
+tag=$(grep -m1 '^ETag: ' "$T/$name.out" | cut -d' ' -f2 | tr -d '\r')
+cat > "$T/$name.sim" <<EOF
+start 2024-04-01 00:00
+end 1m
+0 send GET /jp?pw=Undine12 HTTP/1.1\r\nIf-None-Match: $tag\r\nConnection: close\r\n\r\n
+1 GET /cp?pw=Undine12&pid=-1&v=[1,127,0,[360,0,0,0],[60]]&name=Morning
+2 send GET /jp?pw=Undine12 HTTP/1.1\r\nIf-None-Match: $tag\r\nConnection: close\r\n\r\n
+EOF
+run $name
+status=$(grep '^HTTP/1.1 ' "$T/$name.out" | cut -d' ' -f2 | tr '\n' ' ')
+if [ -n "$tag" ] && [ "$status" == "304 200 " ]; then
+  echo "ok   $name: 304 for the current tag, 200 once a program changed"
+else
+  echo "FAIL $name: 304 for the current tag, 200 once a program changed"
+  fail=1
+fi
+
+exit $fail
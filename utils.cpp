@@ -23,56 +23,303 @@
 
 #include "utils.h"
 #include "OpenHome.h"
+#include <fcntl.h>
 extern OpenHome os;
 
-void nvm_read_block(void *dst, const void *src, int len) {
-  FILE *fp = fopen(get_filename_fullpath(NVM_FILENAME), "rb");
-  if(fp) {
-    fseek(fp, (intptr_t)src, SEEK_SET);
-    fread(dst, 1, len, fp);
-    fclose(fp);
+/** RAM-resident NVM image
+ * nvm.dat is read into nvm_image once, on first access.
+ * Reads are served from RAM. Writes update RAM and extend the dirty range,
+ * which nvm_flush() commits to disk.
+ *
+ * nvm.dat holds two slots (A/B), each a header followed by a full image.
+ * A commit writes the inactive slot with the next generation number and
+ * a crc of the image, then calls fdatasync once. At boot the valid slot
+ * with the highest generation wins, so a commit torn by a power cut falls
+ * back to the previous generation instead of a factory reset.
+ *
+ * Slots written by firmware with a smaller image (NVM_LEGACY_SIZE) are
+ * still loaded: the image is zero-extended, and the first commit goes to
+ * slot B at its new place, past the end of the old file.
+ */
+#define NVM_SLOT_MAGIC  0x564E484FUL  // "OHNV"
+
+struct NVMSlotHeader {
+  uint32_t magic;
+  uint32_t generation;
+  uint32_t crc;
+  uint32_t size;
+};
+
+#define NVM_SLOT_SIZE   (sizeof(NVMSlotHeader)+NVM_SIZE)
+
+static byte nvm_image[NVM_SIZE];
+static int  nvm_fd = -1;
+static bool nvm_loaded = false;
+static int  nvm_dirty_start = NVM_SIZE; // dirty range is [nvm_dirty_start, nvm_dirty_end)
+static int  nvm_dirty_end = 0;
+static int  nvm_prev_start = 0;         // range written by the previous commit,
+static int  nvm_prev_end = NVM_SIZE;    // which the inactive slot still lacks
+static ulong nvm_dirty_ms;              // time (millis) when the image first became dirty
+static byte nvm_active = 1;             // slot holding the current generation
+static uint32_t nvm_generation = 0;
+static int  nvm_loaded_size = 0;        // size of the image found in nvm.dat
+static byte nvm_txn_depth = 0;          // nesting depth of nvm_begin/nvm_commit
+
+NVMStats nvm_stats;
+ulong nvm_flush_interval = NVM_FLUSH_INTERVAL;
+
+/** Standard (IEEE 802.3) crc32 */
+uint32_t crc32(const byte *buf, int len, uint32_t crc) {
+  static uint32_t table[256];
+  if(!table[1]) {
+    for(uint32_t i=0;i<256;i++) {
+      uint32_t c = i;
+      for(byte k=0;k<8;k++) c = (c&1) ? (0xEDB88320UL^(c>>1)) : (c>>1);
+      table[i] = c;
+    }
   }
+  crc = ~crc;
+  while(len--) crc = table[(crc^*buf++)&0xff]^(crc>>8);
+  return ~crc;
 }
 
-void nvm_write_block(const void *src, void *dst, int len) {
-  FILE *fp = fopen(get_filename_fullpath(NVM_FILENAME), "rb+");
-  if(!fp) {
-    fp = fopen(get_filename_fullpath(NVM_FILENAME), "wb");
+/** Read the slot at file offset pos into buf, returns true if the slot is valid
+ * size receives the image size the slot was written with, the rest of buf is zeroed */
+static bool nvm_load_slot(off_t pos, byte *buf, uint32_t *generation, int *size) {
+  NVMSlotHeader hdr;
+  nvm_stats.syscalls+=2;
+  if(pread(nvm_fd, &hdr, sizeof(hdr), pos) != sizeof(hdr)) return false;
+  if(hdr.magic != NVM_SLOT_MAGIC || (hdr.size != NVM_SIZE && hdr.size != NVM_LEGACY_SIZE)) return false;
+  if(pread(nvm_fd, buf, hdr.size, pos+sizeof(hdr)) != (ssize_t)hdr.size) return false;
+  if(crc32(buf, hdr.size) != hdr.crc) return false;
+  memset(buf+hdr.size, 0, NVM_SIZE-hdr.size);
+  *generation = hdr.generation;
+  *size = hdr.size;
+  return true;
+}
+
+/** Load nvm.dat into the RAM image */
+static void nvm_load() {
+  if(nvm_loaded) return;
+  nvm_loaded = true;
+  memset(nvm_image, 0, NVM_SIZE);
+  nvm_fd = open(get_filename_fullpath(NVM_FILENAME), O_RDWR|O_CREAT, 0644);
+  nvm_stats.syscalls++;
+  if(nvm_fd < 0) {
+    DEBUG_PRINTLN("can't open nvm file");
+    return;
   }
-  if(fp) {
-    fseek(fp, (intptr_t)dst, SEEK_SET);
-    fwrite(src, 1, len, fp);
-    fclose(fp);
+
+  byte other[NVM_SIZE];
+  uint32_t gen0, gen1;
+  int size0, size1;
+  bool valid0 = nvm_load_slot(0, nvm_image, &gen0, &size0);
+  bool valid1 = nvm_load_slot(NVM_SLOT_SIZE, other, &gen1, &size1);
+  if(!valid1) valid1 = nvm_load_slot(sizeof(NVMSlotHeader)+NVM_LEGACY_SIZE, other, &gen1, &size1);
+  if(valid1 && (!valid0 || (int32_t)(gen1-gen0) > 0)) {
+    memcpy(nvm_image, other, NVM_SIZE);
+    nvm_active = 1;
+    nvm_generation = gen1;
+    nvm_loaded_size = size1;
+  } else if(valid0) {
+    nvm_active = 0;
+    nvm_generation = gen0;
+    nvm_loaded_size = size0;
   } else {
-    // file does not exist
+    uint32_t magic = 0;
+    memset(nvm_image, 0, NVM_SIZE);
+    nvm_stats.syscalls++;
+    pread(nvm_fd, &magic, sizeof(magic), 0);
+    if(magic != NVM_SLOT_MAGIC) {
+      // legacy raw image (or a new file): import it. The first commit
+      // goes to slot B, so the raw image survives until that succeeds
+      nvm_stats.syscalls++;
+      ssize_t n = pread(nvm_fd, nvm_image, NVM_SIZE, 0);
+      if(n < 0) {
+        memset(nvm_image, 0, NVM_SIZE);
+        n = 0;
+      }
+      nvm_loaded_size = n;
+      nvm_active = 0;
+      nvm_dirty_start = 0;
+      nvm_dirty_end = NVM_SIZE;
+      nvm_dirty_ms = millis();
+    } else {
+      // neither slot survived: start from a blank image,
+      // options_setup then performs a factory reset
+      DEBUG_PRINTLN("nvm file corrupted");
+    }
+  }
+  if(nvm_loaded_size > 0 && nvm_loaded_size < NVM_SIZE) {
+    // grown image: write it in full, to slot B at its new place first,
+    // since slot A at the start of the file overlaps the old slot B
+    nvm_active = 0;
+    nvm_dirty_start = 0;
+    nvm_dirty_end = NVM_SIZE;
+    nvm_dirty_ms = millis();
   }
+  // the other slot is either older or broken, rewrite it in full next time
+  nvm_prev_start = 0;
+  nvm_prev_end = NVM_SIZE;
 }
 
-byte nvm_read_byte(const byte *p) {
-  FILE *fp = fopen(get_filename_fullpath(NVM_FILENAME), "rb");
-  byte v = 0;
-  if(fp) {
-    fseek(fp, (intptr_t)p, SEEK_SET);
-    fread(&v, 1, 1, fp);
-    fclose(fp);
-  } else {
-   // file does not exist
+/** Clip an nvm access to the image size, returns the usable length */
+static int nvm_clip(intptr_t addr, int len) {
+  if(addr < 0 || addr >= NVM_SIZE || len <= 0) return 0;
+  return (addr+len > NVM_SIZE) ? (NVM_SIZE-(int)addr) : len;
+}
+
+/** Mark an image range as dirty and commit it if write-through is selected */
+static void nvm_mark_dirty(int start, int end) {
+  if(nvm_dirty_start >= nvm_dirty_end) nvm_dirty_ms = millis();
+  if(start < nvm_dirty_start) nvm_dirty_start = start;
+  if(end > nvm_dirty_end) nvm_dirty_end = end;
+  if(!nvm_flush_interval && !nvm_txn_depth) nvm_flush();
+}
+
+/** Commit the image to the inactive slot as a new generation */
+void nvm_flush() {
+  if(nvm_dirty_start >= nvm_dirty_end) return;
+  if(nvm_fd < 0) return;
+
+  // the inactive slot holds the generation before the active one,
+  // so it is missing both the previous commit and the current changes
+  int start = (nvm_prev_start < nvm_dirty_start) ? nvm_prev_start : nvm_dirty_start;
+  int end = (nvm_prev_end > nvm_dirty_end) ? nvm_prev_end : nvm_dirty_end;
+  byte slot = 1-nvm_active;
+  off_t base = (off_t)slot*NVM_SLOT_SIZE;
+
+  NVMSlotHeader hdr;
+  hdr.magic = NVM_SLOT_MAGIC;
+  hdr.generation = nvm_generation+1;
+  hdr.crc = crc32(nvm_image, NVM_SIZE);
+  hdr.size = NVM_SIZE;
+
+  // data first, header last: a torn write leaves a crc mismatch
+  // and the slot is ignored at boot
+  nvm_stats.syscalls+=3;
+  if(pwrite(nvm_fd, nvm_image+start, end-start, base+sizeof(hdr)+start) != end-start ||
+     pwrite(nvm_fd, &hdr, sizeof(hdr), base) != sizeof(hdr) ||
+     fdatasync(nvm_fd) != 0) {
+    DEBUG_PRINTLN("nvm commit failed");
+    // the slot may be half written, rewrite it in full next time
+    nvm_prev_start = 0;
+    nvm_prev_end = NVM_SIZE;
+    return;
   }
-  return v;
+  nvm_stats.flushes++;
+  nvm_active = slot;
+  nvm_generation = hdr.generation;
+  nvm_prev_start = nvm_dirty_start;
+  nvm_prev_end = nvm_dirty_end;
+  nvm_dirty_start = NVM_SIZE;
+  nvm_dirty_end = 0;
+}
+
+/** Commit once the image has been dirty for nvm_flush_interval seconds */
+void nvm_flush_check() {
+  if(nvm_txn_depth) return;
+  if(nvm_dirty_start >= nvm_dirty_end) return;
+  if(millis() - nvm_dirty_ms >= nvm_flush_interval*1000) nvm_flush();
+}
+
+/** Milliseconds until nvm_flush_check writes back, -1 if there is nothing to write */
+long nvm_flush_wait() {
+  if(nvm_txn_depth || nvm_dirty_start >= nvm_dirty_end) return -1;
+  ulong age = millis() - nvm_dirty_ms;
+  return (age >= nvm_flush_interval*1000) ? 0 : (long)(nvm_flush_interval*1000 - age);
+}
+
+/** Start an nvm transaction
+ * Writes made until the matching nvm_commit() go to disk
+ * together in a single generation. Transactions can be nested.
+ */
+void nvm_begin() {
+  nvm_load();
+  nvm_txn_depth++;
+}
+
+/** End an nvm transaction, the outermost one commits immediately */
+void nvm_commit() {
+  if(nvm_txn_depth) nvm_txn_depth--;
+  if(!nvm_txn_depth) nvm_flush();
+}
+
+/** Save the image, so the writes that follow can be undone
+ * Only meaningful inside a transaction, which keeps them from being committed */
+void nvm_savepoint(NVMSavepoint *sp) {
+  nvm_load();
+  memcpy(sp->image, nvm_image, NVM_SIZE);
+  sp->dirty_start = nvm_dirty_start;
+  sp->dirty_end = nvm_dirty_end;
+  sp->dirty_ms = nvm_dirty_ms;
+}
+
+/** Undo the writes made since a savepoint */
+void nvm_rollback(const NVMSavepoint *sp) {
+  memcpy(nvm_image, sp->image, NVM_SIZE);
+  nvm_dirty_start = sp->dirty_start;
+  nvm_dirty_end = sp->dirty_end;
+  nvm_dirty_ms = sp->dirty_ms;
+}
+
+/** Size of the image nvm.dat held when it was loaded
+ * Smaller than NVM_SIZE if it was written by older firmware */
+int nvm_get_loaded_size() {
+  nvm_load();
+  return nvm_loaded_size;
+}
+
+/** Generation number of the last commit */
+ulong nvm_get_generation() {
+  nvm_load();
+  return nvm_generation;
+}
+
+void nvm_read_block(void *dst, const void *src, int len) {
+  nvm_load();
+  // http workers read concurrently (under the state read lock)
+  __atomic_fetch_add(&nvm_stats.reads, 1, __ATOMIC_RELAXED);
+  int n = nvm_clip((intptr_t)src, len);
+  memcpy(dst, nvm_image+(intptr_t)src, n);
+}
+
+void nvm_write_block(const void *src, void *dst, int len) {
+  nvm_load();
+  nvm_stats.writes++;
+  int n = nvm_clip((intptr_t)dst, len);
+  if(!n) return;
+  memcpy(nvm_image+(intptr_t)dst, src, n);
+  nvm_mark_dirty((intptr_t)dst, (intptr_t)dst+n);
+}
+
+/** Copy the zero terminated string at src, at most size-1 bytes of it, into dst.
+ * Returns its length; size-1 means the string may go on */
+int nvm_read_string(char *dst, const void *src, int size) {
+  nvm_load();
+  __atomic_fetch_add(&nvm_stats.reads, 1, __ATOMIC_RELAXED);
+  int n = nvm_clip((intptr_t)src, size-1);
+  const char *s = (const char *)nvm_image+(intptr_t)src;
+  const char *end = (const char *)memchr(s, 0, n);
+  if (end) n = end-s;
+  memcpy(dst, s, n);
+  dst[n] = 0;
+  return n;
+}
+
+byte nvm_read_byte(const byte *p) {
+  nvm_load();
+  __atomic_fetch_add(&nvm_stats.reads, 1, __ATOMIC_RELAXED);
+  if(!nvm_clip((intptr_t)p, 1)) return 0;
+  return nvm_image[(intptr_t)p];
 }
 
 void nvm_write_byte(const byte *p, byte v) {
-  FILE *fp = fopen(get_filename_fullpath(NVM_FILENAME), "rb+");
-  if(!fp) {
-    fp = fopen(get_filename_fullpath(NVM_FILENAME), "wb");
-  }
-  if(fp) {
-    fseek(fp, (intptr_t)p, SEEK_SET);
-    fwrite(&v, 1, 1, fp);
-    fclose(fp);
-  } else {
-    // file does not exist
-  }
+  nvm_load();
+  nvm_stats.writes++;
+  if(!nvm_clip((intptr_t)p, 1)) return;
+  nvm_image[(intptr_t)p] = v;
+  nvm_mark_dirty((intptr_t)p, (intptr_t)p+1);
 }
 
 void write_to_file(const char *name, const char *data, int size, int pos, bool trunc) {
@@ -122,16 +369,24 @@ void remove_file(const char *name) {
   remove(get_filename_fullpath(name));
 }
 
+static char runtime_path[PATH_MAX];
+static byte runtime_query = 1;
+
+/** Keep the data files in dir (ending with '/') instead of next to the executable */
+void set_runtime_path(const char *dir) {
+  strncpy(runtime_path, dir, PATH_MAX-1);
+  runtime_query = 0;
+}
+
 char* get_runtime_path() {
-  static char path[PATH_MAX];
-  static byte query = 1;
+  char *path = runtime_path;
 
   #ifdef __APPLE__
     strcpy(path, "./");
     return path;
   #endif
 
-  if(query) {
+  if(runtime_query) {
     if(readlink("/proc/self/exe", path, PATH_MAX ) <= 0) {
       return NULL;
     }
@@ -141,13 +396,13 @@ char* get_runtime_path() {
     }
     path_end++;
     *path_end=0;
-    query = 0;
+    runtime_query = 0;
   }
   return path;
 }
 
 char* get_filename_fullpath(const char *filename) {
-  static char fullpath[PATH_MAX];
+  static thread_local char fullpath[PATH_MAX];
   strcpy(fullpath, get_runtime_path());
   strcat(fullpath, filename);
   return fullpath;
@@ -178,10 +433,41 @@ unsigned int detect_rpi_rev() {
 }
 #endif
 
+/** Clock of the controller
+ * Wall time normally; once clock_set() is called, a virtual clock that
+ * only moves when it is set again (see sim.cpp). Main loop only.
+ */
+static bool clock_virtual = false;
+static struct timespec clock_vts;
+
+void clock_set(time_t t, long nsec)
+{
+  clock_virtual = true;
+  clock_vts.tv_sec = t;
+  clock_vts.tv_nsec = nsec;
+}
+
+void clock_now(struct timespec *ts)
+{
+  if (clock_virtual) *ts = clock_vts;
+  else clock_gettime(CLOCK_REALTIME, ts);
+}
+
+time_t clock_time()
+{
+  return clock_virtual ? clock_vts.tv_sec : time(0);
+}
+
 void delay(ulong howLong)
 {
   struct timespec sleeper, dummy ;
 
+  if (clock_virtual) {  // the wait passes on the virtual clock
+    uint64_t ns = clock_vts.tv_nsec + (uint64_t)howLong * 1000000 ;
+    clock_set(clock_vts.tv_sec + ns / 1000000000, ns % 1000000000) ;
+    return ;
+  }
+
   sleeper.tv_sec  = (time_t)(howLong / 1000) ;
   sleeper.tv_nsec = (long)(howLong % 1000) * 1000000 ;
 
@@ -223,31 +509,31 @@ static uint64_t epochMilli, epochMicro ;
 
 void initialiseEpoch()
 {
-  struct timeval tv ;
+  struct timespec ts ;
 
-  gettimeofday (&tv, NULL) ;
-  epochMilli = (uint64_t)tv.tv_sec * (uint64_t)1000    + (uint64_t)(tv.tv_usec / 1000) ;
-  epochMicro = (uint64_t)tv.tv_sec * (uint64_t)1000000 + (uint64_t)(tv.tv_usec) ;
+  clock_now (&ts) ;
+  epochMilli = (uint64_t)ts.tv_sec * (uint64_t)1000    + (uint64_t)(ts.tv_nsec / 1000000) ;
+  epochMicro = (uint64_t)ts.tv_sec * (uint64_t)1000000 + (uint64_t)(ts.tv_nsec / 1000) ;
 }
 
 ulong millis (void)
 {
-  struct timeval tv ;
+  struct timespec ts ;
   uint64_t now ;
 
-  gettimeofday (&tv, NULL) ;
-  now  = (uint64_t)tv.tv_sec * (uint64_t)1000 + (uint64_t)(tv.tv_usec / 1000) ;
+  clock_now (&ts) ;
+  now  = (uint64_t)ts.tv_sec * (uint64_t)1000 + (uint64_t)(ts.tv_nsec / 1000000) ;
 
   return (uint32_t)(now - epochMilli) ;
 }
 
 ulong micros (void)
 {
-  struct timeval tv ;
+  struct timespec ts ;
   uint64_t now ;
 
-  gettimeofday (&tv, NULL) ;
-  now  = (uint64_t)tv.tv_sec * (uint64_t)1000000 + (uint64_t)tv.tv_usec ;
+  clock_now (&ts) ;
+  now  = (uint64_t)ts.tv_sec * (uint64_t)1000000 + (uint64_t)(ts.tv_nsec / 1000) ;
 
   return (uint32_t)(now - epochMicro) ;
 }
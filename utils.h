@@ -25,10 +25,29 @@
 #define _UTILS_H
 
 #include <stdio.h>
+#include <stdint.h>
 #include <limits.h>
 #include <sys/time.h>
 #include "defines.h"
 
+/** NVM access counters */
+struct NVMStats {
+  ulong reads;      // nvm_read_* calls
+  ulong writes;     // nvm_write_* calls
+  ulong flushes;    // generations committed to nvm.dat
+  ulong syscalls;   // file system calls made on nvm.dat
+};
+extern NVMStats nvm_stats;
+
+/** Saved nvm image, to undo the writes made since (see nvm_savepoint) */
+struct NVMSavepoint {
+  byte image[NVM_SIZE];
+  int dirty_start;
+  int dirty_end;
+  ulong dirty_ms;
+};
+extern ulong nvm_flush_interval; // seconds a dirty nvm image may stay in RAM, 0 means write-through
+
 void strncpy_P0(char* dest, const char* src, int n);
 byte strcmp_to_nvm(const char* src, int addr);
 byte water_time_encode(uint16_t i);
@@ -42,8 +61,20 @@ void remove_file(const char *name);
 void nvm_read_block(void *dst, const void *src, int len);
 void nvm_write_block(const void *src, void *dst, int len);
 byte nvm_read_byte(const byte *p);
+int nvm_read_string(char *dst, const void *src, int size);
 void nvm_write_byte(const byte *p, byte v);
+void nvm_flush();
+void nvm_flush_check();
+long nvm_flush_wait();
+void nvm_begin();
+void nvm_commit();
+void nvm_savepoint(NVMSavepoint *sp);
+void nvm_rollback(const NVMSavepoint *sp);
+ulong nvm_get_generation();
+int nvm_get_loaded_size();
+uint32_t crc32(const byte *buf, int len, uint32_t crc=0);
 char* get_runtime_path();
+void set_runtime_path(const char *dir);
 char* get_filename_fullpath(const char *filename);
 void delay(ulong ms);
 void delayMicroseconds(ulong us);
@@ -51,6 +82,9 @@ void delayMicrosecondsHard(ulong us);
 ulong millis();
 ulong micros();
 void initialiseEpoch();
+void clock_set(time_t t, long nsec=0);
+void clock_now(struct timespec *ts);
+time_t clock_time();
 #if defined(OSPI)
   unsigned int detect_rpi_rev();
 #endif
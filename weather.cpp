@@ -27,15 +27,16 @@
 #include <iostream>
 #include <netdb.h>
 
-extern char ether_buffer[];
+extern thread_local char ether_buffer[];
 extern const char wtopts_filename[];
 
 #include "OpenHome.h"
 #include "utils.h"
 #include "server.h"
+#include "sim.h"
 
 extern OpenHome os; // OpenHome object
-extern char tmp_buffer[];
+extern thread_local char tmp_buffer[];
 byte findKeyVal (const char *str,char *strbuf, uint8_t maxlen,const char *key,bool key_in_pgm=false,uint8_t *keyfound=NULL);
 void write_log(byte type, ulong curr_time);
 
@@ -103,6 +104,7 @@ static void getweather_callback(byte status, uint16_t off, uint16_t len) {
   }
 
   os.checkwt_success_lasttime = os.now_tz();
+  os.events |= EVENT_WEATHER;
   write_log(LOGDATA_WATERLEVEL, os.checkwt_success_lasttime);
 }
 
@@ -139,6 +141,12 @@ void GetWeather() {
   char * delim;
   struct hostent *server;
   
+  if (sim_active()) {
+    // simulated: the response comes from the script
+    if (sim_weather(ether_buffer, ETHER_BUFFER_SIZE)) getweather_callback(0, 0, ETHER_BUFFER_SIZE);
+    return;
+  }
+
   nvm_read_block(tmp_buffer, (void*)ADDR_NVM_WEATHERURL, MAX_WEATHERURL);
 
   // Check to see if url specifies a port number to use
@@ -170,7 +178,7 @@ void GetWeather() {
     return;
   }
 
-  BufferFiller bf = tmp_buffer;
+  BufferFiller bf(tmp_buffer, TMP_BUFFER_SIZE-12);  // room for the url encoding below
   char tmp[100];
   read_from_file(wtopts_filename, tmp, 100);
   bf.emit_p(PSTR("$D.py?loc=$E&key=$E&fwv=$D&wto=$S"),